@@ -48,6 +48,15 @@
 #endif
 #endif
 
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+/* header of a value sent by sendfile() goes in the same packet */
+#ifndef MSG_MORE
+# define MSG_MORE 0
+#endif
+
 /* FreeBSD 4.x doesn't have IOV_MAX exposed. */
 #ifndef IOV_MAX
 #if defined(__FreeBSD__) || defined(__APPLE__)
@@ -94,6 +103,7 @@ static void process_command(conn *c, char *command);
 static int transmit(conn *c);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
+static int add_file(conn *c, item *it);
 static int add_msghdr(conn *c);
 static void conn_free(conn *c);
 
@@ -121,6 +131,9 @@ static void stats_init(void) {
     stats.get_cmds = stats.set_cmds = stats.delete_cmds = 0;
     stats.slow_cmds = stats.get_hits = stats.get_misses = 0;
     stats.bytes_read = stats.bytes_written = 0;
+    stats.sendfile_gets = 0;
+    stats.sync_probes = 0;
+    stats.sync_probe_time = stats.sync_probe_max = 0;
 
     // 设置启动时间在2秒前
     /* make the time we started always be 2 seconds before we really
@@ -137,6 +150,9 @@ static void stats_reset(void) {
     stats.get_cmds = stats.set_cmds = stats.delete_cmds = 0;
     stats.slow_cmds = stats.get_hits = stats.get_misses = 0;
     stats.bytes_read = stats.bytes_written = 0;
+    stats.sendfile_gets = 0;
+    stats.sync_probes = 0;
+    stats.sync_probe_time = stats.sync_probe_max = 0;
     STATS_UNLOCK();
 }
 
@@ -151,7 +167,13 @@ static void settings_init(void) {
     settings.num_threads = 16;
     settings.flush_limit = 1024; // 1M
     settings.flush_period = 60 * 10; // 10 min
+    settings.snapshot_period = 60 * 10;
     settings.slow_cmd_time = 0.1; // 100ms
+    settings.sendfile_size = 128 * 1024;
+    settings.sendfile_crc = false;
+    settings.durable = false;
+    settings.commit_window = 1000; // 1ms
+    settings.commit_batch = 64;
 }
 
 /*
@@ -170,6 +192,10 @@ static int add_msghdr(conn *c)
         if (! msg)
             return -1;
         c->msglist = msg;
+        item **files = realloc(c->msgfile, c->msgsize * 2 * sizeof(item *));
+        if (! files)
+            return -1;
+        c->msgfile = files;
         c->msgsize *= 2;
     }
 
@@ -180,6 +206,7 @@ static int add_msghdr(conn *c)
     memset(msg, 0, sizeof(struct msghdr));
 
     msg->msg_iov = &c->iov[c->iovused];
+    c->msgfile[c->msgused] = NULL;
 
     c->msgbytes = 0;
     c->msgused++;
@@ -261,6 +288,7 @@ conn *conn_new(const int sfd, const int init_state, const int read_buffer_size)
         c->ilist = 0;
         c->iov = 0;
         c->msglist = 0;
+        c->msgfile = 0;
 
         c->rsize = read_buffer_size;
         c->wsize = DATA_BUFFER_SIZE;
@@ -273,9 +301,10 @@ conn *conn_new(const int sfd, const int init_state, const int read_buffer_size)
         c->ilist = (item **)malloc(sizeof(item *) * c->isize);
         c->iov = (struct iovec *)malloc(sizeof(struct iovec) * c->iovsize);
         c->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * c->msgsize);
+        c->msgfile = (item **)malloc(sizeof(item *) * c->msgsize);
 
         if (c->rbuf == 0 || c->wbuf == 0 || c->ilist == 0 || c->iov == 0 ||
-                c->msglist == 0) {
+                c->msglist == 0 || c->msgfile == 0) {
             conn_free(c);
             fprintf(stderr, "malloc()\n");
             return NULL;
@@ -358,6 +387,8 @@ void conn_free(conn *c) {
     if (c) {
         if (c->msglist)
             free(c->msglist);
+        if (c->msgfile)
+            free(c->msgfile);
         if (c->rbuf)
             free(c->rbuf);
         if (c->wbuf)
@@ -436,9 +467,12 @@ static void conn_shrink(conn *c) {
     }
 
     if (c->msgsize > MSG_LIST_HIGHWAT) {
-        struct msghdr *newbuf = (struct msghdr *) realloc((void *)c->msglist, MSG_LIST_INITIAL * sizeof(c->msglist[0]));
-        if (newbuf) {
-            c->msglist = newbuf;
+        item **newfiles = (item **) realloc((void *)c->msgfile, MSG_LIST_INITIAL * sizeof(c->msgfile[0]));
+        if (newfiles) {
+            struct msghdr *newbuf = (struct msghdr *) realloc((void *)c->msglist, MSG_LIST_INITIAL * sizeof(c->msglist[0]));
+            if (newbuf)
+                c->msglist = newbuf;
+            c->msgfile = newfiles;
             c->msgsize = MSG_LIST_INITIAL;
         }
     /* TODO check error condition? */
@@ -557,6 +591,21 @@ static int add_iov(conn *c, const void *buf, int len) {
     return 0;
 }
 
+/*
+ * Adds the suffix of an item whose value is in file, the value is sent by
+ * sendfile() after current msghdr, then the "\r\n" in a new one.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+static int add_file(conn *c, item *it) {
+    if (add_iov(c, ITEM_suffix(it), it->nsuffix) != 0)
+        return -1;
+    c->msgfile[c->msgused - 1] = it;
+    if (add_msghdr(c) != 0)
+        return -1;
+    return add_iov(c, ITEM_data(it), it->nbytes);
+}
+
 
 // 回显
 static void out_string(conn *c, const char *str) {
@@ -781,11 +830,15 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
     command = tokens[COMMAND_TOKEN].value;
 
     if (ntokens == 2 && strcmp(command, "stats") == 0) {
-        char temp[1024];
+        char temp[4096];
         pid_t pid = getpid();
         uint64_t total = 0, curr = 0, avail_space, total_space;
+        uint64_t index_allocated, index_used;
+        uint64_t commits, syncs, hist[COMMIT_HIST_SIZE];
+        bool durable = hs_commit_stat(store, &commits, &syncs, hist);
         total = hs_count(store, &curr);
         hs_stat(store, &total_space, &avail_space);
+        hs_index_stat(store, &index_allocated, &index_used);
         char *pos = temp;
 
 #ifndef WIN32
@@ -818,8 +871,27 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         pos += sprintf(pos, "STAT total_items %"PRIu64"\r\n", total);
         pos += sprintf(pos, "STAT avail_space %"PRIu64"\r\n", avail_space);
         pos += sprintf(pos, "STAT total_space %"PRIu64"\r\n", total_space);
+        pos += sprintf(pos, "STAT index_bytes_allocated %"PRIu64"\r\n", index_allocated);
+        pos += sprintf(pos, "STAT index_bytes_used %"PRIu64"\r\n", index_used);
+        pos += sprintf(pos, "STAT index_lock_max_us %"PRIu32"\r\n", hs_max_lock_hold(store));
+        pos += sprintf(pos, "STAT sync_probes %"PRIu64"\r\n", stats.sync_probes);
+        pos += sprintf(pos, "STAT sync_probe_avg_us %.0f\r\n",
+                stats.sync_probes > 0 ? stats.sync_probe_time * 1e6 / stats.sync_probes : 0);
+        pos += sprintf(pos, "STAT sync_probe_max_us %.0f\r\n", stats.sync_probe_max * 1e6);
         pos += sprintf(pos, "STAT bytes_read %"PRIu64"\r\n", stats.bytes_read);
         pos += sprintf(pos, "STAT bytes_written %"PRIu64"\r\n", stats.bytes_written);
+        pos += sprintf(pos, "STAT sendfile_gets %"PRIu64"\r\n", stats.sendfile_gets);
+        if (durable) {
+            int i;
+            pos += sprintf(pos, "STAT commits %"PRIu64"\r\n", commits);
+            pos += sprintf(pos, "STAT commit_syncs %"PRIu64"\r\n", syncs);
+            // SETs committed in less than the us
+            for (i=0; i<COMMIT_HIST_SIZE; i++) {
+                if (hist[i] > 0) {
+                    pos += sprintf(pos, "STAT commit_lt_%dus %"PRIu64"\r\n", 2 << i, hist[i]);
+                }
+            }
+        }
         pos += sprintf(pos, "STAT threads %d\r\n", settings.num_threads);
         pos += sprintf(pos, "END");
         STATS_UNLOCK();
@@ -849,6 +921,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
     int stats_get_cmds   = 0;
     int stats_get_hits   = 0;
     int stats_get_misses = 0;
+    int stats_sendfile_gets = 0;
     assert(c != NULL);
 
     do {
@@ -890,11 +963,13 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
                  *   "VALUE "
                  *   key
                  *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
+                 * or the data is sent from file if it->fd >= 0.
                  */
 
                 if (add_iov(c, "VALUE ", 6) != 0 ||
                    add_iov(c, ITEM_key(it), it->nkey) != 0 ||
-                   add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
+                   (it->fd >= 0 ? add_file(c, it) :
+                    add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes)) != 0)
                    {
                        item_free(it);
                        it = NULL;
@@ -905,6 +980,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
                     fprintf(stderr, ">%d sending key %s\n", c->sfd, ITEM_key(it));
 
                 stats_get_hits++;
+                if (it->fd >= 0) stats_sendfile_gets++;
                 *(c->ilist + i) = it;
                 i++;
 
@@ -949,6 +1025,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
     stats.get_cmds   += stats_get_cmds;
     stats.get_hits   += stats_get_hits;
     stats.get_misses += stats_get_misses;
+    stats.sendfile_gets += stats_sendfile_gets;
     STATS_UNLOCK();
 
     return;
@@ -1152,6 +1229,9 @@ static void process_command(conn *c, char *command) {
     clock_gettime(CLOCK_MONOTONIC, &start);
 
     ntokens = tokenize_command(command, tokens, MAX_TOKENS);
+    // tokens are overwritten by get of many keys
+    bool probe = ntokens >= 3 && tokens[KEY_TOKEN].value[0] == '@'
+        && strcmp(tokens[COMMAND_TOKEN].value, "get") == 0;
     if (ntokens >= 3 &&
         (strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ) {
 
@@ -1221,6 +1301,14 @@ static void process_command(conn *c, char *command) {
         stats.slow_cmds ++;
         STATS_UNLOCK();
     }
+    // hash tree probes from sync, should not be blocked by writes
+    if (probe) {
+        STATS_LOCK();
+        stats.sync_probes ++;
+        stats.sync_probe_time += secs;
+        if (secs > stats.sync_probe_max) stats.sync_probe_max = secs;
+        STATS_UNLOCK();
+    }
 
     // access logging
     if (NULL != access_log && ntokens >= 3) {
@@ -1342,7 +1430,38 @@ static bool update_event(conn *c, const int new_flags) {
 }
 
 /*
- * Transmit the next chunk of data from our list of msgbuf structures.
+ * Send the value of an item from its file, the return values are same as
+ * transmit().
+ */
+static int transmit_file(conn *c, item *it) {
+    ssize_t res = -1;
+#ifdef HAVE_SENDFILE
+    res = sendfile(c->sfd, it->fd, &it->foffset, it->fbytes);
+#else
+    errno = ENOSYS;
+#endif
+    if (res > 0) {
+        STATS_LOCK();
+        stats.bytes_written += res;
+        STATS_UNLOCK();
+        it->fbytes -= res;
+        return TRANSMIT_INCOMPLETE;
+    }
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        update_event(c, AE_WRITABLE);
+        return TRANSMIT_SOFT_ERROR;
+    }
+    /* the file is shorter than expected, or a real error */
+    if (settings.verbose > 0)
+        perror("Failed to sendfile, and not due to blocking");
+
+    conn_set_state(c, conn_closing);
+    return TRANSMIT_HARD_ERROR;
+}
+
+/*
+ * Transmit the next chunk of data from our list of msgbuf structures, or
+ * the value in file after it.
  *
  * Returns:
  *   TRANSMIT_COMPLETE   All done writing.
@@ -1354,15 +1473,22 @@ static int transmit(conn *c) {
     assert(c != NULL);
 
     if (c->msgcurr < c->msgused &&
-            c->msglist[c->msgcurr].msg_iovlen == 0) {
+            c->msglist[c->msgcurr].msg_iovlen == 0 &&
+            (c->msgfile[c->msgcurr] == NULL || c->msgfile[c->msgcurr]->fbytes == 0)) {
         /* Finished writing the current msg; advance to the next. */
         c->msgcurr++;
     }
     if (c->msgcurr < c->msgused) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
+        item *it = c->msgfile[c->msgcurr];
 
-        res = sendmsg(c->sfd, m, 0);
+        /* value in file is sent after the header */
+        if (m->msg_iovlen == 0 && it != NULL) {
+            return transmit_file(c, it);
+        }
+
+        res = sendmsg(c->sfd, m, it != NULL ? MSG_MORE : 0);
         if (res > 0) {
             STATS_LOCK();
             stats.bytes_written += res;
@@ -1749,7 +1875,23 @@ static void usage(void) {
            "-s <num>      slow command time limit, in ms, default is 100ms\n"
            "-f <num>      flush period, default is 600 secs\n"
            "-n <num>      flush limit(in KB), default is 1024 (KB)\n"
+           "-I <num>      period of saving HTree in background, default is 600 secs, 0 to disable\n"
            "-m <time>     serve data written before <time> (read-only)\n"
+           "-z <codecs>   compressor of values, qlz(default), lz4, zstd or none, and\n"
+           "              prefix=codec for keys with prefix, splitted by ','\n"
+           "-Z <file>     dictionary for zstd, trained by `zstd --train`\n"
+#ifdef HAVE_SENDFILE
+           "-F <num>      send values larger than <num> KB from file by sendfile(),\n"
+           "              default is 128 (KB), 0 to disable\n"
+           "-C            check crc32 of values before sendfile(), which reads them\n"
+           "              once more, from page cache when sending them\n"
+#endif
+           "-k <num>      keep digests of the latest values of <num> keys (96 to 192\n"
+           "              bytes each), to tell unchanged values without reading them,\n"
+           "              default 0\n"
+           "-D            durable, reply SETs after the records are synced to disk\n"
+           "-w <num>      group commit window of -D, in us, default is 1000 (us)\n"
+           "-B <num>      sync once <num> SETs are waiting with -D, default is 64\n"
            "-v            verbose (print errors/warnings while in event loop)\n"
            "-vv           very verbose (also print client commands/reponses)\n"
            "-h            print this help and exit\n"
@@ -1881,6 +2023,7 @@ void* do_flush(void *args)
 {
     while (!daemon_quit) {
         hs_flush(store, settings.flush_limit, settings.flush_period);
+        hs_snapshot(store, settings.snapshot_period);
         sleep(1);
     }
     fprintf(stderr, "flush thread exit.\n");
@@ -1911,7 +2054,7 @@ int main (int argc, char **argv) {
     setbuf(stderr, NULL);
 
     /* process arguments */
-    while ((c = getopt(argc, argv, "a:p:c:hivl:dru:P:L:t:b:H:T:m:s:f:n:S")) != -1) {
+    while ((c = getopt(argc, argv, "a:p:c:hivl:dru:P:L:t:b:H:T:m:s:f:n:I:z:Z:F:Ck:Dw:B:S")) != -1) {
         switch (c) {
         case 'a': // access_log
             if (strcmp(optarg, "-") == 0) {
@@ -1996,6 +2139,47 @@ int main (int argc, char **argv) {
         case 'n':
             settings.flush_limit = atoi(optarg);
             break;
+        case 'I':
+            settings.snapshot_period = atoi(optarg);
+            break;
+        case 'z':
+            if (hs_set_compressor(optarg) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Z':
+            if (hs_load_compress_dict(optarg) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+#ifdef HAVE_SENDFILE
+        case 'F':
+            settings.sendfile_size = atoi(optarg) * 1024;
+            break;
+        case 'C':
+            settings.sendfile_crc = true;
+            break;
+#else
+        case 'F':
+        case 'C':
+            fprintf(stderr, "sendfile() is not built in, -%c is not supported\n", c);
+            exit(EXIT_FAILURE);
+#endif
+        case 'k':
+            hs_set_digests(atoi(optarg));
+            break;
+        case 'D':
+            settings.durable = true;
+#ifndef HAVE_SYNCFS
+            fprintf(stderr, "Warning: syncfs() is not built in, -D will sync all the filesystems by sync()\n");
+#endif
+            break;
+        case 'w':
+            settings.commit_window = atoi(optarg);
+            break;
+        case 'B':
+            settings.commit_batch = atoi(optarg);
+            break;
         case 'm':
             {
                 char fmt[] = "%Y-%m-%d-%H:%M:%S";
@@ -2123,6 +2307,10 @@ int main (int argc, char **argv) {
         fprintf(stderr, "failed to open db %s\n", dbhome);
         exit(1);
     }
+    if (settings.durable && hs_group_commit(store, settings.commit_window,
+                settings.commit_batch) != 0) {
+        exit(1);
+    }
 
     if ((stub_fd = open("/dev/null", O_RDONLY)) == -1) {
         perror("open stub file failed");
@@ -113,6 +113,10 @@ struct stats {
     time_t        started;          /* when the process was started */
     uint64_t      bytes_read;
     uint64_t      bytes_written;
+    uint64_t      sendfile_gets;    /* values sent from data file */
+    uint64_t      sync_probes;      /* get @xxx from sync */
+    double        sync_probe_time;
+    float         sync_probe_max;
 };
 
 #define MAX_VERBOSITY_LEVEL 2
@@ -127,7 +131,13 @@ struct settings {
     float slow_cmd_time;
     int flush_period;
     int flush_limit;
+    int snapshot_period;    /* save HTree in background, in secs */
     int num_threads;        /* number of libevent threads to run */
+    int sendfile_size;      /* send values larger than it by sendfile(), 0 to disable */
+    bool sendfile_crc;      /* check crc of values before sendfile(), read twice */
+    bool durable;           /* reply SETs after their records are synced */
+    int commit_window;      /* group commit, in us */
+    int commit_batch;
 };
 
 extern struct stats stats;
@@ -139,6 +149,9 @@ typedef struct _stritem {
     int             nbytes;     /* size of data */
     uint8_t         nsuffix;    /* length of flags-and-length string */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
+    int             fd;         /* value is sent from fd by sendfile(), or -1 */
+    int             fbytes;     /* bytes of value left in fd */
+    off_t           foffset;
     void * end[];
     /* then null-terminated key */
     /* then " flags length\r\n" (no terminating null) */
@@ -216,6 +229,7 @@ struct conn {
     int    msgused;   /* number of elements used in msglist[] */
     int    msgcurr;   /* element in msglist[] being transmitted now */
     int    msgbytes;  /* number of bytes in current msg */
+    item   **msgfile; /* item whose value is sent after msglist[i], or NULL */
 
     item   **ilist;   /* list of items to write out */
     int    isize;
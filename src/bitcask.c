@@ -30,12 +30,17 @@
 #include "bitcask.h"
 #include "htree.h"
 #include "record.h"
+#include "hint.h"
 #include "diskmgr.h"
 
 #define MAX_BUCKET_COUNT 256
+#define KEY_LOCKS 64
 
 const uint32_t MAX_RECORD_SIZE = 50 << 20; // 50M
-const uint32_t MAX_BUCKET_SIZE = (uint32_t)(4000 << 20); // 4G
+#ifndef MAX_BUCKET_MB
+#define MAX_BUCKET_MB 4000 // 4G, smaller ones in tests
+#endif
+const uint32_t MAX_BUCKET_SIZE = (uint32_t)MAX_BUCKET_MB << 20;
 const uint32_t WRITE_BUFFER_SIZE = 2 << 20; // 2M
 
 const int SAVE_HTREE_LIMIT = 5;
@@ -44,14 +49,37 @@ const char DATA_FILE[] = "%03d.data";
 const char HINT_FILE[] = "%03d.hint.qlz";
 const char HTREE_FILE[] = "%03d.htree";
 
+// read only fd of a data file, closed by the last one who releases it
+typedef struct t_rfile {
+    int fd;
+    int refs;
+} RFile;
+
+// digest of the latest value of a key, for the record at pos with ver
+typedef struct t_digest {
+    uint64_t pos;
+    int32_t  ver;
+    uint32_t khash;
+    uint64_t digest;
+} Digest;
+
+#define DIGEST_WAYS 8
+
 struct bitcask_t {
     uint32_t depth, pos;
     time_t before;
     Mgr    *mgr;
     // HTree* tree; //这个tree记录了所有的data数据信息(也就是curr个tree的信息)，比cur_tree要大得多
     // HTree* tree; //这个tree记录了所有的data数据信息(也就是curr个tree的信息)，比cur_tree要大得多
-    HTree  *tree, *curr_tree;
+    // items of current bucket are tagged by bucket, hint is built
+    // from a view of tree after rotating
+    HTree  *tree;
+    Codec  *dc;     // shared by bitcasks of a store, or NULL
+    uint32_t curr_items;
+    pthread_t build_tid;
+    bool   building;
     int    last_snapshot;
+    time_t last_snapshot_time;
     int    curr; // //当前的桶的序号，这之前的桶都已经写入datafile了
     uint64_t bytes, curr_bytes;
     //write_buffer相当于active file的一个缓冲区。当write_buffer满了以后就flush
@@ -62,8 +90,26 @@ struct bitcask_t {
     // 也就是文件的末尾
     // wbuf_curr_pos; // 有效的数据的大小
     uint32_t    wbuf_size, wbuf_start_pos, wbuf_curr_pos;
-    pthread_mutex_t flush_lock, buffer_lock, write_lock;
+    // the last write_buffer, being written into data file by the holder
+    // of flush_lock, it's empty (fbuf_used is 0) when flush_lock is free
+    char   *flush_buffer;
+    uint32_t    fbuf_size, fbuf_start_pos, fbuf_used;
+    pthread_mutex_t flush_lock, buffer_lock, snapshot_lock;
+    // writers of a key are serialized by one of key_locks, all of them
+    // are taken to block writers
+    pthread_mutex_t key_locks[KEY_LOCKS];
+    // writers copying records into write_buffer, which is not swapped
+    // until they are done
+    int    wbuf_writers;
+    bool   flush_waiting;
+    pthread_cond_t writers_done;
     int    optimize_flag;
+    // cached fds of data files for reading, protected by fd_lock
+    RFile  *files[MAX_BUCKET_COUNT];
+    pthread_mutex_t fd_lock;
+    // indexed by hash of key, or NULL, protected by buffer_lock
+    Digest *digests;
+    uint32_t digest_size, digest_shift;
 };
 
 Bitcask* bc_open(const char* path, int depth, int pos, time_t before)
@@ -77,13 +123,14 @@ Bitcask* bc_open(const char* path, int depth, int pos, time_t before)
     Mgr *mgr = mgr_create(t, 1);
     if (mgr == NULL) return NULL;
 
-    Bitcask* bc = bc_open2(mgr, depth, pos, before);
+    Bitcask* bc = bc_open2(mgr, depth, pos, before, NULL);
     if (bc != NULL) bc_scan(bc);
     return bc;
 }
 
-Bitcask* bc_open2(Mgr *mgr, int depth, int pos, time_t before)
+Bitcask* bc_open2(Mgr *mgr, int depth, int pos, time_t before, Codec *dc)
 {
+    int i;
     Bitcask* bc = (Bitcask*)malloc(sizeof(Bitcask));
     if (bc == NULL) return NULL;
 
@@ -95,14 +142,19 @@ Bitcask* bc_open2(Mgr *mgr, int depth, int pos, time_t before)
     bc->bytes = 0;
     bc->curr_bytes = 0;
     bc->tree = NULL;
+    bc->dc = dc;
     bc->last_snapshot = -1;
-    bc->curr_tree = ht_new(depth, pos);
     bc->wbuf_size = 1024 * 4;
     bc->write_buffer = malloc(bc->wbuf_size);
     bc->last_flush_time = time(NULL);
     pthread_mutex_init(&bc->buffer_lock, NULL);
-    pthread_mutex_init(&bc->write_lock, NULL);
+    for (i=0; i<KEY_LOCKS; i++) {
+        pthread_mutex_init(&bc->key_locks[i], NULL);
+    }
+    pthread_cond_init(&bc->writers_done, NULL);
     pthread_mutex_init(&bc->flush_lock, NULL);
+    pthread_mutex_init(&bc->snapshot_lock, NULL);
+    pthread_mutex_init(&bc->fd_lock, NULL);
     return bc;
 }
 
@@ -111,6 +163,36 @@ inline bool file_exists(const char *path) {
     return stat(path, &st) == 0;
 }
 
+// wait for the writers in progress, and block new ones
+static void block_writers(Bitcask *bc)
+{
+    int i;
+    for (i=0; i<KEY_LOCKS; i++) {
+        pthread_mutex_lock(&bc->key_locks[i]);
+    }
+}
+
+static void unblock_writers(Bitcask *bc)
+{
+    int i;
+    for (i=KEY_LOCKS-1; i>=0; i--) {
+        pthread_mutex_unlock(&bc->key_locks[i]);
+    }
+}
+
+// take the view of tree, wait for bc_snapshot() to save it's view
+static int freeze_tree(HTree *tree)
+{
+    int r;
+    while ((r = ht_freeze(tree)) > 0) {
+        usleep(1000);
+    }
+    if (r != 0) {
+        fprintf(stderr, "freeze HTree failed\n");
+    }
+    return r;
+}
+
 inline char *gen_path(char *dst, const char *base, const char *fmt, int i)
 {
     static char path[256];
@@ -132,6 +214,49 @@ inline char *new_path(char *dst, Mgr *mgr, const char *fmt, int i)
     return path;
 }
 
+static void release_file(Bitcask *bc, RFile *f)
+{
+    pthread_mutex_lock(&bc->fd_lock);
+    bool last = -- f->refs == 0;
+    pthread_mutex_unlock(&bc->fd_lock);
+    if (last) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+// the cached fd of data file, opened with fd_lock held, so it's never
+// older than the last invalidate_file()
+static RFile *acquire_file(Bitcask *bc, int bucket)
+{
+    pthread_mutex_lock(&bc->fd_lock);
+    RFile *f = bc->files[bucket];
+    if (f == NULL) {
+        char path[255];
+        int fd = open(gen_path(path, mgr_base(bc->mgr), DATA_FILE, bucket), O_RDONLY);
+        if (fd != -1) {
+            f = (RFile*) malloc(sizeof(RFile));
+            f->fd = fd;
+            f->refs = 1; // by files
+            bc->files[bucket] = f;
+        }
+    }
+    if (f != NULL) f->refs ++;
+    pthread_mutex_unlock(&bc->fd_lock);
+    return f;
+}
+
+// called after the data file is renamed, unlinked or rewritten,
+// readers holding the old one can still finish
+static void invalidate_file(Bitcask *bc, int bucket)
+{
+    pthread_mutex_lock(&bc->fd_lock);
+    RFile *f = bc->files[bucket];
+    bc->files[bucket] = NULL;
+    pthread_mutex_unlock(&bc->fd_lock);
+    if (f != NULL) release_file(bc, f);
+}
+
 static void skip_empty_file(Bitcask* bc)
 {
     int i, last=0;
@@ -154,6 +279,22 @@ static void skip_empty_file(Bitcask* bc)
     }
 }
 
+// learn the prefixes of keys for a new codec from the latest hint,
+// before any tree uses it
+int bc_train(Bitcask *bc, Codec *dc)
+{
+    char hintpath[255];
+    struct stat st;
+    int i;
+    const char* base = mgr_base(bc->mgr);
+    for (i=MAX_BUCKET_COUNT-1; i>=0; i--) {
+        if (stat(gen_path(hintpath, base, HINT_FILE, i), &st) == 0) {
+            return trainHintFile(dc, hintpath);
+        }
+    }
+    return -1;
+}
+
 void bc_scan(Bitcask* bc)
 {
     char datapath[255], hintpath[255];
@@ -169,7 +310,7 @@ void bc_scan(Bitcask* bc)
                 && stat(gen_path(hintpath, base, HINT_FILE, i), &hst) == 0
                 && st.st_mtime >= hst.st_mtime
                 && (bc->before == 0 || st.st_mtime < bc->before)) {
-            bc->tree = ht_open(bc->depth, bc->pos, datapath);
+            bc->tree = ht_open2(bc->depth, bc->pos, datapath, bc->dc);
             if (bc->tree != NULL) {
                 bc->last_snapshot = i;
                 break; // 最新的快照
@@ -180,7 +321,7 @@ void bc_scan(Bitcask* bc)
         }
     }
     if (bc->tree == NULL) {
-        bc->tree = ht_new(bc->depth, bc->pos);
+        bc->tree = ht_new2(bc->depth, bc->pos, bc->dc);
     }
 
     for (i=0; i<MAX_BUCKET_COUNT; i++) {
@@ -236,17 +377,17 @@ void bc_close(Bitcask *bc)
         }
     }
 
-    pthread_mutex_lock(&bc->write_lock);
+    block_writers(bc);
 
     bc_flush(bc, 0, 0);
 
-    if (NULL != bc->curr_tree) {
-        if (bc->curr_bytes > 0) {
-            build_hint(bc->curr_tree, new_path(hintpath, bc->mgr, HINT_FILE, bc->curr));
-        }else{
-            ht_destroy(bc->curr_tree);
-        }
-        bc->curr_tree = NULL;
+    if (bc->building) {
+        pthread_join(bc->build_tid, NULL);
+        bc->building = false;
+    }
+    // without hint, the data file will be scanned after restart
+    if (bc->curr_bytes > 0 && freeze_tree(bc->tree) == 0) {
+        build_bucket_hint(bc->tree, bc->curr, new_path(hintpath, bc->mgr, HINT_FILE, bc->curr));
     }
 
     if (bc->curr_bytes == 0) bc->curr --;
@@ -259,8 +400,13 @@ void bc_close(Bitcask *bc)
     }
     ht_destroy(bc->tree);
 
+    for (i=0; i<MAX_BUCKET_COUNT; i++) {
+        invalidate_file(bc, i);
+    }
     mgr_destroy(bc->mgr);
     free(bc->write_buffer);
+    free(bc->flush_buffer);
+    free(bc->digests);
     free(bc);
 }
 
@@ -276,27 +422,30 @@ uint64_t data_file_size(Bitcask *bc, int bucket) {
 // update pos in HTree
 struct update_args {
     HTree *tree;
-    uint32_t index;
+    uint32_t bucket, index;
 };
 
 static void update_item_pos(Item *it, void *_args)
 {
     struct update_args *args = _args;
     HTree *tree = (HTree*) args->tree;
-    Item *p = ht_get(tree, it->key);
-    if (p) {
-        if (it->pos == p->pos) {
-            uint32_t npos = (it->pos & 0xffffff00) | args->index;
-            ht_add(tree, p->key, npos, p->hash, p->ver);
+    Item p;
+    if (it->bucket != args->bucket) return;
+    if (ht_lookup(tree, it->key, strlen(it->key), &p)) {
+        if (ITEM_POS(it) == ITEM_POS(&p)) {
+            uint64_t npos = MAKE_POS(args->index, POS_OFFSET(ITEM_POS(it)));
+            ht_add3(tree, it->key, strlen(it->key), npos, p.hash, p.ver, p.size);
         }
-        free(p);
     }
 }
 
 void bc_optimize(Bitcask *bc, int limit)
 {
     int i, total, last = -1;
+    // wait for bc_snapshot()
+    pthread_mutex_lock(&bc->snapshot_lock);
     bc->optimize_flag = 1;
+    pthread_mutex_unlock(&bc->snapshot_lock);
     const char *base = mgr_base(bc->mgr);
     // remove htree
     for (i=0; i < bc->curr; i++) {
@@ -344,6 +493,7 @@ void bc_optimize(Bitcask *bc, int limit)
                 scanHintFile(tree, i, hintpath, NULL);
                 struct update_args args;
                 args.tree = bc->tree;
+                args.bucket = i;
                 args.index = last;
                 ht_visit(tree, update_item_pos, &args);
                 ht_destroy(tree);
@@ -351,6 +501,8 @@ void bc_optimize(Bitcask *bc, int limit)
                 unlink(npath);
                 mgr_rename(datapath, npath);
                 mgr_rename(hintpath, gen_path(npath, base, HINT_FILE, last));
+                invalidate_file(bc, i);
+                invalidate_file(bc, last);
             }
             continue;
         }
@@ -381,6 +533,8 @@ void bc_optimize(Bitcask *bc, int limit)
             recoverd = optimizeDataFile(bc->tree, i, datapath, hintpath,
                 skipped, MAX_BUCKET_SIZE, last, NULL, NULL);
         }
+        invalidate_file(bc, i);
+        invalidate_file(bc, last);
         if (recoverd < 0) break; // failed
 
         pthread_mutex_lock(&bc->buffer_lock);
@@ -388,53 +542,74 @@ void bc_optimize(Bitcask *bc, int limit)
         pthread_mutex_unlock(&bc->buffer_lock);
     }
 
-    // update pos of items in curr_tree
-    pthread_mutex_lock(&bc->write_lock);
+    // update pos of items in current bucket
+    block_writers(bc);
     pthread_mutex_lock(&bc->flush_lock);
-    if (i == bc->curr && ++last < bc->curr) {
+    if (i == bc->curr && ++last < bc->curr && freeze_tree(bc->tree) == 0) {
         char opath[255], npath[255];
         gen_path(opath, base, DATA_FILE, bc->curr);
-
-        if (file_exists(opath)) {
-            gen_path(npath, base, DATA_FILE, last);
-            if (symlink(opath, npath) != 0)
-                fprintf(stderr, "symlink failed: %s -> %s\n", opath, npath);
-
-            struct update_args args;
-            args.tree = bc->tree;
-            args.index = last;
-            ht_visit(bc->curr_tree, update_item_pos, &args);
-
+        gen_path(npath, base, DATA_FILE, last);
+
+        // records in write buffer have not been flushed into it
+        bool exists = file_exists(opath);
+        if (exists && symlink(opath, npath) != 0)
+            fprintf(stderr, "symlink failed: %s -> %s\n", opath, npath);
+
+        // writers are blocked, the view is same as tree, hint of
+        // the bucket is built from the items tagged with it
+        struct update_args args;
+        args.tree = bc->tree;
+        args.bucket = bc->curr;
+        args.index = last;
+        ht_visit_frozen(bc->tree, update_item_pos, &args);
+
+        if (exists) {
             unlink(npath);
             mgr_rename(opath, npath);
         }
-
+        invalidate_file(bc, bc->curr);
+        invalidate_file(bc, last);
         bc->curr = last;
     }
+    // positions of records may be taken by others
+    if (bc->digests != NULL) {
+        pthread_mutex_lock(&bc->buffer_lock);
+        memset(bc->digests, 0, sizeof(Digest) * bc->digest_size);
+        pthread_mutex_unlock(&bc->buffer_lock);
+    }
     pthread_mutex_unlock(&bc->flush_lock);
-    pthread_mutex_unlock(&bc->write_lock);
+    unblock_writers(bc);
 
     bc->optimize_flag = 0;
 }
 
 DataRecord* bc_get(Bitcask *bc, const char* key)
 {
-    Item *item = ht_get(bc->tree, key);
-    if (NULL == item) return NULL;
+    return bc_get2(bc, key, 0, false, NULL, NULL);
+}
+
+// the record of key, or only the header and key of it if fd is not NULL,
+// the indexed size is not less than min_size and the value is not
+// compressed, the value can be sent from *fd (a dup of the cached one,
+// closed by caller) at *offset then, *fd is -1 otherwise.
+DataRecord* bc_get2(Bitcask *bc, const char* key, int min_size, bool check_crc,
+        int *fd, off_t *offset)
+{
+    Item item;
+    if (fd != NULL) *fd = -1;
+    if (!ht_lookup(bc->tree, key, strlen(key), &item)) return NULL;
     // ver < 0 代表删除
-    if (item->ver < 0){
-        free(item);
+    if (item.ver < 0){
         return NULL;
     }
 
-    // 后8位是文件编号
-    uint32_t bucket = item->pos & 0xff;
-    // 前24位是在文件中的位置
-    uint32_t pos = item->pos & 0xffffff00;
+    // 文件编号
+    uint32_t bucket = item.bucket;
+    // 在文件中的位置
+    uint32_t pos = POS_OFFSET(ITEM_POS(&item));
     if (bucket > bc->curr) {
         fprintf(stderr, "BUG: invalid bucket %d > %d\n", bucket, bc->curr);
         ht_remove(bc->tree, key);
-        free(item);
         return NULL;
     }
 
@@ -443,29 +618,46 @@ DataRecord* bc_get(Bitcask *bc, const char* key)
         pthread_mutex_lock(&bc->buffer_lock);
         if (bucket == bc->curr && pos >= bc->wbuf_start_pos){
             uint32_t p = pos - bc->wbuf_start_pos;
-            r = decode_record(bc->write_buffer + p, bc->wbuf_curr_pos - p, true);
+            r = decode_record(bc->write_buffer + p, bc->wbuf_curr_pos - p, false);
+        } else if (bucket == bc->curr && bc->fbuf_used > 0 && pos >= bc->fbuf_start_pos) {
+            uint32_t p = pos - bc->fbuf_start_pos;
+            r = decode_record(bc->flush_buffer + p, bc->fbuf_used - p, false);
         }
         pthread_mutex_unlock(&bc->buffer_lock);
 
         if (r != NULL){
-            free(item);
-            return r;
+            return decompress_record(r);
         }
     }
 
-    char fname[20], data[255];
-    const char * path = mgr_base(bc->mgr);
-    sprintf(fname, DATA_FILE, bucket);
-    sprintf(data, "%s/%s", path, fname);
-    int fd = open(data, O_RDONLY);
-    if (-1 == fd){
+    RFile *f = acquire_file(bc, bucket);
+    if (NULL == f){
         goto GET_END;
     }
 
-    r = fast_read_record(fd, pos, true);
+    // large one is left in file, or read as below if it's compressed
+    if (fd != NULL && min_size > 0 && item.size > 0
+            && class_length(item.size) >= min_size) {
+        r = read_record_header(f->fd, pos, check_crc);
+        if (r != NULL && strcmp(key, r->key) == 0
+                && (*fd = dup(f->fd)) != -1) {
+            *offset = pos + sizeof(DataRecord) - sizeof(char*) + r->ksz;
+            release_file(bc, f);
+            return r;
+        }
+        free_record(r);
+        r = NULL;
+    }
+
+    // in one read if the size of record is known
+    if (item.size > 0) {
+        r = fast_read_record2(f->fd, pos, strlen(key), class_length(item.size), false);
+    } else {
+        r = fast_read_record(f->fd, pos, false);
+    }
     if (NULL == r){
         if (bc->optimize_flag == 0)
-            fprintf(stderr, "Bug: get %s failed in %s %u %u\n", key, path, bucket, pos);
+            fprintf(stderr, "Bug: get %s failed in %s %u %u\n", key, mgr_base(bc->mgr), bucket, pos);
     } else {
          // check key
         if (strcmp(key, r->key) != 0){
@@ -478,41 +670,134 @@ DataRecord* bc_get(Bitcask *bc, const char* key)
 GET_END:
     if (NULL == r && bc->optimize_flag == 0)
         ht_remove(bc->tree, key);
-    if (fd != -1) close(fd);
-    free(item);
-    return r;
+    if (f != NULL) release_file(bc, f);
+    // kept in index if it can not be decompressed, such as by compressor
+    // not built in
+    return r != NULL ? decompress_record(r) : NULL;
 }
 
 struct build_thread_args {
     HTree *tree;
+    int bucket;
     char *path;
 };
 
 void* build_thread(void *param)
 {
     struct build_thread_args *args = (struct build_thread_args*) param;
-    build_hint(args->tree, args->path);
+    // all the items of the bucket are in tree since it's rotated, so the
+    // view can be taken later, after the one being saved by bc_snapshot()
+    if (freeze_tree(args->tree) == 0) {
+        build_bucket_hint(args->tree, args->bucket, args->path);
+    }
     free(args->path);
     free(param);
     return NULL;
 }
 
+// called with buffer_lock held, all the items in current bucket are in tree
 void bc_rotate(Bitcask *bc) {
-    // build in new thread
+    // one hint is built at a time, a bucket takes minutes to fill
+    if (bc->building) {
+        pthread_join(bc->build_tid, NULL);
+        bc->building = false;
+    }
+    // build in new thread, which takes the view of tree without locks
     char hintpath[255];
     new_path(hintpath, bc->mgr, HINT_FILE, bc->curr);
     struct build_thread_args *args = (struct build_thread_args*)malloc(
             sizeof(struct build_thread_args));
-    args->tree = bc->curr_tree;
+    args->tree = bc->tree;
+    args->bucket = bc->curr;
     args->path = strdup(hintpath);
-    pthread_t build_ptid;
-    pthread_create(&build_ptid, NULL, build_thread, args);
-    // next bucket
+    pthread_create(&bc->build_tid, NULL, build_thread, args);
+    bc->building = true;
+    // next bucket, fd of a stale file with the number should not be used
+    if (bc->curr + 1 < MAX_BUCKET_COUNT) invalidate_file(bc, bc->curr + 1);
     bc->curr ++;
-    bc->curr_tree = ht_new(bc->depth, bc->pos);
+    bc->curr_items = 0;
     bc->wbuf_start_pos = 0;
 }
 
+// called with flush_lock and buffer_lock held, wait for the writers
+// copying into write_buffer, new ones wait for flush_lock
+static void wait_writers(Bitcask *bc)
+{
+    bc->flush_waiting = true;
+    while (bc->wbuf_writers > 0) {
+        pthread_cond_wait(&bc->writers_done, &bc->buffer_lock);
+    }
+    bc->flush_waiting = false;
+}
+
+// called with flush_lock and buffer_lock held, flush_buffer is empty,
+// records in write_buffer will be written by write_flush_buffer()
+static void swap_buffer(Bitcask *bc)
+{
+    wait_writers(bc);
+    char *buf = bc->flush_buffer;
+    uint32_t size = bc->wbuf_size, old_size = bc->fbuf_size;
+    bc->flush_buffer = bc->write_buffer;
+    bc->fbuf_size = bc->wbuf_size;
+    bc->fbuf_start_pos = bc->wbuf_start_pos;
+    bc->fbuf_used = bc->wbuf_curr_pos;
+
+    if (size < WRITE_BUFFER_SIZE) {
+        size *= 2;
+    } else if (size > WRITE_BUFFER_SIZE * 2) {
+        size = WRITE_BUFFER_SIZE;
+    }
+    if (buf == NULL || old_size != size) {
+        free(buf);
+        buf = malloc(size);
+    }
+    bc->write_buffer = buf;
+    bc->wbuf_size = size;
+    bc->wbuf_start_pos += bc->wbuf_curr_pos;
+    bc->wbuf_curr_pos = 0;
+}
+
+// called with flush_lock held, writers keep appending into write_buffer
+static void write_flush_buffer(Bitcask *bc)
+{
+    char buf[255];
+    new_path(buf, bc->mgr, DATA_FILE, bc->curr);
+
+    FILE *f = fopen(buf, "ab");
+    if (f == NULL) {
+        fprintf(stderr, "open file %s for flushing failed.\n", buf);
+        exit(1);
+    }
+    // check file size
+    uint64_t last_pos = ftello(f);
+    if (last_pos > 0 && last_pos != bc->fbuf_start_pos) {
+        fprintf(stderr, "last pos not match: %"PRIu64" != %d in %s\n", last_pos, bc->fbuf_start_pos, buf);
+        exit(1);
+    }
+
+    uint32_t size = bc->fbuf_used;
+    int n = fwrite(bc->flush_buffer, 1, size, f);
+    if (n < size) {
+        fprintf(stderr, "write failed: return %d\n", n);
+        exit(1);
+    }
+    fclose(f);
+
+    pthread_mutex_lock(&bc->buffer_lock);
+    bc->last_flush_time = time(NULL);
+    bc->bytes += n;
+    bc->curr_bytes += n;
+    bc->fbuf_used = 0;
+
+    // records added while writing are in current bucket, rotate
+    // after they are flushed
+    if (bc->wbuf_curr_pos == 0
+        && bc->wbuf_start_pos + bc->wbuf_size > MAX_BUCKET_SIZE) {
+        bc_rotate(bc);
+    }
+    pthread_mutex_unlock(&bc->buffer_lock);
+}
+
 void bc_flush(Bitcask *bc, int limit, int flush_period)
 {
     if (bc->curr >= MAX_BUCKET_COUNT) {
@@ -526,62 +811,150 @@ void bc_flush(Bitcask *bc, int limit, int flush_period)
     time_t now = time(NULL);
     if (bc->wbuf_curr_pos > limit * 1024 ||
         now > bc->last_flush_time + flush_period && bc->wbuf_curr_pos > 0) {
-        uint32_t size = bc->wbuf_curr_pos;
-        char * tmp = (char*) malloc(size);
-        memcpy(tmp, bc->write_buffer, size);
+        swap_buffer(bc);
         pthread_mutex_unlock(&bc->buffer_lock);
+        write_flush_buffer(bc);
+    } else {
+        pthread_mutex_unlock(&bc->buffer_lock);
+    }
 
-        char buf[255];
-        new_path(buf, bc->mgr, DATA_FILE, bc->curr);
+    pthread_mutex_unlock(&bc->flush_lock);
+}
 
-        FILE *f = fopen(buf, "ab");
-        if (f == NULL) {
-            fprintf(stderr, "open file %s for flushing failed.\n", buf);
-            exit(1);
-        }
-        // check file size
-        uint64_t last_pos = ftello(f);
-        if (last_pos > 0 && last_pos != bc->wbuf_start_pos) {
-            fprintf(stderr, "last pos not match: %"PRIu64" != %d in %s\n", last_pos, bc->wbuf_start_pos, buf);
-            exit(1);
-        }
+// Save HTree for the last finished bucket in background, so restart
+// will only scan the current bucket. The items of current bucket in the
+// snapshot are flushed, they will be scanned again after restart.
+void bc_snapshot(Bitcask *bc, int period)
+{
+    time_t now = time(NULL);
+    if (period <= 0 || now < bc->last_snapshot_time + period) return;
 
-        int n = fwrite(tmp, 1, size, f);
-        if (n < size) {
-            fprintf(stderr, "write failed: return %d\n", n);
-            exit(1);
-        }
-        free(tmp);
-        fclose(f);
-        bc->last_flush_time = now;
+    char path[255];
+    struct stat st;
+    const char *base = mgr_base(bc->mgr);
+    pthread_mutex_lock(&bc->snapshot_lock);
+    int last = bc->curr - 1;
+    // the hint file is built in background after rotating
+    if (bc->optimize_flag > 0 || last <= bc->last_snapshot
+        || stat(gen_path(path, base, HINT_FILE, last), &st) != 0) {
+        pthread_mutex_unlock(&bc->snapshot_lock);
+        return;
+    }
 
-        pthread_mutex_lock(&bc->buffer_lock);
-        bc->bytes += n;
-        bc->curr_bytes += n;
-        if (n < bc->wbuf_curr_pos) {
-            memmove(bc->write_buffer, bc->write_buffer + n, bc->wbuf_curr_pos - n);
-        }
-        bc->wbuf_start_pos += n;
-        bc->wbuf_curr_pos -= n;
-        if (bc->wbuf_curr_pos == 0) {
-            if (bc->wbuf_size < WRITE_BUFFER_SIZE) {
-                bc->wbuf_size *= 2;
-                free(bc->write_buffer);
-                bc->write_buffer = malloc(bc->wbuf_size);
-            } else if (bc->wbuf_size > WRITE_BUFFER_SIZE * 2) {
-                bc->wbuf_size = WRITE_BUFFER_SIZE;
-                free(bc->write_buffer);
-                bc->write_buffer = malloc(bc->wbuf_size);
-            }
-        }
+    block_writers(bc);
+    bc_flush(bc, 0, 0);
+    int r = ht_freeze(bc->tree);
+    unblock_writers(bc);
+
+    new_path(path, bc->mgr, HTREE_FILE, last);
+    if (r > 0) {
+        // building hint of next bucket, try again later
+    } else if (r == 0 && ht_save_frozen(bc->tree, path) == 0) {
+        mgr_unlink(gen_path(NULL, base, HTREE_FILE, bc->last_snapshot));
+        bc->last_snapshot = last;
+        bc->last_snapshot_time = now;
+    } else {
+        fprintf(stderr, "save HTree to %s failed\n", path);
+        bc->last_snapshot_time = now;
+    }
+    pthread_mutex_unlock(&bc->snapshot_lock);
+}
 
-        if (bc->wbuf_start_pos + bc->wbuf_size > MAX_BUCKET_SIZE) {
-            bc_rotate(bc);
+// 是否和已有的值相同
+// 4 slots or more for a key, so that few keys are dropped from full sets
+void bc_set_digests(Bitcask *bc, int keys)
+{
+    uint32_t n = DIGEST_WAYS * 2, shift = 63;
+    while (n < (uint64_t)keys * 4 && n < (1U << 31)) {
+        n *= 2;
+        shift --;
+    }
+    free(bc->digests);
+    bc->digests = NULL;
+    if (keys <= 0) return;
+    // pages are not touched before used
+    bc->digests = (Digest*) calloc(n, sizeof(Digest));
+    if (bc->digests == NULL) {
+        fprintf(stderr, "no memory for %u digests\n", n);
+        return;
+    }
+    bc->digest_size = n;
+    bc->digest_shift = shift;
+}
+
+// the set of key, by the high bits of fibonacci hashing
+static inline Digest *digest_ways(Bitcask *bc, uint32_t khash)
+{
+    return bc->digests + ((khash * 0x9E3779B97F4A7C15ULL) >> bc->digest_shift) * DIGEST_WAYS;
+}
+
+// 1 if the value is same as the one of item, 0 if not, -1 if unknown,
+// with buffer_lock held
+static int match_digest(Bitcask *bc, Item *it, uint32_t khash, uint64_t digest)
+{
+    Digest *d = digest_ways(bc, khash);
+    int i;
+    for (i=0; i<DIGEST_WAYS; i++) {
+        if (d[i].khash == khash && d[i].pos == ITEM_POS(it) && d[i].ver == it->ver) {
+            return d[i].digest == digest;
         }
     }
+    return -1;
+}
 
-    pthread_mutex_unlock(&bc->buffer_lock);
-    pthread_mutex_unlock(&bc->flush_lock);
+// with buffer_lock held, the digest of key is moved to the front of the
+// set, the last one is dropped if the key is not in it
+static void put_digest(Bitcask *bc, uint64_t pos, int32_t ver, uint32_t khash, uint64_t digest)
+{
+    Digest *d = digest_ways(bc, khash);
+    int i = 0;
+    while (i < DIGEST_WAYS - 1 && d[i].khash != khash) {
+        i ++;
+    }
+    memmove(d + 1, d, sizeof(Digest) * i);
+    d[0].pos = pos;
+    d[0].ver = ver;
+    d[0].khash = khash;
+    d[0].digest = digest;
+}
+
+static bool same_value(Bitcask *bc, const char *key, const char *value, int vlen, int flag)
+{
+    DataRecord *r = bc_get(bc, key);
+    bool same = r != NULL && r->flag == flag && vlen == r->vsz
+                && memcmp(value, r->value, vlen) == 0;
+    free_record(r);
+    return same;
+}
+
+// a new value of key to be compared with the old one
+typedef struct t_compare {
+    const char *key, *value;
+    int vlen, flag;
+    bool use_digest;
+    uint32_t khash;
+    uint64_t digest;
+    // the old value read for the record at pos
+    bool compared, same;
+    uint64_t pos;
+} Compare;
+
+// whether the value is same as the one of item, told by the digest kept
+// for the record if any, or by reading the old value once per record
+static bool same_as_item(Bitcask *bc, Item *it, Compare *c)
+{
+    if (c->use_digest) {
+        pthread_mutex_lock(&bc->buffer_lock);
+        int m = match_digest(bc, it, c->khash, c->digest);
+        pthread_mutex_unlock(&bc->buffer_lock);
+        if (m >= 0) return m;
+    }
+    if (!c->compared || ITEM_POS(it) != c->pos) {
+        c->same = same_value(bc, c->key, c->value, c->vlen, c->flag);
+        c->pos = ITEM_POS(it);
+        c->compared = true;
+    }
+    return c->same;
 }
 
 // 设置一个值
@@ -592,13 +965,47 @@ bool bc_set(Bitcask *bc, const char* key, char* value, int vlen, int flag, int v
         return false;
     }
 
+    // hashing, comparing with the old value, compressing and checksum are
+    // done before taking the lock of key, which only covers resolving
+    // version and reserving space in write buffer, the record is copied
+    // into it in parallel with other keys
+    uint16_t vhash = gen_hash(value, vlen);
+    int klen = strlen(key);
+    uint32_t khash = fnv1a(key, klen);
+    Item it;
+    Compare cmp = {key, value, vlen, flag};
+    // the value is not read when the digest of old one is kept
+    cmp.use_digest = bc->digests != NULL && version >= 0;
+    cmp.khash = khash;
+    if (cmp.use_digest) {
+        cmp.digest = value_digest(value, vlen) ^ (uint32_t)flag;
+    }
+    if (ht_lookup(bc->tree, key, klen, &it) && it.ver > 0 && it.hash == vhash) {
+        same_as_item(bc, &it, &cmp);
+    }
+
+    DataRecord *r = malloc(sizeof(DataRecord) + klen);
+    r->ksz = klen; // key大小
+    // memcpy 内存拷贝
+    memcpy(r->key, key, klen);
+    r->vsz = vlen; // 值大小
+    r->value = value;
+    r->free_value = false;
+    r->flag = flag;
+    r->tstamp = time(NULL);
+    compress_record(r);
+    uint32_t vcrc = value_crc(r);
+    int rlen = record_length(r);
+
     bool suc = false; // success
-    pthread_mutex_lock(&bc->write_lock);
+    bool flushing = false; // holding flush_lock
+    pthread_mutex_t *key_lock = &bc->key_locks[khash % KEY_LOCKS];
+    pthread_mutex_lock(key_lock);
 
     int oldv = 0, ver = version;
-    Item *it = ht_get(bc->tree, key);
-    if (it != NULL) {
-        oldv = it->ver;
+    bool found = ht_lookup(bc->tree, key, klen, &it);
+    if (found) {
+        oldv = it.ver;
     }
 
     if (version == 0 && oldv > 0){ // replace
@@ -615,79 +1022,102 @@ bool bc_set(Bitcask *bc, const char* key, char* value, int vlen, int flag, int v
         ver = version;
     }
 
-    uint16_t hash = gen_hash(value, vlen);
-    if (ver < 0) hash = 0;
+    uint16_t hash = ver < 0 ? 0 : vhash;
 
-    // 值没变化
-    if (NULL != it && hash == it->hash) {
-        DataRecord *r = bc_get(bc, key);
-        if (r != NULL && r->flag == flag && vlen  == r->vsz
-             && memcmp(value, r->value, vlen) == 0) {
-            if (version != 0){
-                // update version
-                if (it->pos & 0xff == bc->curr){
-                    ht_add(bc->curr_tree, key, it->pos, it->hash, ver);
-                }
-                ht_add(bc->tree, key, it->pos, it->hash, ver);
-            }
-            suc = true;
-            free_record(r);
-            goto SET_FAIL;
+    // 值没变化, compared before if the record was not changed since then
+    if (found && hash == it.hash && same_as_item(bc, &it, &cmp)) {
+        if (version != 0){
+            ht_add3(bc->tree, key, klen, ITEM_POS(&it), it.hash, ver, it.size);
         }
-        if (r != NULL) free_record(r);
-    }
-
-    int klen = strlen(key);
-    DataRecord *r = malloc(sizeof(DataRecord) + klen);
-    r->ksz = klen; // key大小
-    // memcpy 内存拷贝
-    memcpy(r->key, key, klen);
-    r->vsz = vlen; // 值大小
-    r->value = value;
-    r->free_value = false;
-    r->flag = flag;
-    r->version = ver;
-    r->tstamp = time(NULL);
-
-    int rlen;
-    // 持久化
-    char *rbuf = encode_record(r, &rlen);
-    if (rbuf == NULL || (rlen & 0xff) != 0){
-        fprintf(stderr, "encode_record() failed with %d\n", rlen);
-        if (rbuf != NULL) free(rbuf);
+        if (cmp.use_digest) {
+            pthread_mutex_lock(&bc->buffer_lock);
+            put_digest(bc, ITEM_POS(&it), version != 0 ? ver : it.ver, khash, cmp.digest);
+            pthread_mutex_unlock(&bc->buffer_lock);
+        }
+        suc = true;
         goto SET_FAIL;
     }
 
+    // 持久化
+    r->version = ver;
     pthread_mutex_lock(&bc->buffer_lock);
-    // record maybe larger than buffer
-    if (bc->wbuf_curr_pos + rlen > bc->wbuf_size) {
+    // record maybe larger than buffer, with the header of data file
+    // the full buffer is written after key_lock is released, only wait
+    // for the last one being written
+    if (bc->flush_waiting || bc->wbuf_curr_pos + rlen + DATA_HEADER_SIZE > bc->wbuf_size) {
         pthread_mutex_unlock(&bc->buffer_lock);
-        bc_flush(bc, 0, 0);
+        pthread_mutex_lock(&bc->flush_lock);
+        flushing = true;
         pthread_mutex_lock(&bc->buffer_lock);
+    }
+    if (bc->wbuf_curr_pos + rlen + DATA_HEADER_SIZE > bc->wbuf_size) {
+        if (bc->curr >= MAX_BUCKET_COUNT) {
+            fprintf(stderr, "reach max bucket count\n");
+            exit(1);
+        }
+        if (bc->wbuf_curr_pos > 0) {
+            swap_buffer(bc);
+        }
 
-        while (rlen > bc->wbuf_size) {
+        while (rlen + DATA_HEADER_SIZE > bc->wbuf_size) {
             bc->wbuf_size *= 2;
             free(bc->write_buffer);
             bc->write_buffer = malloc(bc->wbuf_size);
         }
         if (bc->wbuf_start_pos + bc->wbuf_size > MAX_BUCKET_SIZE) {
-            bc_rotate(bc);
+            // the bucket is rotated after all of it's records are written
+            if (bc->fbuf_used > 0) {
+                pthread_mutex_unlock(&bc->buffer_lock);
+                write_flush_buffer(bc);
+                pthread_mutex_lock(&bc->buffer_lock);
+            }
+            if (bc->wbuf_start_pos + bc->wbuf_size > MAX_BUCKET_SIZE) {
+                bc_rotate(bc);
+            }
         }
+    } else if (flushing) {
+        // flushed by others
+        pthread_mutex_unlock(&bc->flush_lock);
+        flushing = false;
+    }
+    // the first record of bucket, the file is created by bc_flush()
+    if (bc->wbuf_start_pos + bc->wbuf_curr_pos == 0) {
+        bc->wbuf_curr_pos += put_data_header(bc->write_buffer);
     }
-    memcpy(bc->write_buffer + bc->wbuf_curr_pos, rbuf, rlen);
-    int pos = (bc->wbuf_start_pos + bc->wbuf_curr_pos) | bc->curr;
+    // reserve space for the record, copy it without buffer_lock
+    char *buf = bc->write_buffer + bc->wbuf_curr_pos;
+    uint64_t pos = MAKE_POS(bc->curr, bc->wbuf_start_pos + bc->wbuf_curr_pos);
     bc->wbuf_curr_pos += rlen;
+    bc->wbuf_writers ++;
+    if (!found || it.bucket != bc->curr) {
+        bc->curr_items ++;
+    }
+    pthread_mutex_unlock(&bc->buffer_lock);
+
+    encode_record2(r, buf, vcrc);
+    // in tree before the buffer is flushed and the bucket is rotated
+    ht_add3(bc->tree, key, klen, pos, hash, ver, record_class(rlen));
+
+    pthread_mutex_lock(&bc->buffer_lock);
+    if (cmp.use_digest) {
+        put_digest(bc, pos, ver, khash, cmp.digest);
+    }
+    if (-- bc->wbuf_writers == 0 && bc->flush_waiting) {
+        pthread_cond_signal(&bc->writers_done);
+    }
     pthread_mutex_unlock(&bc->buffer_lock);
 
-    ht_add(bc->curr_tree, key, pos, hash, ver);
-    ht_add(bc->tree, key, pos, hash, ver);
     suc = true;
-    free(rbuf);
-    free_record(r);
 
 SET_FAIL:
-    pthread_mutex_unlock(&bc->write_lock);
-    if (it != NULL) free(it);
+    pthread_mutex_unlock(key_lock);
+    if (flushing) {
+        if (bc->fbuf_used > 0) {
+            write_flush_buffer(bc);
+        }
+        pthread_mutex_unlock(&bc->flush_lock);
+    }
+    free_record(r);
     return suc;
 }
 
@@ -713,8 +1143,8 @@ uint32_t   bc_count(Bitcask *bc, uint32_t* curr)
 {
     uint32_t total = 0;
     ht_get_hash(bc->tree, "@", &total);
-    if (NULL != curr && NULL != bc->curr_tree) {
-        ht_get_hash(bc->curr_tree, "@", curr);
+    if (NULL != curr) {
+        *curr = bc->curr_items;
     }
     return total;
 }
@@ -725,3 +1155,19 @@ void bc_stat(Bitcask *bc, uint64_t *bytes)
         *bytes = bc->bytes;
     }
 }
+
+void bc_index_stat(Bitcask *bc, uint64_t *allocated, uint64_t *used)
+{
+    *allocated = *used = 0;
+    if (NULL != bc->tree) {
+        ht_stat(bc->tree, allocated, used);
+    }
+}
+
+uint32_t bc_max_lock_hold(Bitcask *bc)
+{
+    if (NULL != bc->tree) {
+        return ht_max_lock_hold(bc->tree);
+    }
+    return 0;
+}
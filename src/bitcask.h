@@ -21,17 +21,22 @@
 
 #include "record.h"
 #include "diskmgr.h"
+#include "codec.h"
 
 typedef struct bitcask_t Bitcask;
 
 Bitcask*   bc_open(const char *path, int depth, int pos, time_t before);
-Bitcask*   bc_open2(Mgr *mgr, int depth, int pos, time_t before);
+Bitcask*   bc_open2(Mgr *mgr, int depth, int pos, time_t before, Codec *dc);
+int        bc_train(Bitcask *bc, Codec *dc);
 void       bc_scan(Bitcask *bc);
 void       bc_flush(Bitcask *bc, int limit, int period);
+void       bc_snapshot(Bitcask *bc, int period);
 void       bc_close(Bitcask *bc);
 void       bc_merge(Bitcask *bc);
 void       bc_optimize(Bitcask *bc, int limit);
 DataRecord* bc_get(Bitcask *bc, const char* key);
+DataRecord* bc_get2(Bitcask *bc, const char* key, int min_size, bool check_crc,
+                int *fd, off_t *offset);
 bool       bc_set(Bitcask *bc, const char* key, char* value, int vlen, int flag, int version);
 bool       bc_delete(Bitcask *bc, const char* key);
 
@@ -39,5 +44,10 @@ uint16_t   bc_get_hash(Bitcask *bc, const char * pos, int *count);
 char*      bc_list(Bitcask *bc, const char* pos, const char *prefix);
 uint32_t   bc_count(Bitcask *bc, uint32_t* curr);
 void       bc_stat(Bitcask *bc, uint64_t *bytes);
+void       bc_index_stat(Bitcask *bc, uint64_t *allocated, uint64_t *used);
+uint32_t   bc_max_lock_hold(Bitcask *bc);
+// keep digests of the latest values of about the number of keys, so SETs of
+// unchanged values are told without reading the old ones, 0 to disable
+void       bc_set_digests(Bitcask *bc, int keys);
 	
 #endif
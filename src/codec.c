@@ -18,6 +18,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "codec.h"
 
@@ -32,17 +35,131 @@ inline int fmt_size(Fmt *fmt) {
     return sizeof(Fmt) + strlen(fmt->fmt) - 7 + 1;
 }
 
+#define MAX_ARGS 3
+
+// Fmt compiled for decoding: literals around the integer slots,
+// so no sprintf() is needed
+typedef struct {
+    unsigned char nargs;
+    unsigned char hex[MAX_ARGS];        // %x or %d
+    unsigned char len[MAX_ARGS + 1];    // literal before every slot, and the tail
+    char text[0];                       // all the literals
+} Tmpl;
+
+static Tmpl* tmpl_compile(Fmt *f)
+{
+    int flen = strlen(f->fmt), n = 0;
+    Tmpl *t = (Tmpl*) malloc(sizeof(Tmpl) + flen);
+    if (t == NULL) return NULL;
+    memset(t, 0, sizeof(Tmpl));
+    const char *p = f->fmt, *q = f->fmt + flen;
+    char *dst = t->text, *last = t->text;
+    while (p < q) {
+        if (p[0] == '%' && p + 1 < q && (p[1] == 'd' || p[1] == 'x')) {
+            if (n == MAX_ARGS) break;
+            t->len[n] = dst - last;
+            t->hex[n] = p[1] == 'x';
+            last = dst;
+            n ++;
+            p += 2;
+        } else {
+            *dst ++ = *p ++;
+        }
+    }
+    t->len[n] = dst - last;
+    t->nargs = n;
+    if (p < q || n != f->nargs) {
+        fprintf(stderr, "invalid fmt: %s\n", f->fmt);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static const char digits2[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// as sprintf("%d")
+static inline int format_dec(char *buf, int32_t v)
+{
+    char tmp[12], *p = tmp + sizeof(tmp);
+    uint32_t u = v < 0 ? -(uint32_t)v : v;
+    while (u >= 100) {
+        int r = (u % 100) * 2;
+        u /= 100;
+        *--p = digits2[r + 1];
+        *--p = digits2[r];
+    }
+    if (u >= 10) {
+        *--p = digits2[u * 2 + 1];
+        *--p = digits2[u * 2];
+    } else {
+        *--p = '0' + u;
+    }
+    if (v < 0) *--p = '-';
+    int n = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, n);
+    return n;
+}
+
+// as sprintf("%x")
+static inline int format_hex(char *buf, uint32_t u)
+{
+    char tmp[8], *p = tmp + sizeof(tmp);
+    do {
+        *--p = "0123456789abcdef"[u & 15];
+        u >>= 4;
+    } while (u);
+    int n = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, n);
+    return n;
+}
+
 const int DEFAULT_DICT_SIZE = 1024;
 const int MAX_DICT_SIZE = 16384;
 
 #define RDICT_SIZE(DICT_SIZE) ((DICT_SIZE) * 7 + 1)
 
+// Prefix dictionary: the shared leading part of keys (ending at a
+// separator) is replaced by 0 and its index, the rest is encoded by Fmt.
+// Keys never start with 0, see check_key().
+#define MAX_PREFIX 255
+#define MIN_PREFIX 4
+#define MAX_PREFIX_LEN 128
+#define PREFIX_HASH_SIZE 1024
+#define IS_SEP(c) ((c) == '/' || (c) == ':' || (c) == '_' || (c) == '-')
+#define FNV_32_INIT 0x811c9dc5
+#define FNV_32_PRIME 0x01000193
+
 struct t_codec {
     size_t dict_size;
     Fmt **dict;
+    Tmpl **tmpl;        // compiled dict
     size_t rdict_size;
     short *rdict;
     int dict_used;
+    int nprefix;        // prefix dictionary, learned by dc_train()
+    char **prefix;      // 1 .. nprefix
+    unsigned char *plen;
+    short *rprefix;     // hash of prefix => index
+    pthread_mutex_t lock;   // for learning new formats
+    // shared by all trees of a store, saved in its own file
+    char *path;
+    uint32_t id;
+    int saved;          // formats in file, -1 for not saved
+};
+
+// the reference to a shared codec in snapshot of tree
+#define CODEC_REF -1
+struct t_codec_ref {
+    int marker;         // CODEC_REF, dict_used of a dump is positive
+    uint32_t id;
+    int dict_used;      // formats used by the snapshot
+    int nprefix;
 };
 
 Codec* dc_new() 
@@ -52,6 +169,8 @@ Codec* dc_new()
     dc->dict_size = DEFAULT_DICT_SIZE;
     dc->dict = (Fmt**)malloc(sizeof(Fmt*) * dc->dict_size);
     memset(dc->dict, 0, sizeof(Fmt*) * dc->dict_size);
+    dc->tmpl = (Tmpl**)malloc(sizeof(Tmpl*) * dc->dict_size);
+    memset(dc->tmpl, 0, sizeof(Tmpl*) * dc->dict_size);
    
     dc->rdict_size = RDICT_SIZE(dc->dict_size);
     dc->rdict = (short*)malloc(sizeof(short) * dc->rdict_size);
@@ -59,26 +178,44 @@ Codec* dc_new()
 
     dc->dict_used = 1;
 
+    dc->nprefix = 0;
+    dc->prefix = NULL;
+    dc->plen = NULL;
+    dc->rprefix = NULL;
+
+    pthread_mutex_init(&dc->lock, NULL);
+    dc->path = NULL;
+    dc->id = 0;
+    dc->saved = -1;
+
     return dc;
 }
 
+// the prefixes are appended after formats only if there are any,
+// so the dump is still readable for older versions
 int dc_size(Codec *dc) {
     int i, s = sizeof(int);
     for (i=1; i<dc->dict_used; i++) {
         s += 1 + fmt_size(dc->dict[i]);
     }
+    if (dc->nprefix > 0) {
+        s += sizeof(int);
+        for (i=1; i<=dc->nprefix; i++) {
+            s += 1 + dc->plen[i];
+        }
+    }
     return s;
 }
 
 int dc_dump(Codec *dc, char *buf, int size)
 {
     char *orig = buf;
-    int i=0;
+    int i=0, used = __atomic_load_n(&dc->dict_used, __ATOMIC_ACQUIRE);
     if (size < sizeof(int)) return -1;
-    *(int*)buf = dc->dict_used;
+    *(int*)buf = used;
     buf += sizeof(int);
 
-    for (i=1; i<dc->dict_used; i++) {
+    for (i=1; i<used; i++) {
         unsigned char s = fmt_size(dc->dict[i]);
         if (buf + s + 1 - orig > size) return -1;
         *(unsigned char*)buf ++ = s;
@@ -86,9 +223,175 @@ int dc_dump(Codec *dc, char *buf, int size)
         buf += s;
     }
 
+    if (dc->nprefix > 0) {
+        if (buf + sizeof(int) - orig > size) return -1;
+        *(int*)buf = dc->nprefix;
+        buf += sizeof(int);
+        for (i=1; i<=dc->nprefix; i++) {
+            int s = dc->plen[i];
+            if (buf + s + 1 - orig > size) return -1;
+            *(unsigned char*)buf ++ = s;
+            memcpy(buf, dc->prefix[i], s);
+            buf += s;
+        }
+    }
+
     return buf - orig;
 }
 
+static void prefix_rebuild(Codec *dc)
+{
+    int i, j;
+    if (dc->rprefix == NULL) {
+        dc->rprefix = (short*) malloc(sizeof(short) * PREFIX_HASH_SIZE);
+    }
+    memset(dc->rprefix, 0, sizeof(short) * PREFIX_HASH_SIZE);
+    for (i=1; i<=dc->nprefix; i++) {
+        uint32_t h = FNV_32_INIT;
+        for (j=0; j<dc->plen[i]; j++) {
+            h = (h ^ (unsigned char)dc->prefix[i][j]) * FNV_32_PRIME;
+        }
+        h &= PREFIX_HASH_SIZE - 1;
+        while (dc->rprefix[h] > 0) {
+            h = (h + 1) & (PREFIX_HASH_SIZE - 1);
+        }
+        dc->rprefix[h] = i;
+    }
+}
+
+static void add_prefix(Codec *dc, const char *p, int len)
+{
+    if (dc->prefix == NULL) {
+        dc->prefix = (char**) malloc(sizeof(char*) * (MAX_PREFIX + 1));
+        dc->plen = (unsigned char*) malloc(MAX_PREFIX + 1);
+    }
+    int i = ++ dc->nprefix;
+    dc->prefix[i] = (char*) malloc(len);
+    memcpy(dc->prefix[i], p, len);
+    dc->plen[i] = len;
+}
+
+// index of the longest prefix of src in dictionary, 0 for none
+static int find_prefix(Codec *dc, const char *src, int len)
+{
+    uint32_t h = FNV_32_INIT;
+    int i, best = 0;
+    for (i=0; i<len && i<MAX_PREFIX_LEN; i++) {
+        h = (h ^ (unsigned char)src[i]) * FNV_32_PRIME;
+        if (IS_SEP(src[i]) && i + 1 >= MIN_PREFIX) {
+            uint32_t k = h & (PREFIX_HASH_SIZE - 1);
+            int p;
+            while ((p = dc->rprefix[k]) > 0) {
+                if (dc->plen[p] == i + 1 && memcmp(dc->prefix[p], src, i + 1) == 0) {
+                    best = p;
+                    break;
+                }
+                k = (k + 1) & (PREFIX_HASH_SIZE - 1);
+            }
+        }
+    }
+    return best;
+}
+
+typedef struct {
+    uint32_t hash;
+    const char *s;
+    int len;
+    int gain;
+} Candidate;
+
+// Learn the prefix dictionary from sample keys, greedily pick the prefix
+// which saves most bytes given the ones picked before. Should be called
+// before any key is encoded, returns number of prefixes.
+int dc_train(Codec *dc, const char **keys, const int *lens, int n)
+{
+    int i, j, total = 0, ncand = 0, size = 64;
+    if (dc == NULL || dc->nprefix > 0 || dc->saved >= 0 || n <= 0) return -1;
+
+    for (i=0; i<n; i++) {
+        for (j=MIN_PREFIX-1; j<lens[i] && j<MAX_PREFIX_LEN; j++) {
+            if (IS_SEP(keys[i][j])) total ++;
+        }
+    }
+    while (size < total * 2) size *= 2;
+
+    Candidate *cands = (Candidate*) malloc(sizeof(Candidate) * (total + 1));
+    int *slots = (int*) calloc(size, sizeof(int));
+    int *occ = (int*) malloc(sizeof(int) * (total + 1));
+    int *start = (int*) malloc(sizeof(int) * (n + 1));
+    int *best = (int*) calloc(n, sizeof(int));
+    if (cands == NULL || slots == NULL || occ == NULL || start == NULL || best == NULL) {
+        fprintf(stderr, "malloc failed for training %d keys\n", n);
+        n = 0;
+        goto FREE;
+    }
+
+    // candidates and their occurrences in every key
+    total = 0;
+    for (i=0; i<n; i++) {
+        const char *key = keys[i];
+        uint32_t h = FNV_32_INIT;
+        start[i] = total;
+        for (j=0; j<lens[i] && j<MAX_PREFIX_LEN; j++) {
+            h = (h ^ (unsigned char)key[j]) * FNV_32_PRIME;
+            if (!IS_SEP(key[j]) || j + 1 < MIN_PREFIX) continue;
+            uint32_t k = h & (size - 1);
+            while (slots[k] > 0) {
+                Candidate *c = &cands[slots[k]];
+                if (c->hash == h && c->len == j + 1 && memcmp(c->s, key, j + 1) == 0) break;
+                k = (k + 1) & (size - 1);
+            }
+            if (slots[k] == 0) {
+                Candidate *c = &cands[++ ncand];
+                c->hash = h;
+                c->s = key;
+                c->len = j + 1;
+                slots[k] = ncand;
+            }
+            occ[total ++] = slots[k];
+        }
+    }
+    start[n] = total;
+
+    while (dc->nprefix < MAX_PREFIX) {
+        for (i=1; i<=ncand; i++) {
+            cands[i].gain = 0;
+        }
+        for (i=0; i<n; i++) {
+            for (j=start[i]; j<start[i+1]; j++) {
+                Candidate *c = &cands[occ[j]];
+                int g = c->len - 2 - best[i];
+                if (g > 0) c->gain += g;
+            }
+        }
+        int m = 0;
+        for (i=1; i<=ncand; i++) {
+            if (m == 0 || cands[i].gain > cands[m].gain) m = i;
+        }
+        // should save more than the cost of itself, in a few keys
+        if (m == 0 || cands[m].gain < cands[m].len * 4) break;
+        add_prefix(dc, cands[m].s, cands[m].len);
+        for (i=0; i<n; i++) {
+            for (j=start[i]; j<start[i+1]; j++) {
+                if (occ[j] == m && best[i] < cands[m].len - 2) {
+                    best[i] = cands[m].len - 2;
+                }
+            }
+        }
+    }
+    if (dc->nprefix > 0) {
+        prefix_rebuild(dc);
+    }
+
+FREE:
+    free(cands);
+    free(slots);
+    free(occ);
+    free(start);
+    free(best);
+    return dc->nprefix;
+}
+
 void dc_rebuild(Codec *dc) 
 {
     int i;
@@ -111,6 +414,7 @@ void dc_enlarge(Codec *dc)
 {
     dc->dict_size = min(dc->dict_size * 2, MAX_DICT_SIZE);
     dc->dict = (Fmt**) realloc(dc->dict, sizeof(Fmt*) * dc->dict_size);
+    dc->tmpl = (Tmpl**) realloc(dc->tmpl, sizeof(Tmpl*) * dc->dict_size);
 
     dc_rebuild(dc);
 }    
@@ -133,6 +437,11 @@ int dc_load(Codec *dc, const char *buf, int size)
             fprintf(stderr, "realloc failed: %lu\n", sizeof(Fmt*) * dict_size);
             return -1;
         }
+        dc->tmpl = (Tmpl**) realloc(dc->tmpl, sizeof(Tmpl*) * dict_size);
+        if (dc->tmpl == NULL) {
+            fprintf(stderr, "realloc failed: %lu\n", sizeof(Tmpl*) * dict_size);
+            return -1;
+        }
         dc->dict_size = dict_size;
     }
 
@@ -144,13 +453,163 @@ int dc_load(Codec *dc, const char *buf, int size)
             fprintf(stderr, "malloc failed: %d\n", s);
             return -1;
         }
-        dc->dict_used ++;
         memcpy(dc->dict[i], buf, s);
+        dc->tmpl[i] = tmpl_compile(dc->dict[i]);
+        dc->dict_used ++;
         buf += s;
     }
     
     dc_rebuild(dc);
 
+    if (buf + sizeof(int) - orig <= size) {
+        int nprefix = *(int*)buf;
+        buf += sizeof(int);
+        if (nprefix < 0 || nprefix > MAX_PREFIX) {
+            fprintf(stderr, "number of prefixes overflow: %d > %d\n", nprefix, MAX_PREFIX);
+            return -1;
+        }
+        for (i=1; i<=nprefix; i++) {
+            int s = *(unsigned char*) buf++;
+            if (s < MIN_PREFIX || buf + s - orig > size) {
+                fprintf(stderr, "invalid prefix: %d\n", i);
+                return -1;
+            }
+            add_prefix(dc, buf, s);
+            buf += s;
+        }
+        if (dc->nprefix > 0) {
+            prefix_rebuild(dc);
+        }
+    }
+
+    return 0;
+}
+
+// A store-wide codec: formats learned by any tree are seen by all others.
+// The arrays never grow so it can be read without lock, new formats are
+// added under dc->lock.
+Codec* dc_open(const char *path)
+{
+    Codec *dc = dc_new();
+    char *buf = NULL;
+    FILE *f = NULL;
+    dc->dict_size = MAX_DICT_SIZE;
+    dc->dict = (Fmt**) realloc(dc->dict, sizeof(Fmt*) * dc->dict_size);
+    dc->tmpl = (Tmpl**) realloc(dc->tmpl, sizeof(Tmpl*) * dc->dict_size);
+    dc_rebuild(dc);
+    dc->path = strdup(path);
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        // a new one, which is not referenced by any snapshot
+        dc->id = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^ (uint32_t)(uintptr_t)dc;
+        return dc;
+    }
+    long size = 0;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < (long)(sizeof(uint32_t) + sizeof(int))
+        || fseek(f, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "bad codec file: %s\n", path);
+        goto FAIL;
+    }
+    buf = (char*) malloc(size);
+    if (buf == NULL || fread(buf, size, 1, f) != 1) {
+        fprintf(stderr, "read %s failed\n", path);
+        goto FAIL;
+    }
+    dc->id = *(uint32_t*)buf;
+    if (dc_load(dc, buf + sizeof(uint32_t), size - sizeof(uint32_t)) != 0) {
+        fprintf(stderr, "load codec from %s failed\n", path);
+        goto FAIL;
+    }
+    dc->saved = dc->dict_used;
+    free(buf);
+    fclose(f);
+    return dc;
+
+FAIL:
+    if (buf) free(buf);
+    fclose(f);
+    dc_destroy(dc);
+    return NULL;
+}
+
+// write the shared codec into file if it has changed, it should be called
+// before saving any snapshot referring it
+int dc_save(Codec *dc)
+{
+    int r = -1;
+    char tmp[512];
+    if (dc == NULL || dc->path == NULL) return -1;
+    pthread_mutex_lock(&dc->lock);
+    if (dc->saved == dc->dict_used) {
+        pthread_mutex_unlock(&dc->lock);
+        return 0;
+    }
+    int used = dc->dict_used, size = dc_size(dc);
+    char *buf = (char*) malloc(sizeof(uint32_t) + size);
+    if (buf == NULL) goto DONE;
+    *(uint32_t*)buf = dc->id;
+    if (dc_dump(dc, buf + sizeof(uint32_t), size) != size) {
+        fprintf(stderr, "dump codec failed\n");
+        goto DONE;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dc->path);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "open %s failed\n", tmp);
+        goto DONE;
+    }
+    if (fwrite(buf, sizeof(uint32_t) + size, 1, f) != 1 || fflush(f) != 0
+        || fsync(fileno(f)) != 0) {
+        fprintf(stderr, "write %s failed\n", tmp);
+        fclose(f);
+        unlink(tmp);
+        goto DONE;
+    }
+    fclose(f);
+    if (rename(tmp, dc->path) != 0) {
+        fprintf(stderr, "rename %s failed\n", tmp);
+        unlink(tmp);
+        goto DONE;
+    }
+    dc->saved = used;
+    r = 0;
+DONE:
+    pthread_mutex_unlock(&dc->lock);
+    if (buf) free(buf);
+    return r;
+}
+
+bool dc_shared(Codec *dc)
+{
+    return dc != NULL && dc->path != NULL;
+}
+
+// the formats learned so far, in place of a dump of the shared codec
+int dc_dump_ref(Codec *dc, char *buf, int size)
+{
+    struct t_codec_ref ref;
+    if (buf == NULL) return sizeof(ref);
+    if (size < sizeof(ref)) return -1;
+    ref.marker = CODEC_REF;
+    ref.id = dc->id;
+    ref.dict_used = __atomic_load_n(&dc->dict_used, __ATOMIC_ACQUIRE);
+    ref.nprefix = dc->nprefix;
+    memcpy(buf, &ref, sizeof(ref));
+    return sizeof(ref);
+}
+
+// 0 if buf refers to dc, 1 if it's a dump, -1 if it refers to another one
+int dc_check_ref(Codec *dc, const char *buf, int size)
+{
+    struct t_codec_ref ref;
+    if (size != sizeof(ref)) return 1;
+    memcpy(&ref, buf, sizeof(ref));
+    if (ref.marker != CODEC_REF) return 1;
+    if (dc == NULL || !dc_shared(dc) || ref.id != dc->id
+        || ref.dict_used > dc->dict_used || ref.nprefix != dc->nprefix) {
+        return -1;
+    }
     return 0;
 }
 
@@ -160,13 +619,62 @@ void dc_destroy(Codec *dc)
     if (dc == NULL) return;
     
     if (dc->rdict) free(dc->rdict);
-    for (i=1; i<dc->dict_used; i++)
+    for (i=1; i<dc->dict_used; i++) {
         free(dc->dict[i]);
+        free(dc->tmpl[i]);
+    }
     if (dc->dict) free(dc->dict);
+    if (dc->tmpl) free(dc->tmpl);
+    for (i=1; i<=dc->nprefix; i++) {
+        free(dc->prefix[i]);
+    }
+    if (dc->prefix) free(dc->prefix);
+    if (dc->plen) free(dc->plen);
+    if (dc->rprefix) free(dc->rprefix);
+    if (dc->path) free(dc->path);
+    pthread_mutex_destroy(&dc->lock);
     free(dc);
 }
 
 int dc_encode(Codec* dc, char* buf, const char* src, int len)
+{
+    return dc_encode2(dc, buf, src, len, true);
+}
+
+static int encode_fmt(Codec* dc, char* buf, const char* src, int len, bool learn);
+
+// learn=false never touches the dictionary, so it is safe under a read lock
+int dc_encode2(Codec* dc, char* buf, const char* src, int len, bool learn)
+{
+    if (dc != NULL && dc->nprefix > 0 && src[0] > 0) {
+        int p = find_prefix(dc, src, len);
+        // the rest can not look like encoded
+        if (p > 0 && (len == dc->plen[p] || src[dc->plen[p]] > 0)) {
+            int plen = dc->plen[p];
+            buf[0] = 0;
+            buf[1] = p;
+            return 2 + encode_fmt(dc, buf + 2, src + plen, len - plen, learn);
+        }
+    }
+    return encode_fmt(dc, buf, src, len, learn);
+}
+
+// index of fmt in dict, or 0 with the empty slot in rdict
+static int find_fmt(Codec *dc, const char *fmt, int flen, uint32_t *slot)
+{
+    uint32_t h = fnv1a(fmt, flen) % dc->rdict_size;
+    int rh;
+    // test hash collision
+    while ((rh = __atomic_load_n(&dc->rdict[h], __ATOMIC_ACQUIRE)) > 0
+            && strcmp(fmt, dc->dict[rh]->fmt) != 0) {
+        h ++;
+        if (h == dc->rdict_size) h = 0;
+    }
+    *slot = h;
+    return rh;
+}
+
+static int encode_fmt(Codec* dc, char* buf, const char* src, int len, bool learn)
 {
     if (dc != NULL && len > 6 && len < 100 && src[0] > 0){
         int m=0;
@@ -218,28 +726,32 @@ int dc_encode(Codec* dc, char* buf, const char* src, int len)
         *dst = 0; // ending 0
         int flen = dst - fmt, prefix;
         if (m > 0 && m <= 2){
-            Fmt **dict = dc->dict;
-            uint32_t h = fnv1a(fmt, flen) % dc->rdict_size;
-            // test hash collision
-            while (dc->rdict[h] > 0 && strcmp(fmt, dict[dc->rdict[h]]->fmt) != 0) {
-                h ++;
-                if (h == dc->rdict_size) h = 0;
-            }
-            int rh = dc->rdict[h];
-            if (rh == 0){
-                if (dc->dict_used < dc->dict_size) {
-                    dict[dc->dict_used] = (Fmt*) malloc(sizeof(Fmt) + flen - 7 + 1);
-                    dict[dc->dict_used]->nargs = m;
-                    memcpy(dict[dc->dict_used]->fmt, fmt, flen + 1);
-                    // fprintf(stderr, "new fmt %d: %s <= %s\n", dc->dict_used, fmt, src);
-                    dc->rdict[h] = rh = dc->dict_used ++;
+            uint32_t h;
+            int rh = find_fmt(dc, fmt, flen, &h);
+            if (rh == 0 && learn){
+                // other trees may learn it at the same time
+                pthread_mutex_lock(&dc->lock);
+                rh = find_fmt(dc, fmt, flen, &h);
+                if (rh == 0 && dc->dict_used < dc->dict_size) {
+                    int i = dc->dict_used;
+                    Fmt *f = (Fmt*) malloc(sizeof(Fmt) + flen - 7 + 1);
+                    f->nargs = m;
+                    memcpy(f->fmt, fmt, flen + 1);
+                    dc->dict[i] = f;
+                    dc->tmpl[i] = tmpl_compile(f);
+                    // fprintf(stderr, "new fmt %d: %s <= %s\n", i, fmt, src);
+                    __atomic_store_n(&dc->dict_used, i + 1, __ATOMIC_RELEASE);
+                    __atomic_store_n(&dc->rdict[h], i, __ATOMIC_RELEASE);
+                    rh = i;
                     if (dc->dict_used == dc->dict_size && dc->dict_size < MAX_DICT_SIZE) {
                         dc_enlarge(dc);
                     }
-                } else {
+                } else if (rh == 0) {
                     fprintf(stderr, "not captched fmt: %s <= %s\n", fmt, src);
-                    dc->rdict[h] = rh = -1; // not again
+                    __atomic_store_n(&dc->rdict[h], -1, __ATOMIC_RELEASE); // not again
+                    rh = -1;
                 }
+                pthread_mutex_unlock(&dc->lock);
             }
             if (rh > 0) {
                 if (rh < 64) {
@@ -262,6 +774,18 @@ RET:
 
 int dc_decode(Codec* dc, char* buf, const char* src, int len)
 {
+    if (src[0] == 0 && len >= 2) {
+        int p = *(unsigned char*)(src + 1);
+        if (p == 0 || p > dc->nprefix) {
+            fprintf(stderr, "invalid prefix index: %d\n", p);
+            return 0;
+        }
+        int plen = dc->plen[p];
+        memcpy(buf, dc->prefix[p], plen);
+        int n = dc_decode(dc, buf + plen, src + 2, len - 2);
+        if (n == 0 && len > 2) return 0;
+        return plen + n;
+    }
     if (src[0] < 0 && len >= 5){
         int idx = -*src;
         int32_t* args = (int32_t*)(src + 1);
@@ -270,8 +794,8 @@ int dc_decode(Codec* dc, char* buf, const char* src, int len)
             idx += (*(unsigned char*)(src+1)) << 6;
             args = (int32_t*)(src + 2);
         }
-        Fmt *f = dc->dict[idx];
-        if (f == NULL) {
+        Tmpl *t = idx < __atomic_load_n(&dc->dict_used, __ATOMIC_ACQUIRE) ? dc->tmpl[idx] : NULL;
+        if (t == NULL) {
             fprintf(stderr, "invalid fmt index: %d\n", idx);
             fprintf(stderr, "invalid key: ");
             for (idx=0; idx < len; idx++) {
@@ -280,20 +804,24 @@ int dc_decode(Codec* dc, char* buf, const char* src, int len)
             fprintf(stderr, "\n");
             return 0;
         }
-        int nlen = f->nargs * sizeof(int32_t) + ((char *)args - src);
+        int nlen = t->nargs * sizeof(int32_t) + ((char *)args - src);
         if (len != nlen) {
             fprintf(stderr, "invalid length of key: %d != %d\n", len, nlen);
             return 0;
         }
-        int rlen = 0;
-        int flen = strlen(f->fmt);
-        switch(f->nargs){
-            case 1: rlen = sprintf(buf, f->fmt, args[0]); break;
-            case 2: rlen = sprintf(buf, f->fmt, args[0], args[1]); break;
-            case 3: rlen = sprintf(buf, f->fmt, args[0], args[1], args[2]); break;
-            default: ; 
+        char *p = buf;
+        const char *s = t->text;
+        int i;
+        for (i=0; i<t->nargs; i++) {
+            memcpy(p, s, t->len[i]);
+            p += t->len[i];
+            s += t->len[i];
+            p += t->hex[i] ? format_hex(p, args[i]) : format_dec(p, args[i]);
         }
-        return rlen;
+        memcpy(p, s, t->len[i]);
+        p += t->len[i];
+        *p = 0;
+        return p - buf;
     }
 COPY:    
     memcpy(buf, src, len);
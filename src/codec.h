@@ -16,17 +16,28 @@
 #ifndef __CODEC_H__
 #define __CODEC_H__
 
+#include <stdbool.h>
+
 typedef struct t_codec Codec;
 
 Codec* dc_new();
 void dc_destroy(Codec *dc);
 
 int dc_encode(Codec* dc, char* buf, const char *src, int len);
+int dc_encode2(Codec* dc, char* buf, const char *src, int len, bool learn);
 int dc_decode(Codec* dc, char* buf, const char *src, int len);
+int dc_train(Codec* dc, const char **keys, const int *lens, int n);
 
 int dc_size(Codec* dc);
 int dc_dump(Codec* dc, char *buf, int size);
 int dc_load(Codec* dc, const char *buf, int size);
 
+// a codec shared by trees, kept in file, snapshots of trees refer to it
+Codec* dc_open(const char *path);
+int dc_save(Codec* dc);
+bool dc_shared(Codec* dc);
+int dc_dump_ref(Codec* dc, char *buf, int size);
+int dc_check_ref(Codec* dc, const char *buf, int size);
+
 #endif
 
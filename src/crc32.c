@@ -16,6 +16,8 @@
 // 获取文件crc32
 
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 
 /* Table computed with Mark Adler's makecrc.c utility.  */
@@ -75,13 +77,132 @@ static const uint32_t crc32_table[256] =
   0x2d02ef8d
 };
 
+/* crc32_slice[k][b] is the crc of byte b followed by k zero bytes, so
+   that 8 bytes can be folded with 8 lookups (slicing-by-8), the result
+   is the same as crc32_table byte by byte.  */
+static uint32_t crc32_slice[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/* x^(2^k) modulo the polynomial, for crc32_combine() */
+static uint32_t crc32_x2n[32];
+
+/* a * b modulo the polynomial, in the reflected bit order */
+static uint32_t
+crc32_multmodp (uint32_t a, uint32_t b)
+{
+  uint32_t m = (uint32_t) 1 << 31, p = 0;
+
+  for (;;)
+    {
+      if (a & m)
+        {
+          p ^= b;
+          if ((a & (m - 1)) == 0)
+            break;
+        }
+      m >>= 1;
+      b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+    }
+  return p;
+}
+
+static void
+crc32_init (void)
+{
+  int i, k;
+  for (i = 0; i < 256; i++)
+    {
+      uint32_t c = crc32_table[i];
+      crc32_slice[0][i] = c;
+      for (k = 1; k < 8; k++)
+        {
+          c = crc32_table[c & 0xff] ^ (c >> 8);
+          crc32_slice[k][i] = c;
+        }
+    }
+  crc32_x2n[0] = (uint32_t) 1 << 30;    /* x^1 */
+  for (k = 1; k < 32; k++)
+    crc32_x2n[k] = crc32_multmodp (crc32_x2n[k - 1], crc32_x2n[k - 1]);
+}
+
 uint32_t
 crc32 (uint32_t crc, unsigned char *buf, size_t len)
 {
   unsigned char *end;
 
   crc = ~crc;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (len >= 16)
+    {
+      pthread_once (&crc32_once, crc32_init);
+      for (; ((uintptr_t) buf & 7) != 0; ++buf, --len)
+        crc = crc32_table[(crc ^ *buf) & 0xff] ^ (crc >> 8);
+      for (; len >= 8; buf += 8, len -= 8)
+        {
+          uint32_t lo = *(uint32_t *) buf ^ crc;
+          uint32_t hi = *(uint32_t *) (buf + 4);
+          crc = crc32_slice[7][lo & 0xff] ^ crc32_slice[6][(lo >> 8) & 0xff]
+            ^ crc32_slice[5][(lo >> 16) & 0xff] ^ crc32_slice[4][lo >> 24]
+            ^ crc32_slice[3][hi & 0xff] ^ crc32_slice[2][(hi >> 8) & 0xff]
+            ^ crc32_slice[1][(hi >> 16) & 0xff] ^ crc32_slice[0][hi >> 24];
+        }
+    }
+#endif
   for (end = buf + len; buf < end; ++buf)
     crc = crc32_table[(crc ^ *buf) & 0xff] ^ (crc >> 8);
   return ~crc;
 }
+
+/* copy LEN bytes from FROM to TO and return the crc of them, in one pass */
+uint32_t
+crc32_copy (uint32_t crc, char *to, const char *from, size_t len)
+{
+  unsigned char *dst = (unsigned char *) to;
+  const unsigned char *src = (const unsigned char *) from, *end;
+
+  crc = ~crc;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (len >= 16)
+    {
+      pthread_once (&crc32_once, crc32_init);
+      for (; ((uintptr_t) src & 7) != 0; ++src, ++dst, --len)
+        {
+          *dst = *src;
+          crc = crc32_table[(crc ^ *src) & 0xff] ^ (crc >> 8);
+        }
+      for (; len >= 8; src += 8, dst += 8, len -= 8)
+        {
+          uint32_t lo = *(const uint32_t *) src;
+          uint32_t hi = *(const uint32_t *) (src + 4);
+          memcpy (dst, &lo, 4);
+          memcpy (dst + 4, &hi, 4);
+          lo ^= crc;
+          crc = crc32_slice[7][lo & 0xff] ^ crc32_slice[6][(lo >> 8) & 0xff]
+            ^ crc32_slice[5][(lo >> 16) & 0xff] ^ crc32_slice[4][lo >> 24]
+            ^ crc32_slice[3][hi & 0xff] ^ crc32_slice[2][(hi >> 8) & 0xff]
+            ^ crc32_slice[1][(hi >> 16) & 0xff] ^ crc32_slice[0][hi >> 24];
+        }
+    }
+#endif
+  for (end = src + len; src < end; ++src, ++dst)
+    {
+      *dst = *src;
+      crc = crc32_table[(crc ^ *src) & 0xff] ^ (crc >> 8);
+    }
+  return ~crc;
+}
+
+/* the crc of A followed by B, from CRC1 of A, CRC2 of B and LEN2 of B,
+   as crc32_combine() of zlib: CRC1 * x^(8 * LEN2) + CRC2 */
+uint32_t
+crc32_combine (uint32_t crc1, uint32_t crc2, size_t len2)
+{
+  uint32_t p = (uint32_t) 1 << 31;      /* x^0 */
+  int k = 3;
+
+  pthread_once (&crc32_once, crc32_init);
+  for (; len2 != 0; len2 >>= 1, k++)
+    if (len2 & 1)
+      p = crc32_multmodp (crc32_x2n[k & 31], p);
+  return crc32_multmodp (p, crc1) ^ crc2;
+}
@@ -12,6 +12,13 @@
  *      Davies Liu <davies.liu@gmail.com>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // syncfs()
+#endif
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +27,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <libgen.h>
+#include <fcntl.h>
 
 #include "diskmgr.h"
 
@@ -167,6 +175,25 @@ const char* mgr_alloc(Mgr *mgr, const char *name)
     return mgr->disks[maxi];
 }
 
+int mgr_sync(Mgr *mgr)
+{
+#ifdef HAVE_SYNCFS
+    int i, r = 0;
+    for (i=0; i<mgr->ndisks; i++) {
+        int fd = open(mgr->disks[i], O_RDONLY);
+        if (fd == -1 || syncfs(fd) != 0) {
+            fprintf(stderr, "sync %s failed\n", mgr->disks[i]);
+            r = -1;
+        }
+        if (fd != -1) close(fd);
+    }
+    return r;
+#else
+    sync();
+    return 0;
+#endif
+}
+
 void mgr_unlink(const char *path)
 {
     struct stat sb;
@@ -25,6 +25,10 @@ void mgr_destroy(Mgr *mgr);
 const char* mgr_base(Mgr *mgr);
 const char* mgr_alloc(Mgr *mgr, const char *path);
 
+// data written into the disks is on stable storage after it, one
+// sync for every disk
+int mgr_sync(Mgr *mgr);
+
 void mgr_unlink(const char *path);
 void mgr_rename(const char *oldpath, const char *newpath);
 
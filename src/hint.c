@@ -39,26 +39,49 @@ struct param {
     int size;
     int curr;
     char* buf;
+    int bucket; // only items in this bucket, -1 for all
 };
 
 void collect_items(Item* it, void* param)
 {
-    int ksize = strlen(it->key);
-    int length = sizeof(HintRecord) + ksize + 1 - NAME_IN_RECORD;
     struct param *p = (struct param *)param;
+    if (p->bucket >= 0 && it->bucket != p->bucket) return;
+    int ksize = strlen(it->key);
+    int length = HINT_RECORD_LENGTH(ksize);
     if (p->size - p->curr < length) {
         p->size *= 2;
         p->buf = (char*)realloc(p->buf, p->size);
     }
 
-    HintRecord *r = (HintRecord*)(p->buf + p->curr);
-    r->ksize = ksize;
-    r->pos = it->pos >> 8;
-    r->version = it->ver;
-    r->hash = it->hash;
-    memcpy(r->key, it->key, r->ksize + 1);
+    p->curr += put_hint_record(p->buf + p->curr, it->key, ksize, POS_OFFSET(ITEM_POS(it)), it->ver,
+            it->hash, it->size);
+}
+
+// the record of empty key before all the others, see HINT_VERSION
+int put_hint_header(char *buf)
+{
+    HintRecord *r = (HintRecord*)buf;
+    r->ksize = 0;
+    r->pos = 0;
+    r->version = HINT_VERSION;
+    r->hash = 0;
+    r->key[0] = 0;
+    return sizeof(HintRecord) - NAME_IN_RECORD + 1;
+}
 
-    p->curr += length;
+int put_hint_record(char *buf, const char *key, int ksize, uint32_t offset, int32_t ver,
+        uint16_t hash, uint8_t size)
+{
+    HintRecord *r = (HintRecord*)buf;
+    r->ksize = ksize;
+    r->pos = offset >> 4;
+    r->version = ver;
+    r->hash = hash;
+    r->key[0] = size;
+    r->key[1] = offset >> 28;
+    memcpy(r->key + 2, key, ksize);
+    r->key[ksize + 2] = 0;
+    return HINT_RECORD_LENGTH(ksize);
 }
 
 // 把HashTree Hint文件写到磁盘上
@@ -96,8 +119,9 @@ void build_hint(HTree* tree, const char* hintpath)
 {
     struct param p;
     p.size = 1024 * 1024;
-    p.curr = 0;
     p.buf = malloc(p.size);
+    p.curr = put_hint_header(p.buf);
+    p.bucket = -1;
 
     ht_visit(tree, collect_items, &p);
     ht_destroy(tree);
@@ -106,6 +130,22 @@ void build_hint(HTree* tree, const char* hintpath)
     free(p.buf);
 }
 
+// build hint from the items of bucket in the view taken by ht_freeze(),
+// the view is released
+void build_bucket_hint(HTree* tree, int bucket, const char* hintpath)
+{
+    struct param p;
+    p.size = 1024 * 1024;
+    p.buf = malloc(p.size);
+    p.curr = put_hint_header(p.buf);
+    p.bucket = bucket;
+
+    ht_visit_frozen(tree, collect_items, &p);
+
+    write_hint_file(p.buf, p.curr, hintpath);
+    free(p.buf);
+}
+
 MFile* open_mfile(const char* path)
 {
     int fd = open(path, O_RDONLY);
@@ -213,6 +253,19 @@ HintFile *open_hint(const char* path, const char* new_path)
         hint->buf = buf;
     }
 
+    hint->version = 1;
+    hint->records = hint->buf;
+    HintRecord *r = (HintRecord*) hint->buf;
+    if (hint->size >= sizeof(HintRecord) - NAME_IN_RECORD + 1 && r->ksize == 0) {
+        if (r->version < 2 || r->version > HINT_VERSION) {
+            fprintf(stderr, "the version %d of %s is not expected\n", r->version, path);
+            close_hint(hint);
+            return NULL;
+        }
+        hint->version = r->version;
+        hint->records = hint->buf + sizeof(HintRecord) - NAME_IN_RECORD + 1;
+    }
+
     if (new_path != NULL) {
         write_hint_file(hint->buf, hint->size, new_path);
     }
@@ -244,22 +297,62 @@ void scanHintFile(HTree* tree, int bucket, const char* path, const char* new_pat
 
     // P                     HintFile                     End
     // | HintRecord / HintRecord / HintRecord / HintRecord |
-    char *p = hint->buf, *end = hint->buf + hint->size;
+    char *p = hint->records, *end = hint->buf + hint->size;
     while (p < end) {
         HintRecord *r = (HintRecord*) p;
-        p += sizeof(HintRecord) - NAME_IN_RECORD + r->ksize + 1;
+        p += HINT_LENGTH(hint, r);
         if (p > end){
             fprintf(stderr, "scan %s: unexpected end, need %ld byte\n", path, p - end);
             break;
         }
-        uint32_t pos = (r->pos << 8) | (bucket & 0xff);
+        uint64_t pos = MAKE_POS(bucket & 0xff, HINT_POS(hint, r));
         if (r->version > 0)
-            ht_add2(tree, r->key, r->ksize, pos, r->hash, r->version);
+            ht_add2(tree, HINT_KEY(hint, r), r->ksize, pos, r->hash, r->version, HINT_SIZE(hint, r));
         else
-            ht_remove2(tree, r->key, r->ksize);
+            ht_remove2(tree, HINT_KEY(hint, r), r->ksize);
+    }
+
+    close_hint(hint);
+}
+
+#define SAMPLE_KEYS 16384
+
+// learn the prefixes of keys for a new codec, from keys evenly
+// sampled from a hint file
+int trainHintFile(Codec* dc, const char* path)
+{
+    HintFile* hint = open_hint(path, NULL);
+    if (hint == NULL) return -1;
+
+    const char **keys = (const char**) malloc(sizeof(char*) * SAMPLE_KEYS);
+    int *lens = (int*) malloc(sizeof(int) * SAMPLE_KEYS);
+    int i = 0, n = 0, total = 0;
+    char *p = hint->records, *end = hint->buf + hint->size;
+    while (p < end) {
+        HintRecord *r = (HintRecord*) p;
+        p += HINT_LENGTH(hint, r);
+        if (p > end) break;
+        total ++;
+    }
+
+    int step = total / SAMPLE_KEYS + 1;
+    p = hint->records;
+    while (p < end && n < SAMPLE_KEYS) {
+        HintRecord *r = (HintRecord*) p;
+        p += HINT_LENGTH(hint, r);
+        if (p > end) break;
+        if (i++ % step == 0) {
+            keys[n] = HINT_KEY(hint, r);
+            lens[n] = r->ksize;
+            n ++;
+        }
     }
+    int r = n > 0 ? dc_train(dc, keys, lens, n) : 0;
 
+    free(keys);
+    free(lens);
     close_hint(hint);
+    return r;
 }
 
 int count_deleted_record(HTree* tree, int bucket, const char* path, int *total)
@@ -270,21 +363,21 @@ int count_deleted_record(HTree* tree, int bucket, const char* path, int *total)
         return 0;
     }
 
-    char *p = hint->buf, *end = hint->buf + hint->size;
+    char *p = hint->records, *end = hint->buf + hint->size;
     int deleted = 0;
     while (p < end) {
         HintRecord *r = (HintRecord*) p;
-        p += sizeof(HintRecord) - NAME_IN_RECORD + r->ksize + 1;
+        p += HINT_LENGTH(hint, r);
         if (p > end){
             fprintf(stderr, "scan %s: unexpected end, need %ld byte\n", path, p - end);
             break;
         }
         (*total) ++;
-        Item *it = ht_get2(tree, r->key, r->ksize);
-        if (it == NULL || it->pos != ((r->pos << 8) | bucket) || it->ver <= 0) {
+        Item it;
+        if (!ht_lookup(tree, HINT_KEY(hint, r), r->ksize, &it)
+            || ITEM_POS(&it) != MAKE_POS(bucket, HINT_POS(hint, r)) || it.ver <= 0) {
             deleted ++;
         }
-        if (it) free(it);
     }
 
     close_hint(hint);
@@ -39,17 +39,39 @@ typedef struct hint_record {
     char key[NAME_IN_RECORD]; // allign
 } HintRecord;
 
+// Since version 2, a hint file starts with a record of empty key, which
+// has the version, and the size class of record is put before the key.
+// Since version 3, pos is in 16 bytes (256 before), and the high byte of
+// it is put after the size class.
+#define HINT_VERSION 3
+#define HINT_EXTRA(h) (((h)->version > 1) + ((h)->version > 2))
+#define HINT_SIZE(h, r) ((h)->version > 1 ? (uint8_t)(r)->key[0] : 0)
+#define HINT_KEY(h, r) ((r)->key + HINT_EXTRA(h))
+#define HINT_LENGTH(h, r) (sizeof(HintRecord) - NAME_IN_RECORD + HINT_EXTRA(h) + (r)->ksize + 1)
+// offset of the record in data file
+#define HINT_POS(h, r) ((h)->version > 2 \
+        ? ((uint32_t)(r)->pos | (uint32_t)(uint8_t)(r)->key[1] << 24) << 4 : (uint32_t)(r)->pos << 8)
+// length of the record written by put_hint_record()
+#define HINT_RECORD_LENGTH(ksize) (sizeof(HintRecord) - NAME_IN_RECORD + 2 + (ksize) + 1)
+
 typedef struct {
     MFile *f; // 内存映射文件
     size_t size;
     char *buf;
+    int version;
+    char *records;  // after the header
 } HintFile;
 
 HintFile *open_hint(const char* path, const char* new_path);
 void close_hint(HintFile *hint);
 void scanHintFile(HTree* tree, int bucket, const char* path, const char* new_path);
+int trainHintFile(Codec* dc, const char* path);
 void build_hint(HTree* tree, const char* path);
+void build_bucket_hint(HTree* tree, int bucket, const char* path);
 void write_hint_file(char *buf, int size, const char *path);
+int put_hint_header(char *buf);
+int put_hint_record(char *buf, const char *key, int ksize, uint32_t offset, int32_t ver,
+        uint16_t hash, uint8_t size);
 int count_deleted_record(HTree* tree, int bucket, const char* path, int *total);
 
 #endif
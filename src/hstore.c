@@ -29,18 +29,36 @@
 #include "hstore.h"
 #include "bitcask.h"
 #include "diskmgr.h"
+#include "record.h"
 
 #define NUM_OF_MUTEX 37
 #define MAX_PATHS 20
+#define CODEC_FILE "codec"
 const int APPEND_FLAG  = 0x00000100;
 const int INCR_FLAG    = 0x00000204;
 
+// group commit: the writers wait for the committer, which flushes the
+// bitcasks they wrote into and syncs the disks once for all of them
+typedef struct t_commit {
+    int window, batch;
+    bool quit;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup, done;
+    uint64_t waiting, committed;    // sequence of SETs
+    uint64_t syncs;
+    uint64_t hist[COMMIT_HIST_SIZE];
+    uint8_t *dirty;                 // bitcasks to be flushed
+} Commit;
+
 struct t_hstore {
     int height, count; // 文件夹深度
     time_t before;
     int scan_threads;
     int op_start, op_end, op_limit; // for optimization
     Mgr* mgr;
+    Codec* dc; // shared by all the trees
+    Commit *commit; // NULL if SETs are not synced
     pthread_mutex_t locks[NUM_OF_MUTEX];
     Bitcask* bitcasks[];
 };
@@ -61,6 +79,8 @@ inline pthread_mutex_t* get_mutex(HStore *store, char *key)
 
 
 // scan
+// digests of values kept by bitcasks of a store
+static int digest_keys = 0;
 static int scan_completed = 0;
 static pthread_mutex_t scan_lock;
 static pthread_cond_t  scan_cond;
@@ -202,6 +222,19 @@ HStore* hs_open(char *path, int height, time_t before, int scan_threads)
         pthread_mutex_init(&store->locks[i], NULL);
     }
 
+    // key formats are learned once for the store, prefixes of keys are
+    // learned from hints when the codec is created
+    char codec_path[255];
+    sprintf(codec_path, "%s/%s", paths[0], CODEC_FILE);
+    bool new_codec = access(codec_path, F_OK) != 0;
+    store->dc = dc_open(codec_path);
+    if (store->dc == NULL) {
+        fprintf(stderr, "open %s failed, remove it and rebuild the trees\n", codec_path);
+        unlink(codec_path);
+        new_codec = true;
+        store->dc = dc_open(codec_path);
+    }
+
     char *buf[20] = {0};
     for (i=0;i<npath;i++) {
         buf[i] = malloc(255);
@@ -221,12 +254,20 @@ HStore* hs_open(char *path, int height, time_t before, int scan_threads)
         // /home/girl/data/0 /home/girl/data/1 /home/girl/data/2 ...
         Mgr *mgr = mgr_create((const char**)buf, npath);
         if (mgr == NULL) return NULL;
-        store->bitcasks[i] = bc_open2(mgr, height, i, before);
+        store->bitcasks[i] = bc_open2(mgr, height, i, before, store->dc);
+        if (digest_keys > 0) {
+            bc_set_digests(store->bitcasks[i], digest_keys / count);
+        }
     }
     for (i=0;i<npath;i++) {
         free(buf[i]);
     }
 
+    for (i=0; new_codec && i<count; i++) {
+        if (bc_train(store->bitcasks[i], store->dc) >= 0) break;
+    }
+    if (new_codec) dc_save(store->dc);
+
     if (store->scan_threads > 1 && count > 1) {
         parallelize(store, bc_scan);
     }else{
@@ -248,12 +289,148 @@ void hs_flush(HStore *store, int limit, int period)
     }
 }
 
+void hs_snapshot(HStore *store, int period)
+{
+    if (!store) return;
+    if (store->before > 0) return;
+    int i;
+    for (i=0; i<store->count; i++){
+        bc_snapshot(store->bitcasks[i], period);
+    }
+}
+
+static void* commit_thread(void *param)
+{
+    HStore *store = (HStore*) param;
+    Commit *c = store->commit;
+    uint8_t *dirty = malloc(store->count);
+    int i;
+    pthread_mutex_lock(&c->lock);
+    // the waiting ones are committed before quit
+    while (!c->quit || c->waiting > c->committed) {
+        if (c->waiting == c->committed) {
+            pthread_cond_wait(&c->wakeup, &c->lock);
+            continue;
+        }
+        // more SETs join in the window
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += c->window * 1000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!c->quit && c->window > 0 && c->waiting - c->committed < c->batch
+               && pthread_cond_timedwait(&c->wakeup, &c->lock, &deadline) == 0);
+
+        uint64_t seq = c->waiting;
+        memcpy(dirty, c->dirty, store->count);
+        memset(c->dirty, 0, store->count);
+        pthread_mutex_unlock(&c->lock);
+
+        for (i=0; i<store->count; i++) {
+            if (dirty[i]) bc_flush(store->bitcasks[i], 0, 0);
+        }
+        // the records flushed by others are synced too
+        if (mgr_sync(store->mgr) != 0) {
+            fprintf(stderr, "sync failed, the records may be lost\n");
+            exit(1);
+        }
+
+        pthread_mutex_lock(&c->lock);
+        c->committed = seq;
+        c->syncs ++;
+        pthread_cond_broadcast(&c->done);
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(dirty);
+    return NULL;
+}
+
+int hs_group_commit(HStore *store, int window, int batch)
+{
+    if (!store || store->commit) return -1;
+    Commit *c = (Commit*) malloc(sizeof(Commit));
+    memset(c, 0, sizeof(Commit));
+    c->window = window;
+    c->batch = batch > 0 ? batch : 1;
+    c->dirty = malloc(store->count);
+    memset(c->dirty, 0, store->count);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wakeup, NULL);
+    pthread_cond_init(&c->done, NULL);
+    store->commit = c;
+    if (pthread_create(&c->tid, NULL, commit_thread, store) != 0) {
+        fprintf(stderr, "create commit thread failed\n");
+        store->commit = NULL;
+        free(c->dirty);
+        free(c);
+        return -1;
+    }
+    return 0;
+}
+
+static inline int hist_index(uint64_t us)
+{
+    int i = 0;
+    while (us > 1 && i < COMMIT_HIST_SIZE - 1) {
+        us >>= 1;
+        i ++;
+    }
+    return i;
+}
+
+// wait for the record written into bitcask index to be synced
+static void wait_commit(HStore *store, int index)
+{
+    Commit *c = store->commit;
+    struct timespec st, ed;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    pthread_mutex_lock(&c->lock);
+    uint64_t seq = ++ c->waiting;
+    c->dirty[index] = 1;
+    pthread_cond_signal(&c->wakeup);
+    while (c->committed < seq) {
+        pthread_cond_wait(&c->done, &c->lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ed);
+    c->hist[hist_index((ed.tv_sec - st.tv_sec) * 1000000 + (ed.tv_nsec - st.tv_nsec) / 1000)] ++;
+    pthread_mutex_unlock(&c->lock);
+}
+
+bool hs_commit_stat(HStore *store, uint64_t *commits, uint64_t *syncs, uint64_t *hist)
+{
+    Commit *c = store->commit;
+    if (c == NULL) return false;
+    pthread_mutex_lock(&c->lock);
+    *commits = c->committed;
+    *syncs = c->syncs;
+    memcpy(hist, c->hist, sizeof(c->hist));
+    pthread_mutex_unlock(&c->lock);
+    return true;
+}
+
+static void stop_commit(HStore *store)
+{
+    Commit *c = store->commit;
+    pthread_mutex_lock(&c->lock);
+    c->quit = true;
+    pthread_cond_signal(&c->wakeup);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->tid, NULL);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->wakeup);
+    pthread_cond_destroy(&c->done);
+    free(c->dirty);
+    free(c);
+    store->commit = NULL;
+}
+
 void hs_close(HStore *store)
 {
     int i;
     if (!store) return;
     // stop optimizing
     store->op_start = store->op_end = 0;
+    if (store->commit) stop_commit(store);
 
     if (store->scan_threads > 1 && store->count > 1) {
         parallelize(store, bc_close);
@@ -262,6 +439,7 @@ void hs_close(HStore *store)
             bc_close(store->bitcasks[i]);
         }
     }
+    dc_destroy(store->dc);
     mgr_destroy(store->mgr);
     free(store);
 }
@@ -325,6 +503,15 @@ static char* hs_list(HStore *store, char *key)
 
 char *hs_get(HStore *store, char *key, int *vlen, uint32_t *flag)
 {
+    return hs_get2(store, key, vlen, flag, 0, false, NULL, NULL);
+}
+
+// value of key, or NULL with *fd >= 0 if fd is not NULL and the value
+// (larger than min_size) can be sent by sendfile() from *fd at offset
+char *hs_get2(HStore *store, char *key, int *vlen, uint32_t *flag,
+        int min_size, bool check_crc, int *fd, off_t *offset)
+{
+    if (fd != NULL) *fd = -1;
     if (!key || !store) return NULL;
 
     if (key[0] == '@'){
@@ -340,10 +527,22 @@ char *hs_get(HStore *store, char *key, int *vlen, uint32_t *flag)
         key ++;
     }
     int index = get_index(store, key);
-    DataRecord *r = bc_get(store->bitcasks[index], key);
+    DataRecord *r = bc_get2(store->bitcasks[index], key, min_size, check_crc,
+            info ? NULL : fd, offset);
     if (r == NULL){
         return NULL;
     }
+    if (fd != NULL && *fd >= 0) {
+        if (r->version > 0) {
+            *vlen = r->vsz;
+            *flag = r->flag;
+        } else {
+            close(*fd);
+            *fd = -1;
+        }
+        free_record(r);
+        return NULL;
+    }
 
     char *res = NULL;
     if (info){
@@ -376,7 +575,9 @@ bool hs_set(HStore *store, char *key, char* value, int vlen, uint32_t flag, int
     if (store->before > 0) return false;
 
     int index = get_index(store, key);
-    return bc_set(store->bitcasks[index], key, value, vlen, flag, ver);
+    bool suc = bc_set(store->bitcasks[index], key, value, vlen, flag, ver);
+    if (suc && store->commit) wait_commit(store, index);
+    return suc;
 }
 
 bool hs_append(HStore *store, char *key, char* value, int vlen)
@@ -480,7 +681,9 @@ bool hs_delete(HStore *store, char *key)
     if (store->before > 0) return false;
 
     int index = get_index(store, key);
-    return bc_delete(store->bitcasks[index], key);
+    bool suc = bc_delete(store->bitcasks[index], key);
+    if (suc && store->commit) wait_commit(store, index);
+    return suc;
 }
 
 uint64_t hs_count(HStore *store, uint64_t *curr)
@@ -510,3 +713,41 @@ void    hs_stat(HStore *store, uint64_t *total, uint64_t *avail)
     uint64_t total_space;
     mgr_stat(store->mgr, &total_space, avail);
 }
+
+void    hs_index_stat(HStore *store, uint64_t *allocated, uint64_t *used)
+{
+    uint64_t a = 0, u = 0;
+    *allocated = *used = 0;
+    int i;
+    for (i=0; i<store->count; i++) {
+        bc_index_stat(store->bitcasks[i], &a, &u);
+        *allocated += a;
+        *used += u;
+    }
+}
+
+uint32_t hs_max_lock_hold(HStore *store)
+{
+    uint32_t m = 0, t;
+    int i;
+    for (i=0; i<store->count; i++) {
+        t = bc_max_lock_hold(store->bitcasks[i]);
+        if (t > m) m = t;
+    }
+    return m;
+}
+
+void hs_set_digests(int keys)
+{
+    digest_keys = keys;
+}
+
+int hs_set_compressor(const char *spec)
+{
+    return set_compressor(spec);
+}
+
+int hs_load_compress_dict(const char *path)
+{
+    return load_compress_dict(path);
+}
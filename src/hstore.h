@@ -21,11 +21,29 @@ HStore* hs_open(char *path, int height, time_t before, int scan_threads);
 void    hs_flush(HStore *store, int limit, int period);
 void    hs_close(HStore *store);
 char*   hs_get(HStore *store, char *key, int *vlen, uint32_t *flag);
+char*   hs_get2(HStore *store, char *key, int *vlen, uint32_t *flag,
+                int min_size, bool check_crc, int *fd, off_t *offset);
 bool    hs_set(HStore *store, char *key, char* value, int vlen, uint32_t flag, int version);
 bool    hs_append(HStore *store, char *key, char* value, int vlen);
 int64_t hs_incr(HStore *store, char *key, int64_t value); 
 bool    hs_delete(HStore *store, char *key);
 uint64_t hs_count(HStore *store, uint64_t *curr);
 void    hs_stat(HStore *store, uint64_t *total, uint64_t *avail);
+void    hs_index_stat(HStore *store, uint64_t *allocated, uint64_t *used);
+uint32_t hs_max_lock_hold(HStore *store);
 bool    hs_optimize(HStore *store, int limit);
+void    hs_snapshot(HStore *store, int period);
+// SETs return after their records are synced to disk, the waiting ones
+// are synced together once per window (us) or batch of SETs
+int     hs_group_commit(HStore *store, int window, int batch);
+// SETs committed, syncs, and histogram of commit latency, hist[i] for
+// [2^i, 2^(i+1)) us, false if group commit is not enabled
+#define COMMIT_HIST_SIZE 21
+bool    hs_commit_stat(HStore *store, uint64_t *commits, uint64_t *syncs, uint64_t *hist);
+// compressors of values, should be set before hs_open()
+int     hs_set_compressor(const char *spec);
+int     hs_load_compress_dict(const char *path);
+// keep digests of the latest values of about the number of keys, should be set
+// before hs_open()
+void    hs_set_digests(int keys);
 #endif
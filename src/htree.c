@@ -12,6 +12,9 @@
  *      Davies Liu <davies.liu@gmail.com>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np()
+#endif
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -19,6 +22,12 @@
 #include <assert.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "fnv1a.h"
 #include "htree.h"
@@ -26,26 +35,108 @@
 
 const int MAX_KEY_LENGTH = 200;
 const int BUCKET_SIZE = 16;
-const int SPLIT_LIMIT = 64;
+const uint32_t SPLIT_LIMIT = 64;
+const uint32_t MERGE_LIMIT = 32; // lower than SPLIT_LIMIT, avoid split/merge again and again
 const int MAX_DEPTH = 8;
 static const long long g_index[] = {0, 1, 17, 273, 4369, 69905, 1118481, 17895697, 286331153, 4581298449L};
 
-const char VERSION[] = "HTREE001";
+const char VERSION[] = "HTREE003";
+const char VERSION2[] = "HTREE002";
+const char VERSION1[] = "HTREE001";
 
 #define max(a,b) ((a)>(b)?(a):(b))
+#define min(a,b) ((a)<(b)?(a):(b))
 #define INDEX(it) (0x0f & (keyhash >> ((7 - node->depth - tree->depth) * 4)))
-#define KEYLENGTH(it) ((it)->length-sizeof(Item)+ITEM_PADDING)
+#define ITEM_HEAD (sizeof(Item) - ITEM_PADDING)
+#define KEYLENGTH(it) ((it)->length-ITEM_HEAD)
 #define HASH(it) ((it)->hash * ((it)->ver>0))
+#define NEXT_ITEM(it) ((Item*)((char*)(it) + (it)->length))
+// one byte per item, folded from all of keyhash, because the items in
+// a leaf share the high nibbles used by INDEX()
+#define FINGERPRINT(h) ((uint8_t)((h) ^ ((h) >> 8) ^ ((h) >> 16) ^ ((h) >> 24)))
 
+// Data block: header, fingerprints (slots bytes), key hashes (slots
+// uint32_t), packed items
 typedef struct t_data Data;
 struct t_data {
     int size;
     int used;
     int count;
-    Item head[0];
+    int slots;      // capacity of fp[], multiple of BUCKET_SIZE
+    int node;       // id of the owner node
+    uint8_t fp[0];
+};
+#define SLOT_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+
+// the on-disk layout of HTREE001, without fingerprints
+struct t_data_v1 {
+    int size;
+    int used;
+    int count;
+    char head[0];
+};
+
+// the items of HTREE001 and HTREE002, without size class
+struct t_item_v2 {
+    uint32_t pos;
+    int32_t  ver;
+    uint16_t hash;
+    uint8_t  length;
+    char     key[1];
+};
+#define ITEM_HEAD_V2 (sizeof(struct t_item_v2) - 1)
+
+// Data blocks are allocated from an arena owned by the tree, in size
+// classes (8 classes per power of 2), freed blocks are kept in per-class
+// free lists and all the memory is released in ht_destroy().
+static const int size_classes[] = {
+    32, 48, 64, 80, 96, 112, 128,
+    144, 160, 176, 192, 208, 224, 240, 256,
+    288, 320, 352, 384, 416, 448, 480, 512,
+    576, 640, 704, 768, 832, 896, 960, 1024,
+    1152, 1280, 1408, 1536, 1664, 1792, 1920, 2048,
+    2304, 2560, 2816, 3072, 3328, 3584, 3840, 4096,
+    4608, 5120, 5632, 6144, 6656, 7168, 7680, 8192,
+    9216, 10240, 11264, 12288, 13312, 14336, 15360, 16384,
+};
+#define NUM_CLASSES (sizeof(size_classes) / sizeof(int))
+#define MAX_CLASS_SIZE 16384
+#define CHUNK_SIZE (256 << 10) // aligned, only the touched pages take memory
+#define CHUNK_OF(p) ((Chunk*)((uintptr_t)(p) & ~(uintptr_t)(CHUNK_SIZE - 1)))
+#define MIN_COMPACT (1 << 20)
+
+// A chunk is a sequence of blocks, every block starts with its size,
+// followed by `used` of Data, FREE_BLOCK or DEAD_BLOCK.
+#define FREE_BLOCK -1
+#define DEAD_BLOCK -2   // 16 bytes left by cutting, too small to reuse
+
+typedef struct t_free_block FreeBlock;
+struct t_free_block {
+    int size;
+    int used;
+    FreeBlock *next, *prev;
+};
+
+typedef struct t_chunk Chunk;
+struct t_chunk {
+    Chunk *next;
+    int used;           // bytes of blocks
+    int live;           // bytes of Data blocks
+    char data[0];
+};
+
+typedef struct t_arena Arena;
+struct t_arena {
+    Chunk *chunks;      // the first one is the current
+    FreeBlock *free[NUM_CLASSES];
+    uint64_t allocated; // bytes of chunks (touched part) and big blocks
+    uint64_t used;      // bytes used by Data blocks
+    uint64_t free_bytes;    // bytes in free lists
+    uint64_t compact_limit; // compact() when free_bytes is above it
 };
 
 typedef struct t_node Node;
+typedef struct t_view View;
 struct t_node {
     uint16_t is_node:1;
     uint16_t valid:1;
@@ -53,7 +144,44 @@ struct t_node {
     uint16_t flag:9;
     uint16_t hash;
     uint32_t count;
-    Data *data;
+    union {
+        Data *data;     // leaf
+        struct t_node *child;   // node, the group of children
+    };
+};
+
+// The children of a node are allocated together (a group of 16) from
+// aligned chunks, only when it's split. The first group of a chunk keeps
+// the index of chunk, so a node can be named by a 32-bit id,
+// chunk << NODE_BITS | offset in chunk, which is kept in Data and used
+// to find the node in a copy of the pool.
+#define NODE_BITS 14    // CHUNK_SIZE / sizeof(Node)
+#define NODES_PER_CHUNK (1 << NODE_BITS)
+#define NODE_OF(chunks, id) ((chunks)[(id) >> NODE_BITS] + ((id) & (NODES_PER_CHUNK - 1)))
+#define GROUP_SIZE (sizeof(Node) * BUCKET_SIZE)
+
+typedef struct t_pool Pool;
+struct t_pool {
+    Node **chunks;
+    int nchunks, size;
+    uint32_t next;      // id of the next unused group
+    Node *free;         // freed groups, linked by child of the first node
+    uint32_t groups;    // groups in use
+    uint64_t allocated; // bytes of groups cut from chunks
+};
+
+// a consistent view of the tree for ht_save(), the leaves are shared with
+// the tree until they are changed
+struct t_view {
+    int height;
+    Node *root;
+    Node **chunks;      // copy of node pool, the part before limit
+    int nchunks;
+    uint32_t limit;
+    char *codec;        // dump of codec, or reference to the shared one
+    int codec_size;
+    Data **garbage;     // shared leaves replaced in tree, freed after saving
+    int ngarbage, garbage_size;
 };
 
 struct t_hash_tree {
@@ -61,43 +189,416 @@ struct t_hash_tree {
     int pos;
     int height;
     Node *root;
+    Pool pool;
     Codec *dc;
-    pthread_mutex_t lock;
+    bool shared_dc;     // dc is shared with other trees, not owned
+    Arena arena;
+    pthread_rwlock_t lock;
+    uint32_t max_hold;  // the longest time the lock is held for writing, in us
+    char *snapshot;     // Data blocks loaded from HTREE003, used in place
+    size_t snapshot_size;
+    bool snapshot_mapped;
+    View *frozen;
     char buf[512];
 };
 
 
 // forward dec
-static void add_item(HTree *tree, Node *node, Item *it, uint32_t keyhash, bool enlarge);
+static void add_item(HTree *tree, Node *node, Item *it, uint32_t keyhash);
 static void remove_item(HTree *tree, Node *node, Item *it, uint32_t keyhash);
 static void split_node(HTree *tree, Node *node);
 static void merge_node(HTree *tree, Node *node);
 static void update_node(HTree *tree, Node *node);
 
-inline uint32_t get_pos(HTree *tree, Node *node)
+inline Node *get_child(HTree *tree, Node *node, int b)
 {
-    return (node - tree->root) - g_index[(int)node->depth];
+    return node->child + b;
 }
 
-inline Node *get_child(HTree *tree, Node *node, int b)
+static int size_class(int size)
+{
+    int lo = 0, hi = NUM_CLASSES - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (size_classes[mid] < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// round size up to the size of block, which grows geometrically
+static int block_size(int size)
+{
+    if (size <= MAX_CLASS_SIZE) {
+        return size_classes[size_class(size)];
+    }
+    int step = MAX_CLASS_SIZE / 8;
+    while (step * 8 < size) step *= 2;
+    return (size + step - 1) / step * step;
+}
+
+static void unlink_block(Arena *arena, FreeBlock *b)
+{
+    int c = size_class(b->size);
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        arena->free[c] = b->next;
+    }
+    if (b->next) b->next->prev = b->prev;
+    arena->free_bytes -= b->size;
+    CHUNK_OF(b)->live += b->size;
+}
+
+static void arena_free(Arena *arena, void *p, int size)
+{
+    if (size > MAX_CLASS_SIZE) {
+        arena->allocated -= size;
+        free(p);
+        return;
+    }
+    int c = size_class(size);
+    FreeBlock *b = (FreeBlock*) p;
+    b->size = size_classes[c];
+    b->used = FREE_BLOCK;
+    b->prev = NULL;
+    b->next = arena->free[c];
+    if (b->next) b->next->prev = b;
+    arena->free[c] = b;
+    arena->free_bytes += b->size;
+    CHUNK_OF(b)->live -= b->size;
+}
+
+static Chunk* new_chunk(void)
+{
+    // mmap()ed, so released chunks are given back to the system
+    char *p = (char*) mmap(NULL, CHUNK_SIZE * 2, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Out of memory: mmap %d bytes for htree\n", CHUNK_SIZE * 2);
+        exit(1);
+    }
+    char *c = (char*)CHUNK_OF(p + CHUNK_SIZE - 1);
+    if (c > p) munmap(p, c - p);
+    if (c < p + CHUNK_SIZE) munmap(c + CHUNK_SIZE, p + CHUNK_SIZE - c);
+    return (Chunk*)c;
+}
+
+static void* arena_alloc(Arena *arena, int size)
+{
+    if (size > MAX_CLASS_SIZE) {
+        arena->allocated += size;
+        return malloc(size);
+    }
+
+    int c = size_class(size), i;
+    FreeBlock *b = arena->free[c];
+    if (b != NULL) {
+        unlink_block(arena, b);
+        return b;
+    }
+
+    // the big blocks freed by split_node() are cut into smaller ones,
+    // otherwise they will never be reused
+    size = size_classes[c];
+    for (i=c+1; i<(int)NUM_CLASSES; i++) {
+        b = arena->free[i];
+        if (b != NULL) {
+            unlink_block(arena, b);
+            int left = size_classes[i] - size;
+            char *q = (char*)b + size;
+            while (left > 16) {
+                int k = size_class(left);
+                if (size_classes[k] > left) k--;
+                arena_free(arena, q, size_classes[k]);
+                q += size_classes[k];
+                left -= size_classes[k];
+            }
+            if (left > 0) {
+                ((FreeBlock*)q)->size = left;
+                ((FreeBlock*)q)->used = DEAD_BLOCK;
+                CHUNK_OF(q)->live -= left;
+            }
+            return b;
+        }
+    }
+
+    Chunk *chunk = arena->chunks;
+    if (chunk == NULL || CHUNK_SIZE - sizeof(Chunk) - chunk->used < (size_t)size) {
+        Chunk *c = new_chunk();
+        c->next = chunk;
+        c->used = 0;
+        c->live = 0;
+        arena->chunks = chunk = c;
+        arena->allocated += sizeof(Chunk);
+    }
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    chunk->live += size;
+    arena->allocated += size;
+    return p;
+}
+
+static void arena_destroy(Arena *arena)
+{
+    while (arena->chunks != NULL) {
+        Chunk *c = arena->chunks;
+        arena->chunks = c->next;
+        munmap(c, CHUNK_SIZE);
+    }
+}
+
+static inline uint32_t node_id(Node *node)
+{
+    Node *c = (Node*)CHUNK_OF(node);
+    return *(uint32_t*)c << NODE_BITS | (node - c);
+}
+
+// a group of 16 empty nodes at depth
+static Node* alloc_group(HTree *tree, int depth)
+{
+    Pool *pool = &tree->pool;
+    Node *child = pool->free;
+    int i;
+    if (child != NULL) {
+        pool->free = child->child;
+    } else {
+        if ((pool->next & (NODES_PER_CHUNK - 1)) == 0) {
+            if (pool->nchunks == pool->size) {
+                pool->size = max(pool->size * 2, 16);
+                pool->chunks = (Node**)realloc(pool->chunks, sizeof(Node*) * pool->size);
+            }
+            Node *c = (Node*)new_chunk();
+            *(uint32_t*)c = pool->nchunks;
+            pool->chunks[pool->nchunks] = c;
+            pool->next = pool->nchunks << NODE_BITS | BUCKET_SIZE;
+            pool->nchunks ++;
+            pool->allocated += GROUP_SIZE;
+        }
+        child = NODE_OF(pool->chunks, pool->next);
+        pool->next += BUCKET_SIZE;
+        pool->allocated += GROUP_SIZE;
+    }
+
+    memset(child, 0, GROUP_SIZE);
+    for (i=0; i<BUCKET_SIZE; i++) {
+        child[i].depth = depth;
+    }
+    pool->groups ++;
+    if (depth + 1 > tree->height) {
+        tree->height = depth + 1;
+    }
+    return child;
+}
+
+// cleared, so a copy of it in the view has no Data
+static void free_group(HTree *tree, Node *child)
+{
+    Pool *pool = &tree->pool;
+    memset(child, 0, GROUP_SIZE);
+    child->child = pool->free;
+    pool->free = child;
+    pool->groups --;
+}
+
+static void pool_destroy(Pool *pool)
+{
+    int i;
+    for (i=0; i<pool->nchunks; i++) {
+        munmap(pool->chunks[i], CHUNK_SIZE);
+    }
+    free(pool->chunks);
+    memset(pool, 0, sizeof(Pool));
+}
+
+static inline Data* alloc_data(HTree *tree, int size)
 {
-    int i = g_index[node->depth + 1] + (get_pos(tree, node) << 4) + b;
-    return tree->root + i;
+    size = block_size(size);
+    Data *data = (Data*) arena_alloc(&tree->arena, size);
+    data->size = size;
+    return data;
 }
 
-inline Data* get_data(Node *node)
+#define IN_SNAPSHOT(tree, d) ((char*)(d) >= (tree)->snapshot \
+        && (char*)(d) < (tree)->snapshot + (tree)->snapshot_size)
+
+static inline Data* get_data(Node *node)
 {
     return node->data;
 }
 
-inline void set_data(Node *node, Data *data)
+// blocks never move between nodes, so the leaf is shared with the view
+// if the node with same id has the same block
+static inline bool is_frozen(HTree *tree, Node *node)
+{
+    View *v = tree->frozen;
+    if (v == NULL) return false;
+    uint32_t id = node_id(node);
+    return id < v->limit && NODE_OF(v->chunks, id)->data == node->data;
+}
+
+static void add_garbage(View *v, Data *data)
+{
+    if (v->ngarbage == v->garbage_size) {
+        v->garbage_size = max(v->garbage_size * 2, 1024);
+        v->garbage = (Data**)realloc(v->garbage, sizeof(Data*) * v->garbage_size);
+    }
+    v->garbage[v->ngarbage++] = data;
+}
+
+static inline void set_data(HTree *tree, Node *node, Data *data)
 {
     if (data != node->data) {
-        if (node->data) free(node->data);
+        if (node->data) {
+            tree->arena.used -= node->data->used;
+            if (is_frozen(tree, node)) {
+                add_garbage(tree->frozen, node->data);
+            } else if (!IN_SNAPSHOT(tree, node->data)) {
+                arena_free(&tree->arena, node->data, node->data->size);
+            }
+        }
+        if (data) {
+            tree->arena.used += data->used;
+            if (!IN_SNAPSHOT(tree, data)) {
+                data->node = node_id(node); // pages of snapshot are not touched
+            }
+        }
         node->data = data;
     }
 }
 
+// All the leaves grow at about the same pace, so the blocks of a size
+// class are freed together and will not be reused until the next split.
+// When an eighth of the arena is free, the live blocks in the chunk with
+// lowest usage are moved out, then the chunk is released, one chunk in
+// a call to keep the lock time short.
+// Data pointers are changed, so call it only at the end of ht_add/ht_remove.
+static void compact(HTree *tree)
+{
+    Arena *arena = &tree->arena;
+    if (tree->frozen != NULL) return; // blocks are read by ht_save()
+    if (arena->free_bytes < max(arena->compact_limit, MIN_COMPACT)
+        || arena->free_bytes * 8 < arena->allocated) {
+        return;
+    }
+
+    // the current chunk is not moved
+    Chunk *victim = NULL, *c, **prev;
+    for (c = arena->chunks->next; c != NULL; c = c->next) {
+        if (c->live * 4 < c->used * 3 && (victim == NULL
+                || (int64_t)c->live * victim->used < (int64_t)victim->live * c->used)) {
+            victim = c;
+        }
+    }
+    if (victim == NULL) {
+        // at least 1/16 of the arena should be freed before next try
+        arena->compact_limit = arena->free_bytes + arena->allocated / 16;
+        return;
+    }
+
+    // take the free blocks out first, so they can not be reused
+    char *p, *end = victim->data + victim->used;
+    for (p = victim->data; p < end; p += ((FreeBlock*)p)->size) {
+        if (((FreeBlock*)p)->used == FREE_BLOCK) {
+            unlink_block(arena, (FreeBlock*)p);
+        }
+    }
+    for (p = victim->data; p < end; p += ((Data*)p)->size) {
+        Data *data = (Data*)p;
+        if (data->used >= 0) {
+            Data *d = (Data*) arena_alloc(arena, data->size);
+            memcpy(d, data, data->used);
+            NODE_OF(tree->pool.chunks, data->node)->data = d;
+        }
+    }
+
+    for (prev = &arena->chunks; *prev != victim; prev = &(*prev)->next) ;
+    *prev = victim->next;
+    arena->allocated -= sizeof(Chunk) + victim->used;
+    munmap(victim, CHUNK_SIZE);
+}
+
+static inline Item* first_item(Data *data)
+{
+    return (Item*)(data->fp + data->slots * SLOT_SIZE);
+}
+
+static inline int items_size(Data *data)
+{
+    return data->used - sizeof(Data) - data->slots * SLOT_SIZE;
+}
+
+static inline uint32_t* item_hashes(Data *data)
+{
+    return (uint32_t*)(data->fp + data->slots);
+}
+
+// bitmask of the 16 fingerprints starting at fp which equal f
+static inline uint32_t match_fp(const uint8_t *fp, uint8_t f)
+{
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i*)fp);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(f)));
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i=0; i<16; i++) {
+        if (fp[i] == f) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// find the item with the same key as it, only the items with matched
+// fingerprint are compared. return the index of found item, or -1
+static int find_item(Data *data, Item *it, uint8_t fp, Item **found)
+{
+    Item *p = first_item(data);
+    int i = 0, k, n = data->count;
+    for (k=0; k<n; k+=BUCKET_SIZE) {
+        uint32_t mask = match_fp(data->fp + k, fp);
+        if (n - k < BUCKET_SIZE) mask &= (1 << (n - k)) - 1;
+        while (mask) {
+            int j = k + __builtin_ctz(mask);
+            mask &= mask - 1;
+            for (; i < j; i++) p = NEXT_ITEM(p);
+            if (it->length == p->length &&
+                    memcmp(it->key, p->key, KEYLENGTH(it)) == 0) {
+                *found = p;
+                return j;
+            }
+        }
+    }
+    return -1;
+}
+
+// copy data into a new block with given slots and size
+static Data* resize_data(HTree *tree, Data *data, int slots, int size)
+{
+    Data *new_data = alloc_data(tree, size);
+    int isize = items_size(data);
+    new_data->count = data->count;
+    new_data->slots = slots;
+    new_data->used = sizeof(Data) + slots * SLOT_SIZE + isize;
+    memcpy(new_data->fp, data->fp, data->count);
+    memcpy(item_hashes(new_data), item_hashes(data), data->count * sizeof(uint32_t));
+    memcpy(first_item(new_data), first_item(data), isize);
+    return new_data;
+}
+
+// copy the leaf before changing it if it's shared with the frozen view
+static Data* unshare_data(HTree *tree, Node *node)
+{
+    Data *data = get_data(node);
+    if (is_frozen(tree, node)) {
+        set_data(tree, node, resize_data(tree, data, data->slots, data->used));
+    }
+    return get_data(node);
+}
+
 inline uint32_t key_hash(HTree *tree, Item* it)
 {
     char buf[255];
@@ -105,39 +606,74 @@ inline uint32_t key_hash(HTree *tree, Item* it)
     return fnv1a(buf, n);
 }
 
-static Item* create_item(HTree *tree, const char* key, int len, uint32_t pos, uint16_t hash, int32_t ver)
+static Item* create_item(HTree *tree, const char* key, int len, uint64_t pos, uint16_t hash,
+        int32_t ver, uint8_t size)
 {
     Item *it = (Item*)tree->buf;
-    it->pos = pos;
+    it->pos = pos >> 8;
+    it->bucket = POS_BUCKET(pos);
     it->ver = ver;
     it->hash = hash;
+    it->size = size;
     int n = dc_encode(tree->dc, it->key, key, len);
     it->length = sizeof(Item) + n - ITEM_PADDING;
     return it;
 }
 
-static void enlarge_pool(HTree *tree)
+// build the lookup item in caller's buffer without learning new formats,
+// so that many readers can share the tree
+static Item* create_lookup_item(HTree *tree, char *buf, const char* key, int len)
 {
-    int i;
-    int old_size = g_index[tree->height];
-    int new_size = g_index[tree->height + 1];
+    Item *it = (Item*)buf;
+    it->pos = 0;
+    it->bucket = 0;
+    it->ver = 0;
+    it->hash = 0;
+    it->size = 0;
+    int n = dc_encode2(tree->dc, it->key, key, len, false);
+    it->length = sizeof(Item) + n - ITEM_PADDING;
+    return it;
+}
 
-    tree->root = (Node*)realloc(tree->root, sizeof(Node) * new_size);
-    memset(tree->root + old_size, 0, sizeof(Node) * (new_size - old_size));
-    for (i=old_size; i<new_size; i++){
-        tree->root[i].depth = tree->height;
-    }
+static inline uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t write_lock(HTree *tree)
+{
+    pthread_rwlock_wrlock(&tree->lock);
+    return now_us();
+}
 
-    tree->height ++;
+static inline void write_unlock(HTree *tree, uint64_t locked)
+{
+    uint64_t t = now_us() - locked;
+    if (t > tree->max_hold) tree->max_hold = t;
+    pthread_rwlock_unlock(&tree->lock);
+}
+
+static void init_lock(HTree *tree)
+{
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // do not let a stream of GETs starve SETs
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&tree->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
 }
 
 static void clear(HTree *tree, Node *node)
 {
-    Data* data = (Data*) malloc(64);
-    data->size = 64;
-    data->used = sizeof(Data);
+    Data* data = alloc_data(tree, 64 + BUCKET_SIZE * SLOT_SIZE);
+    data->slots = BUCKET_SIZE;
+    data->used = sizeof(Data) + data->slots * SLOT_SIZE;
     data->count = 0;
-    set_data(node, data);
+    set_data(tree, node, data);
 
     node->is_node = 0;
     node->valid = 1;
@@ -145,152 +681,217 @@ static void clear(HTree *tree, Node *node)
     node->hash = 0;
 }
 
-static void add_item(HTree *tree, Node *node, Item *it, uint32_t keyhash, bool enlarge)
+static void add_item(HTree *tree, Node *node, Item *it, uint32_t keyhash)
 {
     while (node->is_node) {
-        node->valid = 0;
         node = get_child(tree, node, INDEX(it));
     }
 
-    Data *data = get_data(node);
-    Item *p = data->head;
-    int i;
-    for (i=0; i<data->count; i++){
-        if (it->length == p->length &&
-                memcmp(it->key, p->key, KEYLENGTH(it)) == 0){
-            node->hash += (HASH(it) - HASH(p)) * keyhash;
-            node->count += it->ver > 0;
-            node->count -= p->ver > 0;
-            memcpy(p, it, sizeof(Item));
-            return;
-        }
-        p = (Item*)((char*)p + p->length);
+    Data *data = unshare_data(tree, node);
+    uint8_t fp = FINGERPRINT(keyhash);
+    Item *p;
+    if (find_item(data, it, fp, &p) >= 0) {
+        node->hash += (HASH(it) - HASH(p)) * keyhash;
+        node->count += it->ver > 0;
+        node->count -= p->ver > 0;
+        memcpy(p, it, ITEM_HEAD);
+        return;
     }
 
-    if (data->size < data->used + it->length){
-        int size = max(data->used + it->length, data->size + 64);
-        int pos = (char*)p-(char*)data;
-        Data *new_data = (Data*) malloc(size);
-        memcpy(new_data, data, data->used);
-        data = new_data;
-        set_data(node, data);
-        data->size = size;
-        p = (Item *)((char*)data + pos);
+    int slots = data->slots + (data->count == data->slots ? BUCKET_SIZE : 0);
+    int grow = (slots - data->slots) * SLOT_SIZE;
+    int need = data->used + grow + it->length;
+    if (data->size < need) {
+        data = resize_data(tree, data, slots, need);
+        set_data(tree, node, data);
+    } else if (grow > 0) {
+        memmove(data->fp + slots * SLOT_SIZE, first_item(data), items_size(data));
+        memmove(data->fp + slots, item_hashes(data), data->count * sizeof(uint32_t));
+        data->used += grow;
+        tree->arena.used += grow;
+        data->slots = slots;
     }
 
+    p = (Item*)((char*)data + data->used);
     memcpy(p, it, it->length);
+    data->fp[data->count] = fp;
+    item_hashes(data)[data->count] = keyhash;
     data->count ++;
     data->used += it->length;
+    tree->arena.used += it->length;
     node->count += it->ver > 0;
     node->hash += keyhash * HASH(it);
 
-    if (node->count > SPLIT_LIMIT){
-        if (node->depth == tree->height - 1){
-            if (enlarge && node->count > SPLIT_LIMIT * 4){
-                int pos = node - tree->root;
-                enlarge_pool(tree);
-                node = tree->root + pos; // reload
-                split_node(tree, node);
-            }
-        }else{
-            split_node(tree, node);
-        }
+    // all the bits of keyhash are used at MAX_DEPTH
+    if (node->count > SPLIT_LIMIT && node->depth + tree->depth < MAX_DEPTH){
+        split_node(tree, node);
     }
 }
 
 static void split_node(HTree *tree, Node *node)
 {
-    Node *child = get_child(tree, node, 0);
+    Node *child = alloc_group(tree, node->depth + 1);
     int i;
     for (i=0; i<BUCKET_SIZE; i++){
         clear(tree, child+i);
     }
 
     Data *data = get_data(node);
-    Item *it = data->head;
+    Item *it = first_item(data);
+    uint32_t *hashes = item_hashes(data);
     for (i=0; i<data->count; i++) {
-        int32_t keyhash = key_hash(tree, it);
-        add_item(tree, child + INDEX(it), it, keyhash, false);
-        it = (Item*)((char*)it + it->length);
+        uint32_t keyhash = hashes[i];
+        add_item(tree, child + INDEX(it), it, keyhash);
+        it = NEXT_ITEM(it);
     }
 
-    set_data(node, NULL);
+    set_data(tree, node, NULL);
 
     node->is_node = 1;
     node->valid = 0;
+    node->child = child;
 }
 
 static void remove_item(HTree *tree, Node *node, Item *it, uint32_t keyhash)
 {
     while (node->is_node) {
-        node->valid = 0;
         node = get_child(tree, node, INDEX(it));
     }
 
     Data *data = get_data(node);
     if (data->count == 0) return ;
-    Item *p = data->head;
-    int i;
-    for (i=0; i<data->count; i++){
-        if (it->length == p->length &&
-                memcmp(it->key, p->key, KEYLENGTH(it)) == 0){
-            data->count --;
-            data->used -= p->length;
-            node->count -= p->ver > 0;
-            node->hash -= keyhash * HASH(p);
-            memmove(p, (char*)p + p->length,
-                    data->size - ((char*)p - (char*)data) - p->length);
-            set_data(node, data);
-            return;
-        }
-        p = (Item*)((char*)p + p->length);
+    data = unshare_data(tree, node);
+    Item *p;
+    int i = find_item(data, it, FINGERPRINT(keyhash), &p);
+    if (i >= 0) {
+        int length = p->length;
+        node->count -= p->ver > 0;
+        node->hash -= keyhash * HASH(p);
+        memmove(p, (char*)p + length,
+                data->used - ((char*)p - (char*)data) - length);
+        memmove(data->fp + i, data->fp + i + 1, data->count - i - 1);
+        memmove(item_hashes(data) + i, item_hashes(data) + i + 1,
+                (data->count - i - 1) * sizeof(uint32_t));
+        data->count --;
+        data->used -= length;
+        tree->arena.used -= length;
     }
 }
 
 static void merge_node(HTree *tree, Node *node)
 {
+    Node* child = get_child(tree, node, 0);
+    node->is_node = 0;
+    node->data = NULL;
     clear(tree, node);
 
-    Node* child = get_child(tree, node, 0);
     int i, j;
     for (i=0; i<BUCKET_SIZE; i++){
+        if (child[i].is_node) {
+            merge_node(tree, child + i);
+        }
         Data *data = get_data(child+i);
-        Item *it = data->head;
-        int count = (child+i)->count;
-        for (j=0; j < count; j++){
+        Item *it = first_item(data);
+        uint32_t *hashes = item_hashes(data);
+        for (j=0; j < data->count; j++){
             if (it->ver > 0) {
-                add_item(tree, node, it, key_hash(tree, it), false);
+                add_item(tree, node, it, hashes[j]);
             } // drop deleted items, ver < 0
-            it = (Item*)((char*)it + it->length);
+            it = NEXT_ITEM(it);
+        }
+        set_data(tree, child + i, NULL);
+    }
+    free_group(tree, child);
+}
+
+// 97^i mod 2^16
+static const uint16_t pow97[16] = {
+    1, 97, 9409, 60705, 55681, 27105, 7745, 30369,
+    62209, 4961, 22465, 16417, 19585, 64737, 53569, 18849,
+};
+
+// recalculate hash and count of a node from its children
+static void update_hash(HTree *tree, Node *node)
+{
+    Node *child = get_child(tree, node, 0);
+    uint32_t count = 0;
+    uint16_t hash = 0;
+    int i;
+    for (i=0; i<BUCKET_SIZE; i++){
+        count += child[i].count;
+    }
+    for (i=0; i<BUCKET_SIZE; i++){
+        if (count > SPLIT_LIMIT * 4){
+            hash *= 97;
+        }
+        hash += child[i].hash;
+    }
+    node->count = count;
+    node->hash = hash;
+    node->valid = 1;
+}
+
+// the nodes from root to the leaf of keyhash, return the depth of leaf
+static int find_path(HTree *tree, uint32_t keyhash, Node **path)
+{
+    Node *node = tree->root;
+    int d = 0;
+    path[0] = node;
+    while (node->is_node) {
+        node = get_child(tree, node, INDEX(it));
+        path[++d] = node;
+    }
+    return d;
+}
+
+// The ancestors of a changed leaf are updated bottom-up after every
+// change, so the hash of any node is always ready. With more than
+// SPLIT_LIMIT*4 items, the hash of node is sum(child[i].hash * 97^(15-i)),
+// so only the delta of the changed child is needed.
+static void update_path(HTree *tree, Node **path, int d, uint16_t old_hash, uint32_t old_count)
+{
+    Node *node = path[d];
+    if (node->is_node) { // split by add_item()
+        update_hash(tree, node);
+    }
+    int32_t dc = node->count - old_count;
+    uint16_t dh = node->hash - old_hash;
+    while (d > 0 && (dc != 0 || dh != 0)) {
+        Node *parent = path[--d];
+        int b = node - get_child(tree, parent, 0);
+        uint16_t hash = parent->hash;
+        uint32_t count = parent->count + dc;
+        if ((count > SPLIT_LIMIT * 4) != (parent->count > SPLIT_LIMIT * 4)) {
+            update_hash(tree, parent);
+        } else {
+            parent->hash += count > SPLIT_LIMIT * 4 ? dh * pow97[15 - b] : dh;
+            parent->count = count;
         }
-        clear(tree, child + i);
+        dh = parent->hash - hash;
+        if (parent->count <= MERGE_LIMIT) {
+            merge_node(tree, parent);
+        }
+        node = parent;
     }
 }
 
+// used for the trees saved by older versions, which update nodes lazily
 static void update_node(HTree *tree, Node *node)
 {
     if (node->valid) return ;
 
     int i;
-    node->hash = 0;
     if (node->is_node){
         Node *child = get_child(tree, node, 0);
-        node->count = 0;
         for (i=0; i<BUCKET_SIZE; i++){
             update_node(tree, child+i);
-            node->count += child[i].count;
-        }
-        for (i=0; i<BUCKET_SIZE; i++){
-            if (node->count > SPLIT_LIMIT * 4){
-                node->hash *= 97;
-            }
-            node->hash += child[i].hash;
         }
+        update_hash(tree, node);
     }
     node->valid = 1;
 
     // merge nodes
-    if (node->count <= SPLIT_LIMIT) {
+    if (node->is_node && node->count <= MERGE_LIMIT) {
         merge_node(tree, node);
     }
 }
@@ -302,16 +903,8 @@ static Item* get_item_hash(HTree* tree, Node* node, Item* it, uint32_t keyhash)
     }
 
     Data *data = get_data(node);
-    Item *p = data->head, *r = NULL;
-    int i;
-    for (i=0; i<data->count; i++){
-        if (it->length == p->length &&
-                memcmp(it->key, p->key, KEYLENGTH(it)) == 0){
-            r = p;
-            break;
-        }
-        p = (Item*)((char*)p + p->length);
-    }
+    Item *r = NULL;
+    find_item(data, it, FINGERPRINT(keyhash), &r);
     return r;
 }
 
@@ -336,7 +929,6 @@ static uint16_t get_node_hash(HTree* tree, Node* node, const char* dir,
             return 0;
         }
     }
-    update_node(tree, node);
     if (count) *count = node->count;
     return node->hash;
 }
@@ -360,10 +952,8 @@ static char* list_dir(HTree *tree, Node* node, const char* dir, const char* pref
     memset(buf, 0, bsize);
     int n = 0, i, j;
     if (node->is_node) {
-        update_node(tree, node);
-
         Node *child = get_child(tree, node, 0);
-        if (node->count > 100000 || prefix==NULL && node->count > SPLIT_LIMIT * 4) {
+        if (node->count > 100000 || (prefix==NULL && node->count > SPLIT_LIMIT * 4)) {
             for (i=0; i<BUCKET_SIZE; i++) {
                 Node *t = child + i;
                 n += snprintf(buf + n, bsize - n, "%x/ %u %u\n",
@@ -383,19 +973,19 @@ static char* list_dir(HTree *tree, Node* node, const char* dir, const char* pref
         }
     }else{
         Data *data = get_data(node);
-        Item *it = data->head;
+        Item *it = first_item(data);
         char pbuf[20], key[255];
         int prefix_len = 0;
         if (prefix != NULL) prefix_len = strlen(prefix);
-        for (i=0; i<data->count; i++, it = (Item*)((char*)it + it->length)){
+        for (i=0; i<data->count; i++, it = NEXT_ITEM(it)){
             if (dlen > 0){
-                sprintf(pbuf, "%08x", key_hash(tree, it));
+                sprintf(pbuf, "%08x", item_hashes(data)[i]);
                 if (memcmp(pbuf + tree->depth + node->depth, dir, dlen) != 0){
                     continue;
                 }
             }
             int l = dc_decode(tree->dc, key, it->key, KEYLENGTH(it));
-            if (prefix == NULL || l >= prefix_len && strncmp(key, prefix, prefix_len) == 0) {
+            if (prefix == NULL || (l >= prefix_len && strncmp(key, prefix, prefix_len) == 0)) {
                 n += snprintf(buf+n, bsize-n-1, "%s %u %d\n", key, it->hash, it->ver);
                 if (bsize - n < 200) {
                     bsize *= 2;
@@ -407,87 +997,519 @@ static char* list_dir(HTree *tree, Node* node, const char* dir, const char* pref
     return buf;
 }
 
-static void visit_node(HTree *tree, Node* node, fun_visitor visitor, void* param)
+// the children of a node in view, the pointers are into the tree
+static inline Node* view_child(View *v, Node *node)
+{
+    return NODE_OF(v->chunks, node_id(node->child));
+}
+
+// nodes of the tree, or of the view if v is not NULL
+static void visit_node(View *v, Codec *dc, Node* node, fun_visitor visitor, void* param)
 {
     int i;
     if (node->is_node){
-        Node *child = get_child(tree, node, 0);
+        Node *child = v ? view_child(v, node) : node->child;
         for (i=0; i<BUCKET_SIZE; i++){
-            visit_node(tree, child+i, visitor, param);
+            visit_node(v, dc, child+i, visitor, param);
         }
     }else{
+        char buf[512];
         Data *data = get_data(node);
-        Item *p = data->head;
-        Item *it = (Item*)tree->buf;
+        Item *p = first_item(data);
+        Item *it = (Item*)buf;
         for (i=0; i<data->count; i++){
-            memcpy(it, p, sizeof(Item));
-            dc_decode(tree->dc, it->key, p->key, KEYLENGTH(p));
+            memcpy(it, p, ITEM_HEAD);
+            dc_decode(dc, it->key, p->key, KEYLENGTH(p));
             it->length = sizeof(Item) + strlen(it->key) - ITEM_PADDING;
             visitor(it, param);
-            p = (Item*)((char*)p + p->length);
+            p = NEXT_ITEM(p);
         }
     }
 }
 
-/*
- * API
- */
-
-HTree* ht_new(int depth, int pos)
+static Data* new_block(HTree *tree, int count, int isize)
 {
-    HTree *tree = (HTree*)malloc(sizeof(HTree));
-    if (!tree) return NULL;
-    memset(tree, 0, sizeof(HTree));
-    tree->depth = depth;
-    tree->pos = pos;
-    tree->height = 1;
+    int slots = (count / BUCKET_SIZE + 1) * BUCKET_SIZE;
+    Data *data = alloc_data(tree, sizeof(Data) + slots * SLOT_SIZE + isize);
+    data->used = sizeof(Data) + slots * SLOT_SIZE + isize;
+    data->count = count;
+    data->slots = slots;
+    return data;
+}
 
-    int pool_size = g_index[tree->height];
-    Node *root = (Node*)malloc(sizeof(Node) * pool_size);
-    if (!root){
-        free(tree);
-        return NULL;
-    }
-    memset(root, 0, sizeof(Node) * pool_size);
+// bytes of count items of HTREE002 or older after upgrade_items()
+#define UPGRADED_SIZE(size, count) ((size) + (count) * (ITEM_HEAD - ITEM_HEAD_V2))
 
-    // init depth
-    int i,j;
-    for (i=0; i<tree->height; i++){
-        for (j=g_index[i]; j<g_index[i+1]; j++){
-            root[j].depth = i;
+// convert the packed items of HTREE002 and older into dst, which is
+// longer for every item, -1 if they are broken
+static int upgrade_items(char *dst, const char *src, int size, int count)
+{
+    const char *end = src + size;
+    char *p = dst;
+    int i;
+    for (i=0; i<count; i++) {
+        const struct t_item_v2 *old = (const struct t_item_v2*)src;
+        if (src + ITEM_HEAD_V2 >= end || old->length <= ITEM_HEAD_V2
+            || src + old->length > end) {
+            return -1;
         }
+        int n = old->length - ITEM_HEAD_V2;
+        Item *it = (Item*)p;
+        it->pos = (old->pos & 0xffffff00) >> 4;
+        it->bucket = old->pos & 0xff;
+        it->ver = old->ver;
+        it->hash = old->hash;
+        it->size = 0;
+        it->length = ITEM_HEAD + n;
+        memcpy(it->key, old->key, n);
+        src += old->length;
+        p += it->length;
     }
+    return p - dst;
+}
 
-    tree->root = root;
-    clear(tree, tree->root);
+// the items of data in the layout of HTREE002, for old versions, which
+// can only read the data files with records aligned to 256 bytes
+static int downgrade_items(char *dst, Data *data)
+{
+    Item *it = first_item(data);
+    char *p = dst;
+    int i;
+    for (i=0; i<data->count; i++) {
+        struct t_item_v2 *old = (struct t_item_v2*)p;
+        int n = KEYLENGTH(it);
+        old->pos = ((it->pos << 4) & 0xffffff00) | it->bucket;
+        old->ver = it->ver;
+        old->hash = it->hash;
+        old->length = ITEM_HEAD_V2 + n;
+        memcpy(old->key, it->key, n);
+        p += old->length;
+        it = NEXT_ITEM(it);
+    }
+    return p - dst;
+}
 
-    tree->dc = dc_new();
-    pthread_mutex_init(&tree->lock, NULL);
+// build a Data block from the HTREE001 layout, the key hashes are
+// rebuilt, so the codec should be loaded already
+static Data* load_data_v1(HTree *tree, struct t_data_v1 *old)
+{
+    int isize = old->used - sizeof(struct t_data_v1);
+    Data *data = new_block(tree, old->count, UPGRADED_SIZE(isize, old->count));
+    if (old->count < 0 || upgrade_items((char*)first_item(data), old->head, isize, old->count) < 0) {
+        fprintf(stderr, "broken data: %d items\n", old->count);
+        arena_free(&tree->arena, data, data->size);
+        return NULL;
+    }
 
-    return tree;
+    Item *it = first_item(data);
+    uint32_t *hashes = item_hashes(data);
+    int i;
+    for (i=0; i<data->count; i++) {
+        hashes[i] = key_hash(tree, it);
+        data->fp[i] = FINGERPRINT(hashes[i]);
+        it = NEXT_ITEM(it);
+    }
+    return data;
 }
 
-HTree* ht_open(int depth, int pos, const char *path)
+// HTREE002 layout of Data: int size, int count, uint32_t hashes[count],
+// packed items of struct t_item_v2
+static Data* read_data(HTree *tree, FILE *f, int size)
 {
-    char version[sizeof(VERSION)+1] = {0};
-    HTree *tree = NULL;
-    Node *root = NULL;
-    int pool_used = 0;
-    char *buf = NULL;
-
-    FILE *f = fopen(path, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "open %s failed\n", path);
+    int count = 0, i;
+    if (fread(&count, sizeof(int), 1, f) != 1) {
         return NULL;
     }
-    // fread是一个函数。从一个文件流中读数据，最多读取count个元素，
-    // 每个元素size字节，如果调用成功返回实际读取到的元素个数，如果不成功或读到文件末尾返回 0。
-    // 读取Version
-    // memcmp是比较内存区域buf1和buf2的前count个字节。该函数是按字节比较的。
-    if (fread(version, sizeof(VERSION), 1, f) != 1
-        || memcmp(version, VERSION, sizeof(VERSION)) != 0) {
-        fprintf(stderr, "the version %s is not expected\n", version);
-        fclose(f);
+    int isize = size - sizeof(int) - count * sizeof(uint32_t);
+    if (count < 0 || isize < 0) {
+        fprintf(stderr, "broken data: count %d, size %d\n", count, size);
+        return NULL;
+    }
+
+    Data *data = new_block(tree, count, UPGRADED_SIZE(isize, count));
+    uint32_t *hashes = item_hashes(data);
+    char *items = (char*)malloc(isize + 1);
+    if ((count > 0 && fread(hashes, sizeof(uint32_t) * count, 1, f) != 1)
+        || (isize > 0 && fread(items, isize, 1, f) != 1)) {
+        goto FAIL;
+    }
+    if (upgrade_items((char*)first_item(data), items, isize, count) < 0) {
+        fprintf(stderr, "broken data: %d items\n", count);
+        goto FAIL;
+    }
+    free(items);
+
+    for (i=0; i<count; i++) {
+        data->fp[i] = FINGERPRINT(hashes[i]);
+    }
+    return data;
+
+FAIL:
+    free(items);
+    arena_free(&tree->arena, data, data->size);
+    return NULL;
+}
+
+static int write_data(Data *data, FILE *f)
+{
+    char *items = (char*)malloc(items_size(data) + 1);
+    int isize = downgrade_items(items, data);
+    int size = sizeof(int) + data->count * sizeof(uint32_t) + isize;
+    int r = 0;
+    if (fwrite(&size, sizeof(int), 1, f) != 1
+        || fwrite(&data->count, sizeof(int), 1, f) != 1
+        || (data->count > 0 && fwrite(item_hashes(data), sizeof(uint32_t) * data->count, 1, f) != 1)
+        || (isize > 0 && fwrite(items, isize, 1, f) != 1)) {
+        r = -1;
+    }
+    free(items);
+    return r;
+}
+
+// HTREE003: height, struct t_snapshot, nodes in preorder (data of leaf is
+// the offset + 1 in Data section), codec, then the Data blocks as they are
+// in memory, so they can be mmap()ed and used without parsing. Changed
+// pages are copied by the kernel (MAP_PRIVATE), and a leaf is moved into
+// the arena when it grows.
+#define SNAPSHOT_ALIGN (64 << 10)   // any page size
+#define ALIGN8(n) (((n) + 7) & ~7)
+
+struct t_snapshot {
+    int codec_size;
+    int nodes;
+    off_t data_offset;
+    off_t data_size;
+    uint64_t data_used;
+};
+
+static int count_nodes(View *v, Node *node, struct t_snapshot *s)
+{
+    int i, n = 1;
+    if (node->is_node) {
+        for (i=0; i<BUCKET_SIZE; i++) {
+            n += count_nodes(v, view_child(v, node) + i, s);
+        }
+    } else {
+        s->data_size += ALIGN8(node->data->used);
+        s->data_used += node->data->used;
+    }
+    return n;
+}
+
+static int flatten(View *v, Node *node, Node *out, int n, off_t *off)
+{
+    int i;
+    out[n] = *node;
+    out[n].data = NULL;
+    if (node->is_node) {
+        n ++;
+        for (i=0; i<BUCKET_SIZE; i++) {
+            n = flatten(v, view_child(v, node) + i, out, n, off);
+        }
+        return n;
+    }
+    out[n].data = (Data*)(uintptr_t)(*off + 1);
+    *off += ALIGN8(node->data->used);
+    return n + 1;
+}
+
+static int write_blocks(View *v, Node *node, FILE *f)
+{
+    int i;
+    if (node->is_node) {
+        for (i=0; i<BUCKET_SIZE; i++) {
+            if (write_blocks(v, view_child(v, node) + i, f) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    Data *data = node->data;
+    Data hdr = *data;
+    int64_t zero = 0;
+    hdr.size = ALIGN8(data->used);
+    hdr.node = 0;
+    if (fwrite(&hdr, sizeof(Data), 1, f) != 1
+        || fwrite((char*)data + sizeof(Data), data->used - sizeof(Data), 1, f) != 1
+        || (hdr.size > hdr.used && fwrite(&zero, hdr.size - hdr.used, 1, f) != 1)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int write_snapshot(View *v, FILE *f)
+{
+    struct t_snapshot s = {0};
+    Node *nodes = NULL;
+    off_t off = 0;
+
+    s.nodes = count_nodes(v, v->root, &s);
+    s.codec_size = v->codec_size;
+    s.data_offset = sizeof(VERSION) + sizeof(off_t) + sizeof(int) + sizeof(s)
+        + sizeof(Node) * s.nodes + s.codec_size;
+    s.data_offset = (s.data_offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+
+    nodes = (Node*)malloc(sizeof(Node) * s.nodes);
+    flatten(v, v->root, nodes, 0, &off);
+    if (fwrite(&s, sizeof(s), 1, f) != 1
+        || fwrite(nodes, sizeof(Node) * s.nodes, 1, f) != 1) {
+        goto FAIL;
+    }
+    free(nodes);
+    nodes = NULL;
+
+    if (fwrite(v->codec, v->codec_size, 1, f) != 1) {
+        fprintf(stderr, "write Codec failed\n");
+        goto FAIL;
+    }
+
+    // the gap is a hole
+    if (fseeko(f, s.data_offset, 0) != 0
+        || write_blocks(v, v->root, f) != 0) {
+        goto FAIL;
+    }
+    return 0;
+
+FAIL:
+    if (nodes) free(nodes);
+    fprintf(stderr, "write snapshot failed\n");
+    return -1;
+}
+
+// build the subtree of node from the dense pool of older versions, the
+// Data blocks are moved into the tree
+static void load_dense(HTree *tree, Node *pool, int height, int i, Node *node)
+{
+    Node *d = pool + i;
+    int b, depth = node->depth;
+    node->valid = d->valid;
+    node->hash = d->hash;
+    node->count = d->count;
+    if (d->is_node && depth + 1 < height) {
+        int k = g_index[depth + 1] + ((i - g_index[depth]) << 4);
+        node->is_node = 1;
+        node->child = alloc_group(tree, depth + 1);
+        for (b=0; b<BUCKET_SIZE; b++) {
+            load_dense(tree, pool, height, k + b, node->child + b);
+        }
+    } else if (d->data != NULL) {
+        set_data(tree, node, d->data);
+        d->data = NULL;
+    } else {
+        clear(tree, node);
+    }
+}
+
+static int load_preorder(HTree *tree, Node *nodes, int n, int *cur, Node *node,
+        char *p, off_t size)
+{
+    if (*cur >= n) return -1;
+    Node *d = nodes + (*cur)++;
+    int b;
+    node->valid = d->valid;
+    node->hash = d->hash;
+    node->count = d->count;
+    if (d->is_node) {
+        if (node->depth + tree->depth >= MAX_DEPTH) return -1;
+        node->is_node = 1;
+        node->child = alloc_group(tree, node->depth + 1);
+        for (b=0; b<BUCKET_SIZE; b++) {
+            if (load_preorder(tree, nodes, n, cur, node->child + b, p, size) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    uintptr_t off = (uintptr_t) d->data;
+    if (off == 0 || (off - 1) % 8 != 0 || off - 1 + sizeof(Data) > (uint64_t)size) {
+        fprintf(stderr, "bad offset of data: %lu\n", (unsigned long)off);
+        return -1;
+    }
+    set_data(tree, node, (Data*)(p + off - 1));
+    return 0;
+}
+
+// a snapshot refers to the shared codec, or has a dump of its own
+static int load_codec(HTree *tree, const char *buf, int size, Codec *shared)
+{
+    int r = dc_check_ref(shared, buf, size);
+    if (r == 0) {
+        tree->dc = shared;
+        tree->shared_dc = true;
+        return 0;
+    } else if (r < 0) {
+        fprintf(stderr, "the shared codec is not the one used by snapshot\n");
+        return -1;
+    }
+    tree->dc = dc_new();
+    if (dc_load(tree->dc, buf, size) != 0) {
+        fprintf(stderr, "load codec failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int load_snapshot(HTree *tree, FILE *f, off_t fsize, Codec *shared)
+{
+    struct t_snapshot s;
+    int cur = 0;
+    Node *nodes = NULL;
+    char *buf = NULL, *p = NULL;
+
+    if (fread(&s, sizeof(s), 1, f) != 1
+        || s.codec_size < 0 || s.codec_size > (10<<20)
+        || s.nodes <= 0
+        || s.data_offset % SNAPSHOT_ALIGN != 0 || s.data_size < 0
+        || (s.data_size > 0 && s.data_offset + s.data_size != fsize)) {
+        fprintf(stderr, "bad snapshot header\n");
+        return -1;
+    }
+
+    nodes = (Node*)malloc(sizeof(Node) * s.nodes);
+    if (nodes == NULL || fread(nodes, sizeof(Node) * s.nodes, 1, f) != 1) {
+        fprintf(stderr, "read nodes failed\n");
+        goto FAIL;
+    }
+
+    buf = (char*)malloc(s.codec_size);
+    if (buf == NULL || fread(buf, s.codec_size, 1, f) != 1) {
+        fprintf(stderr, "read codec failed\n");
+        goto FAIL;
+    }
+    if (load_codec(tree, buf, s.codec_size, shared) != 0) {
+        goto FAIL;
+    }
+    free(buf);
+    buf = NULL;
+
+    // released by free_all_data()
+    if (s.data_size > 0) {
+        p = (char*)mmap(NULL, s.data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                fileno(f), s.data_offset);
+        if (p != MAP_FAILED) {
+            tree->snapshot_mapped = true;
+        } else {
+            // read them in once
+            p = (char*)malloc(s.data_size);
+            if (p == NULL || fseeko(f, s.data_offset, 0) != 0
+                || fread(p, s.data_size, 1, f) != 1) {
+                fprintf(stderr, "read data failed\n");
+                if (p) free(p);
+                goto FAIL;
+            }
+        }
+        tree->snapshot = p;
+        tree->snapshot_size = s.data_size;
+    }
+
+    if (load_preorder(tree, nodes, s.nodes, &cur, tree->root, p, s.data_size) != 0
+        || cur != s.nodes) {
+        fprintf(stderr, "bad nodes in snapshot\n");
+        goto FAIL;
+    }
+    free(nodes);
+    return 0;
+
+FAIL:
+    if (nodes) free(nodes);
+    if (buf) free(buf);
+    return -1;
+}
+
+// big blocks are malloc()ed
+static void free_node(HTree *tree, Node *node)
+{
+    int i;
+    if (node->is_node) {
+        for (i=0; i<BUCKET_SIZE; i++) {
+            free_node(tree, get_child(tree, node, i));
+        }
+    } else {
+        Data *data = node->data;
+        if (data && data->size > MAX_CLASS_SIZE && !IN_SNAPSHOT(tree, data)) free(data);
+    }
+}
+
+static void free_all_data(HTree *tree)
+{
+    if (tree->root) free_node(tree, tree->root);
+    tree->root = NULL;
+    arena_destroy(&tree->arena);
+    pool_destroy(&tree->pool);
+    if (tree->snapshot_mapped) {
+        munmap(tree->snapshot, tree->snapshot_size);
+    } else if (tree->snapshot) {
+        free(tree->snapshot);
+    }
+    tree->snapshot = NULL;
+    tree->snapshot_size = 0;
+}
+
+static void new_root(HTree *tree)
+{
+    tree->root = alloc_group(tree, 0);
+}
+
+/*
+ * API
+ */
+
+HTree* ht_new(int depth, int pos)
+{
+    return ht_new2(depth, pos, NULL);
+}
+
+// keys are encoded by dc if it's not NULL, which is shared by trees
+HTree* ht_new2(int depth, int pos, Codec *dc)
+{
+    HTree *tree = (HTree*)malloc(sizeof(HTree));
+    if (!tree) return NULL;
+    memset(tree, 0, sizeof(HTree));
+    tree->depth = depth;
+    tree->pos = pos;
+
+    new_root(tree);
+    clear(tree, tree->root);
+
+    tree->dc = dc ? dc : dc_new();
+    tree->shared_dc = dc != NULL;
+    init_lock(tree);
+
+    return tree;
+}
+
+HTree* ht_open(int depth, int pos, const char *path)
+{
+    return ht_open2(depth, pos, path, NULL);
+}
+
+HTree* ht_open2(int depth, int pos, const char *path, Codec *shared)
+{
+    char version[sizeof(VERSION)+1] = {0};
+    HTree *tree = NULL;
+    Node *root = NULL;
+    char *buf = NULL;
+    bool v1 = false, v2 = false;
+    int i, height = 0, pool_size = 0;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "open %s failed\n", path);
+        return NULL;
+    }
+    // fread是一个函数。从一个文件流中读数据，最多读取count个元素，
+    // 每个元素size字节，如果调用成功返回实际读取到的元素个数，如果不成功或读到文件末尾返回 0。
+    // 读取Version
+    // memcmp是比较内存区域buf1和buf2的前count个字节。该函数是按字节比较的。
+    // HTREE001 and HTREE002 are upgraded while loading
+    if (fread(version, sizeof(VERSION), 1, f) != 1
+        || (memcmp(version, VERSION, sizeof(VERSION)) != 0
+        && !(v2 = memcmp(version, VERSION2, sizeof(VERSION2)) == 0)
+        && !(v1 = memcmp(version, VERSION1, sizeof(VERSION1)) == 0))) {
+        fprintf(stderr, "the version %s is not expected\n", version);
+        fclose(f);
         return NULL;
     }
 
@@ -500,7 +1522,7 @@ HTree* ht_open(int depth, int pos, const char *path)
     off_t fsize = 0; // 文件的大小
     if (fread(&fsize, sizeof(fsize), 1, f) != 1 ||
         fseeko(f, 0, 2) != 0 || ftello(f) != fsize) {
-        fprintf(stderr, "the size %lld is not expected\n", fsize);
+        fprintf(stderr, "the size %lld is not expected\n", (long long)fsize);
         fclose(f);
         return NULL;
     }
@@ -519,14 +1541,24 @@ HTree* ht_open(int depth, int pos, const char *path)
     memset(tree, 0, sizeof(HTree));
     tree->depth = depth;
     tree->pos = pos;
+    new_root(tree);
 
-    if (fread(&tree->height, sizeof(int), 1, f) != 1 ||
-        tree->height + depth < 0 || tree->height + depth > 9) {
-        fprintf(stderr, "invalid height: %d\n", tree->height);
+    if (fread(&height, sizeof(int), 1, f) != 1 ||
+        height < 1 || height + depth > 9) {
+        fprintf(stderr, "invalid height: %d\n", height);
         goto FAIL;
     }
 
-    int pool_size = g_index[tree->height];
+    if (!v1 && !v2) {
+        if (load_snapshot(tree, f, fsize, shared) != 0) {
+            goto FAIL;
+        }
+        fclose(f);
+        init_lock(tree);
+        return tree;
+    }
+
+    pool_size = g_index[height];
     int psize = sizeof(Node) * pool_size;
     root = (Node*)malloc(psize);
     if (!root){
@@ -535,33 +1567,38 @@ HTree* ht_open(int depth, int pos, const char *path)
     if (fread(root, psize, 1, f) != 1) {
         goto FAIL;
     }
-    tree->root = root;
+    int size = 0;
+    for (i=0; i<pool_size; i++) {
+        root[i].data = NULL;
+    }
 
-    // load Data
-    int i,size = 0;
-    Data *data;
+    // load Data, HTREE001 is kept in old layout until the codec is loaded
     for (i=0; i<pool_size; i++) {
         if(fread(&size, sizeof(int), 1, f) != 1) {
             goto FAIL;
         }
-        if (size > 0) {
-            data = (Data*) malloc(size);
+        if (size > 0 && !v1) {
+            Data *data = read_data(tree, f, size);
+            if (data == NULL) {
+                goto FAIL;
+            }
+            root[i].data = data;
+        } else if (size >= (int)sizeof(struct t_data_v1)) {
+            struct t_data_v1 *data = (struct t_data_v1*) malloc(size);
             if (fread(data, size, 1, f) != 1) {
+                free(data);
                 goto FAIL;
             }
             if (data->used != size) {
                 fprintf(stderr, "broken data: %d != %d\n", data->used, size);
+                free(data);
                 goto FAIL;
             }
-            data->size = size;
-        } else if (size == 0) {
-            data = NULL;
-        } else {
+            root[i].data = (Data*)data;
+        } else if (size != 0) {
             fprintf(stderr, "unexpected size: %d\n", size);
             goto FAIL;
         }
-        tree->root[i].data = data;
-        pool_used ++;
     }
 
     // load Codec
@@ -575,43 +1612,145 @@ HTree* ht_open(int depth, int pos, const char *path)
         fprintf(stderr, "read codec failed\n");
         goto FAIL;
     }
-    tree->dc = dc_new();
-    if (dc_load(tree->dc, buf, size) != 0) {
-        fprintf(stderr, "load codec failed\n");
+    if (load_codec(tree, buf, size, shared) != 0) {
         goto FAIL;
     }
     free(buf);
+    buf = NULL;
+
+    bool broken = false;
+    for (i=0; v1 && i<pool_size; i++) {
+        struct t_data_v1 *data = (struct t_data_v1*) root[i].data;
+        if (data == NULL) continue;
+        root[i].data = load_data_v1(tree, data);
+        free(data);
+        broken |= root[i].data == NULL;
+    }
+    v1 = false;
+    if (broken) goto FAIL;
+
+    load_dense(tree, root, height, 0, tree->root);
+    // the leaves under merged nodes
+    for (i=0; i<pool_size; i++) {
+        if (root[i].data) arena_free(&tree->arena, root[i].data, root[i].data->size);
+    }
+    free(root);
+    update_node(tree, tree->root);
     fclose(f);
 
-    pthread_mutex_init(&tree->lock, NULL);
+    init_lock(tree);
 
     return tree;
 
 FAIL:
-    if (tree->dc) dc_destroy(tree->dc);
+    if (tree->dc && !tree->shared_dc) dc_destroy(tree->dc);
     if (buf) free(buf);
     if (root) {
-        for (i=0; i<pool_used; i++) {
-            if (root[i].data) free(root[i].data);
+        for (i=0; i<pool_size; i++) {
+            Data *data = root[i].data;
+            if (data == NULL) continue;
+            if (v1 || data->size > MAX_CLASS_SIZE) {
+                free(data);
+            }
         }
         free(root);
     }
+    free_all_data(tree);
     free(tree);
     fclose(f);
     return NULL;
 }
 
+static void free_view(View *v)
+{
+    int i;
+    for (i=0; i<v->nchunks; i++) {
+        free(v->chunks[i]);
+    }
+    free(v->chunks);
+    free(v->garbage);
+    free(v->codec);
+    free(v);
+}
+
+// expand the view into the dense pool of HTREE002
+static void expand_node(View *v, Node *node, Node *pool, int i)
+{
+    int b;
+    pool[i] = *node;
+    if (node->is_node) {
+        int k = g_index[node->depth + 1] + ((i - g_index[(int)node->depth]) << 4);
+        pool[i].data = NULL;
+        for (b=0; b<BUCKET_SIZE; b++) {
+            expand_node(v, view_child(v, node) + b, pool, k + b);
+        }
+    }
+}
+
+// release the view, free the leaves replaced while saving
+static void thaw(HTree *tree)
+{
+    uint64_t locked = write_lock(tree);
+    View *v = tree->frozen;
+    int i;
+    for (i=0; i<v->ngarbage; i++) {
+        Data *data = v->garbage[i];
+        if (!IN_SNAPSHOT(tree, data)) {
+            arena_free(&tree->arena, data, data->size);
+        }
+    }
+    tree->frozen = NULL;
+    write_unlock(tree, locked);
+
+    free_view(v);
+}
+
+// the shared codec may learn new formats between dc_size() and dc_dump()
+static char* dump_codec(Codec *dc, int *size)
+{
+    while (true) {
+        int n = dc_size(dc);
+        char *buf = (char*)malloc(n);
+        if (buf == NULL) return NULL;
+        if (dc_dump(dc, buf, n) == n) {
+            *size = n;
+            return buf;
+        }
+        free(buf);
+    }
+}
+
 // 序列化HashTree
-int ht_save(HTree *tree, const char *path)
+static int save_tree(HTree *tree, const char *path, bool v2)
 {
-    if (!tree || !path) return -1;
+    if (!tree || !path || tree->frozen == NULL) return -1;
+    View *v = tree->frozen;
+    Node *pool = NULL;
 
     char tmp[256];
     sprintf(tmp, "%s.tmp", path);
 
+    char *codec = v->codec;
+    int codec_size = v->codec_size;
+    if (tree->shared_dc) {
+        if (v2) {
+            // older versions need a dump
+            codec = dump_codec(tree->dc, &codec_size);
+        } else if (dc_save(tree->dc) != 0) {
+            codec = NULL;
+        }
+        if (codec == NULL) {
+            fprintf(stderr, "save shared codec failed\n");
+            thaw(tree);
+            return -1;
+        }
+    }
+
     FILE *f = fopen(tmp, "wb");
     if (f == NULL) {
         fprintf(stderr, "open %s failed\n", tmp);
+        if (codec != v->codec) free(codec);
+        thaw(tree);
         return -1;
     }
 
@@ -622,92 +1761,165 @@ int ht_save(HTree *tree, const char *path)
     // 写版本号
     // 写文件大小（占位）
     off_t pos = 0;
-    if (fwrite(VERSION, sizeof(VERSION), 1, f) != 1 ||
+    if (fwrite(v2 ? VERSION2 : VERSION, sizeof(VERSION), 1, f) != 1 ||
         fwrite(&pos, sizeof(off_t), 1, f) != 1) {
         fprintf(stderr, "write version failed\n");
-        fclose(f);
-        return -1;
+        goto FAIL;
     }
 
-    pthread_mutex_lock(&tree->lock);
-
     // 写height
-    // 写Node
-    int pool_size = g_index[tree->height];
-    if (fwrite(&tree->height, sizeof(int), 1, f) != 1 ||
-        fwrite(tree->root, sizeof(Node) * pool_size, 1, f) != 1 ) {
-        fprintf(stderr, "write nodes failed\n");
-        fclose(f);
-        return -1;
+    int pool_size = g_index[v->height];
+    if (fwrite(&v->height, sizeof(int), 1, f) != 1) {
+        goto FAIL;
     }
-
-    // 写数据
-    int i, zero = 0;
-    for (i=0; i<pool_size; i++) {
-        Data *data= tree->root[i].data;
-        if (data) {
-            if (fwrite(&data->used, sizeof(int), 1, f) != 1
-                || fwrite(data, data->used, 1, f) != 1) {
-                fclose(f);
-                return -1;
+    if (!v2) {
+        if (write_snapshot(v, f) != 0) {
+            goto FAIL;
+        }
+    } else {
+        int i, j, zero = 0;
+        pool = (Node*)malloc(sizeof(Node) * pool_size);
+        memset(pool, 0, sizeof(Node) * pool_size);
+        for (i=0; i<v->height; i++) {
+            for (j=g_index[i]; j<g_index[i+1]; j++) {
+                pool[j].depth = i;
             }
-        }else {
-            if (fwrite(&zero, sizeof(int), 1, f) != 1) {
-                fclose(f);
-                return -1;
+        }
+        expand_node(v, v->root, pool, 0);
+
+        // 写Node
+        if (fwrite(pool, sizeof(Node) * pool_size, 1, f) != 1 ) {
+            fprintf(stderr, "write nodes failed\n");
+            goto FAIL;
+        }
+
+        // 写数据
+        for (i=0; i<pool_size; i++) {
+            Data *data= pool[i].data;
+            if (data) {
+                if (write_data(data, f) != 0) {
+                    goto FAIL;
+                }
+            }else {
+                if (fwrite(&zero, sizeof(int), 1, f) != 1) {
+                    goto FAIL;
+                }
             }
         }
-    }
 
-    // 写codec
-    int s = dc_size(tree->dc);
-    char *buf = malloc(s + sizeof(int));
-    *(int*)buf = s;
-    if (dc_dump(tree->dc, buf + sizeof(int), s) != s) {
-        fprintf(stderr, "dump Codec failed\n");
-        free(buf);
-        fclose(f);
-        return -1;
-    }
-    if (fwrite(buf, s + sizeof(int), 1, f) != 1) {
-        fprintf(stderr, "write Codec failed\n");
-        free(buf);
-        fclose(f);
-        return -1;
+        // 写codec
+        if (fwrite(&codec_size, sizeof(int), 1, f) != 1
+            || fwrite(codec, codec_size, 1, f) != 1) {
+            fprintf(stderr, "write Codec failed\n");
+            goto FAIL;
+        }
     }
-    free(buf);
 
     pos = ftello(f); // 文件的大小
     fseeko(f, sizeof(VERSION), 0);
     // 复写pos
     if (fwrite(&pos, sizeof(off_t), 1, f) != 1) {
         fprintf(stderr, "write size failed\n");
-        fclose(f);
-        return -1;
+        goto FAIL;
     }
 
-    pthread_mutex_unlock(&tree->lock);
-
     fclose(f);
+    if (pool) free(pool);
+    if (codec != v->codec) free(codec);
+    thaw(tree);
     rename(tmp, path);
 
     return 0;
+
+FAIL:
+    fclose(f);
+    if (pool) free(pool);
+    if (codec != v->codec) free(codec);
+    unlink(tmp);
+    thaw(tree);
+    return -1;
+}
+
+// The node pool and codec are copied under the lock, the leaves are copied
+// by writers before they change them, so the tree can be saved without
+// blocking ht_add()/ht_get(). Only one view at a time, return 1 if there
+// is one.
+int ht_freeze(HTree *tree)
+{
+    if (!tree) return -1;
+    uint64_t locked = write_lock(tree);
+    if (tree->frozen != NULL) {
+        write_unlock(tree, locked);
+        return 1;
+    }
+    Pool *pool = &tree->pool;
+    View *v = (View*)calloc(1, sizeof(View));
+    int i;
+    v->height = tree->height;
+    v->codec_size = tree->shared_dc ? dc_dump_ref(tree->dc, NULL, 0) : dc_size(tree->dc);
+    v->codec = (char*)malloc(v->codec_size);
+    if (v->codec == NULL || (tree->shared_dc
+            ? dc_dump_ref(tree->dc, v->codec, v->codec_size)
+            : dc_dump(tree->dc, v->codec, v->codec_size)) != v->codec_size) {
+        write_unlock(tree, locked);
+        fprintf(stderr, "freeze HTree failed\n");
+        free_view(v);
+        return -1;
+    }
+    // only the used part of the last chunk
+    v->chunks = (Node**)malloc(sizeof(Node*) * pool->nchunks);
+    for (i=0; i<pool->nchunks; i++) {
+        int n = i < pool->nchunks - 1 ? NODES_PER_CHUNK
+            : pool->next - (i << NODE_BITS);
+        v->chunks[i] = (Node*)malloc(sizeof(Node) * n);
+        memcpy(v->chunks[i], pool->chunks[i], sizeof(Node) * n);
+        v->nchunks ++;
+    }
+    v->limit = pool->next;
+    v->root = NODE_OF(v->chunks, node_id(tree->root));
+    tree->frozen = v;
+    write_unlock(tree, locked);
+    return 0;
+}
+
+// wait for the view taken by others (hint building or snapshot)
+static int freeze_wait(HTree *tree)
+{
+    int r;
+    while ((r = ht_freeze(tree)) > 0) {
+        usleep(1000);
+    }
+    return r;
+}
+
+int ht_save(HTree *tree, const char *path)
+{
+    if (freeze_wait(tree) != 0) return -1;
+    return save_tree(tree, path, false);
+}
+
+int ht_save_frozen(HTree *tree, const char *path)
+{
+    return save_tree(tree, path, false);
+}
+
+int ht_save_v2(HTree *tree, const char *path)
+{
+    if (freeze_wait(tree) != 0) return -1;
+    return save_tree(tree, path, true);
 }
 
 void ht_destroy(HTree *tree)
 {
     if (!tree) return;
 
-    pthread_mutex_lock(&tree->lock);
+    pthread_rwlock_wrlock(&tree->lock);
 
-    dc_destroy(tree->dc);
+    if (!tree->shared_dc) dc_destroy(tree->dc);
 
-    int i;
-    int pool_size = g_index[tree->height];
-    for(i=0; i<pool_size; i++){
-        if (tree->root[i].data) free(tree->root[i].data);
-    }
-    free(tree->root);
+    free_all_data(tree);
+    pthread_rwlock_unlock(&tree->lock);
+    pthread_rwlock_destroy(&tree->lock);
     free(tree);
 }
 
@@ -744,49 +1956,71 @@ bool check_key(HTree *tree, const char* key, int len)
     return true;
 }
 
-void ht_add2(HTree *tree, const char* key, int len, uint32_t pos, uint16_t hash, int32_t ver)
+void ht_add2(HTree *tree, const char* key, int len, uint64_t pos, uint16_t hash, int32_t ver, uint8_t size)
 {
     if (!check_key(tree, key, len)) return;
-    Item *it = create_item(tree, key, len, pos, hash, ver);
-    add_item(tree, tree->root, it, keyhash(key, len), true);
+    Item *it = create_item(tree, key, len, pos, hash, ver, size);
+    uint32_t h = keyhash(key, len);
+    Node *path[MAX_DEPTH + 1];
+    int d = find_path(tree, h, path);
+    uint16_t old_hash = path[d]->hash;
+    uint32_t old_count = path[d]->count;
+    add_item(tree, path[d], it, h);
+    update_path(tree, path, d, old_hash, old_count);
+    compact(tree);
 }
 
-void ht_add(HTree *tree, const char* key, uint32_t pos, uint16_t hash, int32_t ver)
+void ht_add(HTree *tree, const char* key, uint64_t pos, uint16_t hash, int32_t ver)
 {
-    pthread_mutex_lock(&tree->lock);
-    ht_add2(tree, key, strlen(key), pos, hash, ver);
-    pthread_mutex_unlock(&tree->lock);
+    uint64_t locked = write_lock(tree);
+    ht_add2(tree, key, strlen(key), pos, hash, ver, 0);
+    write_unlock(tree, locked);
+}
+
+void ht_add3(HTree *tree, const char* key, int len, uint64_t pos, uint16_t hash, int32_t ver, uint8_t size)
+{
+    uint64_t locked = write_lock(tree);
+    ht_add2(tree, key, len, pos, hash, ver, size);
+    write_unlock(tree, locked);
 }
 
 void ht_remove2(HTree* tree, const char *key, int len)
 {
     if (!check_key(tree, key, len)) return;
-    Item *it = create_item(tree, key, len, 0, 0, 0);
-    remove_item(tree, tree->root, it, keyhash(key, len));
+    Item *it = create_item(tree, key, len, 0, 0, 0, 0);
+    uint32_t h = keyhash(key, len);
+    Node *path[MAX_DEPTH + 1];
+    int d = find_path(tree, h, path);
+    uint16_t old_hash = path[d]->hash;
+    uint32_t old_count = path[d]->count;
+    remove_item(tree, path[d], it, h);
+    update_path(tree, path, d, old_hash, old_count);
+    compact(tree);
 }
 
 void ht_remove(HTree* tree, const char *key)
 {
-    pthread_mutex_lock(&tree->lock);
+    uint64_t locked = write_lock(tree);
     ht_remove2(tree, key, strlen(key));
-    pthread_mutex_unlock(&tree->lock);
+    write_unlock(tree, locked);
 }
 
 Item* ht_get2(HTree* tree, const char* key, int len)
 {
     if (!check_key(tree, key, len)) return NULL;
 
-    pthread_mutex_lock(&tree->lock);
-    Item *it = create_item(tree, key, len, 0, 0, 0);
+    char buf[512];
+    pthread_rwlock_rdlock(&tree->lock);
+    Item *it = create_lookup_item(tree, buf, key, len);
     Item *r = get_item_hash(tree, tree->root, it, keyhash(key, len));
     if (r != NULL){
         Item *rr = (Item*)malloc(sizeof(Item) + len);
-        memcpy(rr, r, sizeof(Item));
+        memcpy(rr, r, ITEM_HEAD);
         memcpy(rr->key, key, len);
         rr->key[len] = 0; // c-str
         r = rr; // r is in node->Data block
     }
-    pthread_mutex_unlock(&tree->lock);
+    pthread_rwlock_unlock(&tree->lock);
     return r;
 }
 
@@ -795,6 +2029,26 @@ Item* ht_get(HTree* tree, const char* key)
     return ht_get2(tree, key, strlen(key));
 }
 
+bool ht_lookup(HTree* tree, const char* key, int len, Item *item)
+{
+    if (!check_key(tree, key, len)) return false;
+
+    char buf[512];
+    pthread_rwlock_rdlock(&tree->lock);
+    Item *it = create_lookup_item(tree, buf, key, len);
+    Item *r = get_item_hash(tree, tree->root, it, keyhash(key, len));
+    if (r != NULL) {
+        item->pos = r->pos;
+        item->bucket = r->bucket;
+        item->ver = r->ver;
+        item->hash = r->hash;
+        item->size = r->size;
+        item->length = 0; // key is not copied
+    }
+    pthread_rwlock_unlock(&tree->lock);
+    return r != NULL;
+}
+
 uint32_t ht_get_hash(HTree* tree, const char* key, int* count)
 {
     if (!tree || !key || key[0] != '@') {
@@ -803,28 +2057,76 @@ uint32_t ht_get_hash(HTree* tree, const char* key, int* count)
     }
 
     uint32_t hash = 0;
-    pthread_mutex_lock(&tree->lock);
-    update_node(tree, tree->root);
+    pthread_rwlock_rdlock(&tree->lock);
     hash = get_node_hash(tree, tree->root, key+1, count);
-    pthread_mutex_unlock(&tree->lock);
+    pthread_rwlock_unlock(&tree->lock);
     return hash;
 }
 
+void ht_stat(HTree *tree, uint64_t *allocated, uint64_t *used)
+{
+    if (!tree) return;
+    pthread_rwlock_rdlock(&tree->lock);
+    uint64_t pool = (uint64_t)tree->pool.groups * GROUP_SIZE;
+    if (allocated) *allocated = tree->arena.allocated + tree->pool.allocated + tree->snapshot_size;
+    if (used) *used = tree->arena.used + pool;
+    pthread_rwlock_unlock(&tree->lock);
+}
+
+// learn the prefixes of keys, only before any key is added,
+// as the keys in tree can not be encoded again
+int ht_train(HTree *tree, const char **keys, const int *lens, int n)
+{
+    int r = -1;
+    if (!tree) return r;
+    uint64_t locked = write_lock(tree);
+    if (!tree->root->is_node && get_data(tree->root)->count == 0) {
+        r = dc_train(tree->dc, keys, lens, n);
+    }
+    write_unlock(tree, locked);
+    return r;
+}
+
+uint32_t ht_max_lock_hold(HTree *tree)
+{
+    return tree ? tree->max_hold : 0;
+}
+
 char* ht_list(HTree* tree, const char* dir, const char* prefix)
 {
     if (!tree || !dir || strlen(dir) > 8) return NULL;
     if (prefix != NULL && strlen(prefix) == 0) prefix = NULL;
 
-    pthread_mutex_lock(&tree->lock);
+    pthread_rwlock_rdlock(&tree->lock);
     char* r = list_dir(tree, tree->root, dir, prefix);
-    pthread_mutex_unlock(&tree->lock);
+    pthread_rwlock_unlock(&tree->lock);
 
     return r;
 }
 
 void ht_visit(HTree *tree, fun_visitor visitor, void *param)
 {
-    pthread_mutex_lock(&tree->lock);
-    visit_node(tree, tree->root, visitor, param);
-    pthread_mutex_unlock(&tree->lock);
+    pthread_rwlock_rdlock(&tree->lock);
+    visit_node(NULL, tree->dc, tree->root, visitor, param);
+    pthread_rwlock_unlock(&tree->lock);
+}
+
+// visit the view taken by ht_freeze() with a private codec, as writers may
+// change tree->dc, then release it. The shared codec can be read without lock.
+void ht_visit_frozen(HTree *tree, fun_visitor visitor, void *param)
+{
+    View *v = tree->frozen;
+    if (tree->shared_dc) {
+        visit_node(v, tree->dc, v->root, visitor, param);
+        thaw(tree);
+        return;
+    }
+    Codec *dc = dc_new();
+    if (dc_load(dc, v->codec, v->codec_size) == 0) {
+        visit_node(v, dc, v->root, visitor, param);
+    } else {
+        fprintf(stderr, "load codec of view failed\n");
+    }
+    dc_destroy(dc);
+    thaw(tree);
 }
@@ -19,6 +19,8 @@
 #include <stdio.h>
 #include <errno.h>
 
+#include "codec.h"
+
 inline static void* 
 my_malloc(size_t s, const char *file, int line, const char *func) {
     void *p = malloc(s);
@@ -34,14 +36,23 @@ my_malloc(size_t s, const char *file, int line, const char *func) {
 
 typedef struct t_item Item;
 struct t_item {
-    uint32_t pos;
+    uint32_t pos;       // offset of the record in data file, in 16 bytes
     int32_t  ver;
     uint16_t hash;
     uint8_t  length;
+    uint8_t  size;      // size class of the record, 0 for unknown
+    uint8_t  bucket;    // the data file
     char     key[1];
 };
 
-#define ITEM_PADDING 1
+#define ITEM_PADDING 3  // the key starts at sizeof(Item) - ITEM_PADDING
+
+// position of a record in API: the offset in data file (aligned to 16
+// bytes) shifted by 4, and the bucket in the low 8 bits
+#define MAKE_POS(bucket, offset) (((uint64_t)(offset) << 4) | (bucket))
+#define POS_BUCKET(pos) ((uint32_t)(pos) & 0xff)
+#define POS_OFFSET(pos) ((uint32_t)((pos) >> 4) & ~0xfu)
+#define ITEM_POS(it) (((uint64_t)(it)->pos << 8) | (it)->bucket)
 
 typedef struct t_hash_tree HTree;
 typedef void (*fun_visitor) (Item *it, void *param);
@@ -49,20 +60,42 @@ typedef void (*fun_visitor) (Item *it, void *param);
 uint32_t fnv1a(const char *key, int key_len);
 
 HTree*   ht_new(int depth, int pos);
+// with a codec shared by trees
+HTree*   ht_new2(int depth, int pos, Codec *dc);
 void     ht_destroy(HTree *tree);
-void     ht_add(HTree *tree, const char* key, uint32_t pos, uint16_t hash, int32_t ver);
+void     ht_add(HTree *tree, const char* key, uint64_t pos, uint16_t hash, int32_t ver);
+// with the size class of the record
+void     ht_add3(HTree *tree, const char* key, int ksz, uint64_t pos, uint16_t hash, int32_t ver, uint8_t size);
 void     ht_remove(HTree *tree, const char *key);
 Item*    ht_get(HTree *tree, const char *key);
 Item*    ht_get2(HTree *tree, const char *key, int ksz);
+// fill pos/bucket/ver/hash/size of caller's item, no allocation
+bool     ht_lookup(HTree *tree, const char *key, int ksz, Item *it);
 uint32_t ht_get_hash(HTree *tree, const char *key, int *count);
 char*    ht_list(HTree *tree, const char *dir, const char *prefix);
 void     ht_visit(HTree *tree, fun_visitor visitor, void *param);
+// bytes of memory allocated for and used by the index
+void     ht_stat(HTree *tree, uint64_t *allocated, uint64_t *used);
+// the longest time (us) the tree is locked for writing
+uint32_t ht_max_lock_hold(HTree *tree);
+// learn a prefix dictionary from sample keys, before adding any key
+int      ht_train(HTree *tree, const char **keys, const int *lens, int n);
 
 HTree*     ht_open(int depth, int pos, const char *path);
+// the snapshot may refer to the shared codec
+HTree*     ht_open2(int depth, int pos, const char *path, Codec *dc);
+// writers are not blocked while saving
 int     ht_save(HTree *tree, const char *path);
+// take a copy-on-write view of the tree, 1 if there is one already
+int     ht_freeze(HTree *tree);
+// save or visit the view taken by ht_freeze(), and release it
+int     ht_save_frozen(HTree *tree, const char *path);
+void    ht_visit_frozen(HTree *tree, fun_visitor visitor, void *param);
+// save in HTREE002, which can be read by old versions
+int     ht_save_v2(HTree *tree, const char *path);
 
 // not thread safe
-void     ht_add2(HTree *tree, const char* key, int ksz, uint32_t pos, uint16_t hash, int32_t ver);
+void     ht_add2(HTree *tree, const char* key, int ksz, uint64_t pos, uint16_t hash, int32_t ver, uint8_t size);
 void     ht_remove2(HTree *tree, const char *key, int ksz);
 
 #endif /* __HTREE_H__ */
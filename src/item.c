@@ -141,12 +141,39 @@ item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbyte
 
     it->nkey = nkey;
     it->nbytes = nbytes;
+    it->fd = -1;
     strcpy(ITEM_key(it), key);
     memcpy(ITEM_suffix(it), suffix, (size_t)nsuffix);
     it->nsuffix = nsuffix;
     return it;
 }
 
+#ifdef HAVE_SENDFILE
+/*
+ * alloc a item for value in data file, only the "\r\n" after the value
+ * is in buffer, the value will be sent from fd by sendfile().
+ */
+static item *item_alloc_file(char *key, const size_t nkey, const int flags, const int vlen,
+                     int fd, off_t offset) {
+    uint8_t nsuffix;
+    char suffix[40];
+    item_make_header(nkey + 1, flags, vlen + 2, suffix, &nsuffix);
+
+    item *it = item_alloc1(key, nkey, flags, 2);
+    if (it == NULL){
+        return NULL;
+    }
+    // suffix of the value in file, no larger than item buffer
+    memcpy(ITEM_suffix(it), suffix, (size_t)nsuffix);
+    it->nsuffix = nsuffix;
+    memcpy(ITEM_data(it), "\r\n", 2);
+    it->fd = fd;
+    it->fbytes = vlen;
+    it->foffset = offset;
+    return it;
+}
+#endif
+
 /*
  * free a item buffer. here 'it' must be a full item.
  */
@@ -158,6 +185,10 @@ int item_free(item *it) {
 
     /* ntotal may be wrong, if 'it' is not a full item. */
     ntotal = ITEM_ntotal(it);
+    if (it->fd >= 0) {
+        close(it->fd);
+        it->fd = -1;
+    }
     if (ntotal > settings.item_buf_size){
         if (settings.verbose > 1) {
             fprintf(stderr, "ntotal: %"PRIuS", use free() directly.\n", ntotal);
@@ -183,7 +214,20 @@ item *item_get(char *key, size_t nkey){
     item *it = NULL;
     int vlen;
     uint32_t flag;
+#ifdef HAVE_SENDFILE
+    // large values are sent from data file, told by the size in index
+    int fd = -1;
+    off_t offset;
+    char *value = hs_get2(store, key, &vlen, &flag, settings.sendfile_size,
+            settings.sendfile_crc, &fd, &offset);
+    if (fd >= 0) {
+        it = item_alloc_file(key, nkey, flag, vlen, fd, offset);
+        if (it == NULL) close(fd);
+        return it;
+    }
+#else
     char *value = hs_get(store, key, &vlen, &flag);
+#endif
     if (value){
         it = item_alloc1(key, nkey, flag, vlen + 2);
         if (it){
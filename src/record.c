@@ -13,8 +13,13 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,9 +31,18 @@
 #include "crc32.c"
 #include "diskmgr.h"
 #include "quicklz.h"
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 //#include "fnv1a.h"
 
+// records are aligned to PADDING in data files of version 1, and to
+// ALIGNMENT since version 2, PADDING bytes are read first for a record
 const int PADDING = 256;
+const int ALIGNMENT = 16;
 const int32_t COMPRESS_FLAG = 0x00010000;
 const int32_t CLIENT_COMPRESS_FLAG = 0x00000010;
 const float COMPRESS_RATIO_LIMIT = 0.7;
@@ -47,15 +61,71 @@ uint32_t gen_hash(char *buf, int len)
     return hash;
 }
 
-int record_length(DataRecord *r)
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 23;
+    h *= 0x2127599bf4325c37ULL;
+    h ^= h >> 47;
+    return h;
+}
+
+// fasthash64, 8 bytes at a time, to tell whether a value is changed
+// without reading the old one
+uint64_t value_digest(const char *buf, int len)
+{
+    const uint64_t m = 0x880355f21e6d1965ULL;
+    uint64_t h = len * m, v;
+    int i;
+    for (i=0; i + 8 <= len; i+=8) {
+        memcpy(&v, buf + i, 8);
+        h ^= mix64(v);
+        h *= m;
+    }
+    if (i < len) {
+        v = 0;
+        memcpy(&v, buf + i, len - i);
+        h ^= mix64(v);
+        h *= m;
+    }
+    return mix64(h);
+}
+
+// bytes of record in data file whose records are aligned to align
+int record_length2(DataRecord *r, int align)
 {
     size_t n = sizeof(DataRecord) - sizeof(char*) + r->ksz + r->vsz;
-    if (n % PADDING != 0) {
-        n += PADDING - (n % PADDING);
+    if (n % align != 0) {
+        n += align - (n % align);
     }
     return n;
 }
 
+int record_length(DataRecord *r)
+{
+    return record_length2(r, ALIGNMENT);
+}
+
+// size class of record in index, in 256 bytes up to 32K, then 16 classes
+// per power of 2 up to 7.75M, 0 for larger ones
+uint8_t record_class(uint32_t length)
+{
+    uint32_t n = (length + PADDING - 1) / PADDING;
+    if (n <= 128) return n;
+    int c;
+    for (c=129; c<256; c++) {
+        if (class_length(c) >= length) return c;
+    }
+    return 0;
+}
+
+// bytes of records in size class c, may be longer than them
+uint32_t class_length(uint8_t c)
+{
+    if (c <= 128) return c * PADDING;
+    c -= 128;
+    return ((16 + (c & 15)) << (3 + (c >> 4))) * PADDING;
+}
+
 char* record_value(DataRecord *r)
 {
     char *res = r->value;
@@ -74,24 +144,269 @@ void free_record(DataRecord *r)
     free(r);
 }
 
+// Compressors of values, a compressed value has COMPRESS_FLAG. QuickLZ
+// data is kept as before, the others start with one byte of the id of
+// compressor, which is never taken as the header of QuickLZ (01SSLLHC).
+#define QLZ_HEADER_BIT 0x40
+#define COMPRESS_NONE 0
+#define COMPRESS_QLZ 1
+#define COMPRESS_LZ4 2
+#define COMPRESS_ZSTD 3
+#define ZSTD_LEVEL 3
+#define MAX_COMPRESS_RULES 16
+
+typedef struct {
+    const char *name;
+    int (*bound)(int size);
+    // size of compressed data in dst, 0 if failed
+    int (*compress)(const char *src, int size, char *dst, int cap);
+    // size of the original data, -1 if broken
+    int (*size)(const char *src, int size);
+    int (*decompress)(const char *src, int size, char *dst, int cap);
+} Compressor;
+
+static int qlz_bound(int size)
+{
+    return size + 400;
+}
+
+static int qlz_comp(const char *src, int size, char *dst, int cap)
+{
+    char *wbuf = malloc(QLZ_SCRATCH_COMPRESS);
+    if (wbuf == NULL) return 0;
+    int n = qlz_compress(src, dst, size, wbuf);
+    free(wbuf);
+    return n;
+}
+
+static int qlz_size(const char *src, int size)
+{
+    if (size < 9 || qlz_size_compressed(src) != size) return -1;
+    return qlz_size_decompressed(src);
+}
+
+static int qlz_decomp(const char *src, int size, char *dst, int cap)
+{
+    char scratch[QLZ_SCRATCH_DECOMPRESS];
+    return qlz_decompress(src, dst, scratch);
+}
+
+#ifdef HAVE_LZ4
+// the size of original data followed by a LZ4 block
+static int lz4_bound(int size)
+{
+    return LZ4_compressBound(size) + sizeof(uint32_t);
+}
+
+static int lz4_comp(const char *src, int size, char *dst, int cap)
+{
+    *(uint32_t*)dst = size;
+    int n = LZ4_compress_default(src, dst + sizeof(uint32_t), size, cap - sizeof(uint32_t));
+    return n > 0 ? n + sizeof(uint32_t) : 0;
+}
+
+static int lz4_size(const char *src, int size)
+{
+    if (size < sizeof(uint32_t)) return -1;
+    return *(uint32_t*)src;
+}
+
+static int lz4_decomp(const char *src, int size, char *dst, int cap)
+{
+    return LZ4_decompress_safe(src + sizeof(uint32_t), dst, size - sizeof(uint32_t), cap);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ZSTD_CDict *zstd_cdict = NULL;
+static ZSTD_DDict *zstd_ddict = NULL;
+static __thread ZSTD_CCtx *zstd_cctx = NULL;
+static __thread ZSTD_DCtx *zstd_dctx = NULL;
+
+static int zstd_bound(int size)
+{
+    return ZSTD_compressBound(size);
+}
+
+static int zstd_comp(const char *src, int size, char *dst, int cap)
+{
+    if (zstd_cctx == NULL && (zstd_cctx = ZSTD_createCCtx()) == NULL) return 0;
+    size_t n = zstd_cdict != NULL
+        ? ZSTD_compress_usingCDict(zstd_cctx, dst, cap, src, size, zstd_cdict)
+        : ZSTD_compressCCtx(zstd_cctx, dst, cap, src, size, ZSTD_LEVEL);
+    return ZSTD_isError(n) ? 0 : n;
+}
+
+static int zstd_size(const char *src, int size)
+{
+    unsigned long long n = ZSTD_getFrameContentSize(src, size);
+    if (n == ZSTD_CONTENTSIZE_UNKNOWN || n == ZSTD_CONTENTSIZE_ERROR) return -1;
+    return n;
+}
+
+static int zstd_decomp(const char *src, int size, char *dst, int cap)
+{
+    if (zstd_dctx == NULL && (zstd_dctx = ZSTD_createDCtx()) == NULL) return -1;
+    unsigned dict = ZSTD_getDictID_fromFrame(src, size);
+    size_t n;
+    if (dict != 0) {
+        if (zstd_ddict == NULL || ZSTD_getDictID_fromDDict(zstd_ddict) != dict) {
+            fprintf(stderr, "zstd dictionary %u is not loaded\n", dict);
+            return -1;
+        }
+        n = ZSTD_decompress_usingDDict(zstd_dctx, dst, cap, src, size, zstd_ddict);
+    } else {
+        n = ZSTD_decompressDCtx(zstd_dctx, dst, cap, src, size);
+    }
+    return ZSTD_isError(n) ? -1 : n;
+}
+#endif
+
+// indexed by id, compressors not built in have only name
+static Compressor compressors[] = {
+    {"none", NULL, NULL, NULL, NULL},
+    {"qlz", qlz_bound, qlz_comp, qlz_size, qlz_decomp},
+#ifdef HAVE_LZ4
+    {"lz4", lz4_bound, lz4_comp, lz4_size, lz4_decomp},
+#else
+    {"lz4", NULL, NULL, NULL, NULL},
+#endif
+#ifdef HAVE_ZSTD
+    {"zstd", zstd_bound, zstd_comp, zstd_size, zstd_decomp},
+#else
+    {"zstd", NULL, NULL, NULL, NULL},
+#endif
+};
+#define NUM_COMPRESSORS (sizeof(compressors) / sizeof(compressors[0]))
+
+// compressor for keys with prefix, the first matched one is used
+static struct {
+    char *prefix;
+    int len;
+    int id;
+} compress_rules[MAX_COMPRESS_RULES];
+static int num_compress_rules = 0;
+static int default_compressor = COMPRESS_QLZ;
+
+static int find_compressor(const char *name, int len)
+{
+    int i;
+    for (i=0; i<NUM_COMPRESSORS; i++) {
+        if (strlen(compressors[i].name) == len && strncmp(compressors[i].name, name, len) == 0) {
+            if (i != COMPRESS_NONE && compressors[i].compress == NULL) {
+                fprintf(stderr, "compressor %s is not built in\n", compressors[i].name);
+                return -1;
+            }
+            return i;
+        }
+    }
+    fprintf(stderr, "unknown compressor: %.*s\n", len, name);
+    return -1;
+}
+
+/*
+ * spec is a list splitted by ',', of the default compressor and
+ * prefix=compressor for keys with that prefix, such as
+ *      lz4,/photo/=none,/text/=zstd
+ */
+int set_compressor(const char *spec)
+{
+    const char *p = spec;
+    while (*p) {
+        int len = strcspn(p, ",");
+        const char *eq = memchr(p, '=', len);
+        if (eq == NULL) {
+            int id = find_compressor(p, len);
+            if (id < 0) return -1;
+            default_compressor = id;
+        } else {
+            int id = find_compressor(eq + 1, p + len - eq - 1);
+            if (id < 0) return -1;
+            if (num_compress_rules >= MAX_COMPRESS_RULES) {
+                fprintf(stderr, "too many compress rules, max is %d\n", MAX_COMPRESS_RULES);
+                return -1;
+            }
+            compress_rules[num_compress_rules].prefix = strndup(p, eq - p);
+            compress_rules[num_compress_rules].len = eq - p;
+            compress_rules[num_compress_rules ++].id = id;
+        }
+        p += len;
+        if (*p == ',') p ++;
+    }
+    return 0;
+}
+
+// dictionary for zstd, trained by `zstd --train`, it should be kept
+// as long as the values compressed with it
+int load_compress_dict(const char *path)
+{
+#ifdef HAVE_ZSTD
+    int r = -1;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "open %s failed\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = malloc(size);
+    if (buf == NULL || fread(buf, 1, size, f) != size) {
+        fprintf(stderr, "read %s failed\n", path);
+        goto LOAD_END;
+    }
+    zstd_cdict = ZSTD_createCDict(buf, size, ZSTD_LEVEL);
+    zstd_ddict = ZSTD_createDDict(buf, size);
+    if (zstd_cdict == NULL || zstd_ddict == NULL) {
+        fprintf(stderr, "bad zstd dictionary: %s\n", path);
+        goto LOAD_END;
+    }
+    r = 0;
+
+LOAD_END:
+    fclose(f);
+    free(buf);
+    return r;
+#else
+    fprintf(stderr, "zstd is not built in, can not load %s\n", path);
+    return -1;
+#endif
+}
+
+static int choose_compressor(DataRecord *r)
+{
+    int i;
+    for (i=0; i<num_compress_rules; i++) {
+        if (r->ksz >= compress_rules[i].len
+            && memcmp(r->key, compress_rules[i].prefix, compress_rules[i].len) == 0) {
+            return compress_rules[i].id;
+        }
+    }
+    return default_compressor;
+}
+
 void compress_record(DataRecord *r)
 {
     if (r->flag & COMPRESS_FLAG) return;
     int ksz = r->ksz, vsz = r->vsz; 
     int n = sizeof(DataRecord) - sizeof(char*) + ksz + vsz;
-    if (n > PADDING && (r->flag & (COMPRESS_FLAG|CLIENT_COMPRESS_FLAG)) == 0) {
-        char *wbuf = malloc(QLZ_SCRATCH_COMPRESS);
-        char *v = malloc(vsz + 400);
-        if (wbuf == NULL || v == NULL) return ;
+    if (n > PADDING && (r->flag & CLIENT_COMPRESS_FLAG) == 0) {
+        int id = choose_compressor(r);
+        Compressor *c = &compressors[id];
+        if (c->compress == NULL) return;
+        int prefix = id == COMPRESS_QLZ ? 0 : 1;
+        int cap = c->bound(vsz);
+        char *v = malloc(prefix + cap);
+        if (v == NULL) return ;
+        v[0] = id;
         int try_size = vsz > TRY_COMPRESS_SIZE ? TRY_COMPRESS_SIZE : vsz; 
-        int vsize = qlz_compress(r->value, v, try_size, wbuf);
-        if (try_size < vsz && vsize < try_size * COMPRESS_RATIO_LIMIT){
+        int vsize = c->compress(r->value, try_size, v + prefix, cap);
+        if (try_size < vsz && vsize > 0 && vsize < try_size * COMPRESS_RATIO_LIMIT){
             try_size = vsz;
-            vsize = qlz_compress(r->value, v, try_size, wbuf);
+            vsize = c->compress(r->value, try_size, v + prefix, cap);
         }
-        free(wbuf);
         
-        if (vsize > try_size * COMPRESS_RATIO_LIMIT || try_size < vsz) {
+        if (vsize <= 0 || vsize + prefix > try_size * COMPRESS_RATIO_LIMIT || try_size < vsz) {
             free(v);
             return;
         }
@@ -101,30 +416,49 @@ void compress_record(DataRecord *r)
         }
         r->value = v;
         r->free_value = true;
-        r->vsz = vsize;
+        r->vsz = vsize + prefix;
         r->flag |= COMPRESS_FLAG;
     }
 }
 
-DataRecord* decompress_record(DataRecord *r)
+// the value is left as it is if it can not be decompressed
+static bool decompress_value(DataRecord *r)
 {
     if (r->flag & COMPRESS_FLAG) {
-        char scratch[QLZ_SCRATCH_DECOMPRESS];
-        int csize = qlz_size_compressed(r->value);
-        if (csize != r->vsz) {
-            fprintf(stderr, "broken compressed data: %d != %d, flag=%x\n", csize, r->vsz, r->flag);
-            goto DECOMP_END;
+        if (r->vsz < 1) {
+            fprintf(stderr, "broken compressed data of %s: vsz=%d\n", r->key, r->vsz);
+            return false;
+        }
+        int id = (uint8_t)r->value[0], prefix = 1;
+        if (id & QLZ_HEADER_BIT) {
+            id = COMPRESS_QLZ;
+            prefix = 0;
+        }
+        if (id == COMPRESS_NONE || id >= NUM_COMPRESSORS) {
+            fprintf(stderr, "can not decompress %s: unknown compressor %d\n", r->key, id);
+            return false;
+        }
+        Compressor *c = &compressors[id];
+        if (c->decompress == NULL) {
+            fprintf(stderr, "can not decompress %s: %s is not built in\n", r->key, c->name);
+            return false;
+        }
+        const char *src = r->value + prefix;
+        int size = c->size(src, r->vsz - prefix);
+        if (size < 0 || size > 100 * 1024 * 1024) {
+            fprintf(stderr, "broken compressed data: %d, vsz=%d, flag=%x\n", size, r->vsz, r->flag);
+            return false;
         }
-        int size = qlz_size_decompressed(r->value);
         char *v = malloc(size);
         if (v == NULL) {
             fprintf(stderr, "malloc(%d)\n", size);
-            goto DECOMP_END;
+            return false;
         }
-        int ret = qlz_decompress(r->value, v, scratch);
+        int ret = c->decompress(src, r->vsz - prefix, v, size);
         if (ret != size) {
             fprintf(stderr, "decompress %s failed: %d != %d\n", r->key, ret, size);
-            goto DECOMP_END;
+            free(v);
+            return false;
         }
         if (r->free_value) {
             free(r->value);
@@ -134,11 +468,27 @@ DataRecord* decompress_record(DataRecord *r)
         r->vsz = size;
         r->flag &= ~COMPRESS_FLAG;
     }
+    return true;
+}
+
+DataRecord* decompress_record(DataRecord *r)
+{
+    if (!decompress_value(r)) {
+        free_record(r);
+        return NULL;
+    }
     return r;
+}
 
-DECOMP_END:
-    free_record(r); 
-    return NULL;
+// hash of the original value, 0 if it can not be decompressed, such as
+// by a compressor not built in, the record is indexed by its header then
+static uint16_t record_hash(DataRecord *r, const char *path, uint32_t pos)
+{
+    if (!decompress_value(r)) {
+        fprintf(stderr, "index %s @%u in %s without hash of value\n", r->key, pos, path);
+        return 0;
+    }
+    return gen_hash(r->value, r->vsz);
 }
 
 DataRecord* decode_record(char* buf, uint32_t size, bool decomp)
@@ -204,7 +554,7 @@ DataRecord* read_record(FILE *f, bool decomp)
         int ret = 0;
         if (need > 0 && need != (ret=fread(r->value + read_size, 1, need, f))) {
             r->key[ksz] = 0; // c str    
-            fprintf(stderr, "read record %s faied: %d < %d @%lld\n", r->key, ret, need, ftello(f)); 
+            fprintf(stderr, "read record %s faied: %d < %d @%lld\n", r->key, ret, need, (long long)ftello(f)); 
             goto READ_END;
         }
     }
@@ -214,7 +564,7 @@ DataRecord* read_record(FILE *f, bool decomp)
                     sizeof(DataRecord) - sizeof(char*) - sizeof(uint32_t) + ksz);
     crc = crc32(crc, r->value, vsz);
     if (crc != crc_old){
-        fprintf(stderr, "%s @%lld crc32 check failed %d != %d\n", r->key, ftello(f), crc, r->crc);
+        fprintf(stderr, "%s @%lld crc32 check failed %d != %d\n", r->key, (long long)ftello(f), crc, r->crc);
         goto READ_END;
     }
 
@@ -233,7 +583,9 @@ DataRecord* fast_read_record(int fd, off_t offset, bool decomp)
     DataRecord *r = (DataRecord*) malloc(PADDING + sizeof(char*));
     r->value = NULL;
    
-    if (pread(fd, &r->crc, PADDING, offset) != PADDING) {
+    // the last records can be shorter than PADDING since version 2
+    int n = pread(fd, &r->crc, PADDING, offset);
+    if (n < (int)(sizeof(DataRecord) - sizeof(char*))) {
         fprintf(stderr, "read record faied\n");         
         goto READ_END;
     }
@@ -245,7 +597,11 @@ DataRecord* fast_read_record(int fd, off_t offset, bool decomp)
     }
   
     uint32_t crc_old = r->crc;
-    int read_size = PADDING - (sizeof(DataRecord) - sizeof(char*)) - ksz;
+    int read_size = n - (sizeof(DataRecord) - sizeof(char*)) - ksz;
+    if (read_size < 0) {
+        fprintf(stderr, "read record faied: %d bytes @%lld\n", n, (long long)offset);
+        goto READ_END;
+    }
     if (vsz < read_size) {
         r->value = r->key + ksz + 1;
         r->free_value = false;
@@ -256,9 +612,9 @@ DataRecord* fast_read_record(int fd, off_t offset, bool decomp)
         memcpy(r->value, r->key + ksz, read_size);
         int need = vsz - read_size;
         int ret = 0;
-        if (need > 0 && need != (ret=pread(fd, r->value + read_size, need, offset+PADDING))) {
+        if (need > 0 && need != (ret=pread(fd, r->value + read_size, need, offset+n))) {
             r->key[ksz] = 0; // c str    
-            fprintf(stderr, "read record %s faied: %d < %d @%lld\n", r->key, ret, need, offset); 
+            fprintf(stderr, "read record %s faied: %d < %d @%lld\n", r->key, ret, need, (long long)offset); 
             goto READ_END;
         }
     }
@@ -268,7 +624,7 @@ DataRecord* fast_read_record(int fd, off_t offset, bool decomp)
                     sizeof(DataRecord) - sizeof(char*) - sizeof(uint32_t) + ksz);
     crc = crc32(crc, r->value, vsz);
     if (crc != crc_old){
-        fprintf(stderr, "%s @%lld crc32 check failed %d != %d\n", r->key, offset, crc, r->crc);
+        fprintf(stderr, "%s @%lld crc32 check failed %d != %d\n", r->key, (long long)offset, crc, r->crc);
         goto READ_END;
     }
 
@@ -282,30 +638,197 @@ READ_END:
     return NULL; 
 }
 
-char* encode_record(DataRecord *r, int *size)
+// the record with key of ksz bytes in one preadv(), length is from the size
+// class in index, header and key are read into r and the value into its own
+// buffer directly. Read it again as before if anything is unexpected.
+DataRecord* fast_read_record2(int fd, off_t offset, int ksz, uint32_t length, bool decomp)
 {
-    compress_record(r);
+    int hsize = sizeof(DataRecord) - sizeof(char*) + ksz;
+    if (length <= PADDING || ksz > 200 || hsize >= length) {
+        return fast_read_record(fd, offset, decomp);
+    }
+
+    DataRecord *r = (DataRecord*) malloc(PADDING + sizeof(char*));
+    r->value = malloc(length - hsize);
+    struct iovec iov[2] = {{&r->crc, hsize}, {r->value, length - hsize}};
+    ssize_t n = preadv(fd, iov, 2, offset);
+    if (n < hsize || r->ksz != ksz || r->vsz > n - hsize) {
+        goto READ_AGAIN;
+    }
+    uint32_t crc_old = r->crc;
+    r->free_value = true;
+    r->key[ksz] = 0; // c str
+
+    uint32_t crc = crc32(0, (char*)(&r->tstamp),
+                    sizeof(DataRecord) - sizeof(char*) - sizeof(uint32_t) + ksz);
+    crc = crc32(crc, r->value, r->vsz);
+    if (crc != crc_old){
+        fprintf(stderr, "%s @%lld crc32 check failed %d != %d\n", r->key, (long long)offset, crc, crc_old);
+        free_record(r);
+        return NULL;
+    }
+
+    if (decomp) {
+        r = decompress_record(r);
+    }
+    return r;
+
+READ_AGAIN:
+    free(r->value);
+    free(r);
+    return fast_read_record(fd, offset, decomp);
+}
+
+// header and key of a record, whose value is left in file to be sent as is
+// from offset + header size, the crc of value is checked by reading it in
+// pieces if check_crc, so it is read twice: sendfile() can not checksum
+// what it sends, the second read is from page cache. NULL if it's broken
+// or compressed.
+DataRecord* read_record_header(int fd, off_t offset, bool check_crc)
+{
+    DataRecord *r = (DataRecord*) malloc(PADDING + sizeof(char*));
+    char *buf = NULL;
+    r->value = NULL;
 
-    int m, n;
+    int n = pread(fd, &r->crc, PADDING, offset);
+    if (n < (int)(sizeof(DataRecord) - sizeof(char*))) {
+        fprintf(stderr, "read record faied\n");
+        goto READ_END;
+    }
     int ksz = r->ksz, vsz = r->vsz;
-    int hs = sizeof(char*); // over header
-    m = n = sizeof(DataRecord) - hs + ksz + vsz;
-    if (n % PADDING != 0) {
-        m += PADDING - (n % PADDING);
+    if (ksz < 0 || ksz > 200 || vsz < 0 || (r->flag & COMPRESS_FLAG) != 0
+        || n < sizeof(DataRecord) - sizeof(char*) + ksz) {
+        goto READ_END;
     }
+    uint32_t crc_old = r->crc;
+    r->free_value = false;
 
-    char *buf = malloc(m);
+    if (check_crc) {
+        int hsize = sizeof(DataRecord) - sizeof(char*) + ksz, size = 64 << 10;
+        uint32_t crc = crc32(0, (char*)(&r->tstamp), hsize - sizeof(uint32_t));
+        off_t pos = offset + hsize;
+        buf = malloc(size);
+        while (vsz > 0) {
+            int n = pread(fd, buf, vsz < size ? vsz : size, pos);
+            if (n <= 0) {
+                fprintf(stderr, "read value faied @%lld\n", (long long)pos);
+                goto READ_END;
+            }
+            crc = crc32(crc, buf, n);
+            pos += n;
+            vsz -= n;
+        }
+        if (crc != crc_old) {
+            r->key[ksz] = 0;
+            fprintf(stderr, "%s @%lld crc32 check failed %d != %d\n", r->key, (long long)offset, crc, crc_old);
+            goto READ_END;
+        }
+        free(buf);
+    }
+    r->key[ksz] = 0; // c str
+    return r;
+
+READ_END:
+    free(buf);
+    free_record(r);
+    return NULL;
+}
+
+// header and key of a compressed record, returns crc of them
+static uint32_t encode_header(DataRecord *r, char *buf)
+{
+    int hs = sizeof(DataRecord) - sizeof(char*); // header in file
+    memcpy(buf, &r->crc, hs);
+    memcpy(buf + hs, r->key, r->ksz);
+    int n = hs + r->ksz + r->vsz;
+    memset(buf + n, 0, record_length(r) - n);
+    return crc32(0, buf + sizeof(uint32_t), hs - sizeof(uint32_t) + r->ksz);
+}
+
+uint32_t value_crc(DataRecord *r)
+{
+    return crc32(0, r->value, r->vsz);
+}
+
+// encode a compressed record into buf of record_length(r) bytes, with
+// the crc of value from value_crc(), so it can be computed before
+void encode_record2(DataRecord *r, char *buf, uint32_t vcrc)
+{
+    uint32_t crc = encode_header(r, buf);
+    memcpy(buf + sizeof(DataRecord) - sizeof(char*) + r->ksz, r->value, r->vsz);
+    crc = crc32_combine(crc, vcrc, r->vsz);
+    memcpy(buf, &crc, sizeof(uint32_t));
+}
+
+char* encode_record(DataRecord *r, int *size)
+{
+    compress_record(r);
 
-    DataRecord *data = (DataRecord*)(buf - hs);
-    memcpy(&data->crc, &r->crc, sizeof(DataRecord)-hs);
-    memcpy(data->key, r->key, ksz);
-    memcpy(data->key + ksz, r->value, vsz);
-    data->crc = crc32(0, (char*)&data->tstamp, n - sizeof(uint32_t));
+    int m = record_length(r);
+    char *buf = malloc(m);
+    uint32_t crc = encode_header(r, buf);
+    // copy and checksum the value in one pass
+    crc = crc32_copy(crc, buf + sizeof(DataRecord) - sizeof(char*) + r->ksz, r->value, r->vsz);
+    memcpy(buf, &crc, sizeof(uint32_t));
     
     *size = m;    
     return buf;
 }
 
+// the header of data files since version 2, a record without key, whose
+// version is DATA_VERSION, DATA_HEADER_SIZE bytes are put into buf
+typedef struct data_header {
+    uint32_t crc;
+    int32_t tstamp;
+    int32_t flag;
+    int32_t version;
+    uint32_t ksz;
+    uint32_t vsz;
+    char padding[DATA_HEADER_SIZE - 24];
+} DataHeader;
+
+int put_data_header(char *buf)
+{
+    DataHeader h;
+    memset(&h, 0, sizeof(h));
+    h.tstamp = time(NULL);
+    h.version = DATA_VERSION;
+    h.crc = crc32(0, (char*)&h.tstamp, sizeof(DataRecord) - sizeof(char*) - sizeof(uint32_t));
+    memcpy(buf, &h, DATA_HEADER_SIZE);
+    return DATA_HEADER_SIZE;
+}
+
+// alignment of records in the data file starting with buf
+static int data_file_align(const char *buf, size_t size)
+{
+    DataHeader h;
+    if (size >= DATA_HEADER_SIZE) {
+        memcpy(&h, buf, DATA_HEADER_SIZE);
+        if (h.ksz == 0 && h.version == DATA_VERSION) return ALIGNMENT;
+    }
+    return PADDING;
+}
+
+static int read_data_file_align(const char *path)
+{
+    char buf[DATA_HEADER_SIZE];
+    int align = PADDING;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return align;
+    if (fread(buf, 1, sizeof(buf), f) == sizeof(buf)) {
+        align = data_file_align(buf, sizeof(buf));
+    }
+    fclose(f);
+    return align;
+}
+
+// the first record in mapped data file, after the header
+static char* first_record(MFile *f, int *align)
+{
+    *align = data_file_align(f->addr, f->size);
+    return f->addr + (*align == ALIGNMENT ? DATA_HEADER_SIZE : 0);
+}
+
 int write_record(FILE *f, DataRecord *r) 
 {
     int size;
@@ -326,7 +849,8 @@ void scanDataFile(HTree* tree, int bucket, const char* path, const char* hintpat
     
     fprintf(stderr, "scan datafile %s\n", path);
     HTree *cur_tree = ht_new(0,0);
-    char *p = f->addr, *end = f->addr + f->size;
+    int align;
+    char *p = first_record(f, &align), *end = f->addr + f->size;
     int broken = 0;
     size_t last_advise = 0;
     while (p < end) {
@@ -334,23 +858,23 @@ void scanDataFile(HTree* tree, int bucket, const char* path, const char* hintpat
 
         if (r != NULL) {
             uint32_t pos = p - f->addr;
-            p += record_length(r); 
-            r = decompress_record(r);
-            uint16_t hash = gen_hash(r->value, r->vsz);
+            uint8_t size = record_class(record_length2(r, align));
+            p += record_length2(r, align);
+            uint16_t hash = record_hash(r, path, pos);
             if (r->version > 0){
-                ht_add2(tree, r->key, r->ksz, pos | bucket, hash, r->version);            
+                ht_add2(tree, r->key, r->ksz, MAKE_POS(bucket, pos), hash, r->version, size);
             }else{
                 ht_remove2(tree, r->key, r->ksz);
             }
-            ht_add2(cur_tree, r->key, r->ksz, pos | bucket, hash, r->version);
+            ht_add2(cur_tree, r->key, r->ksz, MAKE_POS(bucket, pos), hash, r->version, size);
             free_record(r);
         } else {
             broken ++;
             if (broken > 40960) { // 10M
-                fprintf(stderr, "unexpected broken data in %s at %ld\n", path, p - f->addr - broken * PADDING);
+                fprintf(stderr, "unexpected broken data in %s at %ld\n", path, p - f->addr - broken * align);
                 break;
             }
-            p += PADDING;
+            p += align;
         }
 	size_t pos = p - f->addr;
 	if (pos - last_advise > (64<<20)) {
@@ -372,7 +896,8 @@ void scanDataFileBefore(HTree* tree, int bucket, const char* path, time_t before
     if (f == NULL) return;
     
     fprintf(stderr, "scan datafile %s before %ld\n", path, before);
-    char *p = f->addr, *end = f->addr + f->size;
+    int align;
+    char *p = first_record(f, &align), *end = f->addr + f->size;
     int broken = 0;
     size_t last_advise = 0;
     while (p < end) {
@@ -382,12 +907,11 @@ void scanDataFileBefore(HTree* tree, int bucket, const char* path, time_t before
                 break;
             }
             uint32_t pos = p - f->addr;
-            p += record_length(r); 
-            r = decompress_record(r);
-            uint16_t hash = gen_hash(r->value, r->vsz);
+            uint8_t size = record_class(record_length2(r, align));
+            p += record_length2(r, align);
+            uint16_t hash = record_hash(r, path, pos);
             if (r->version > 0){
-                uint16_t hash = gen_hash(r->value, r->vsz);
-                ht_add2(tree, r->key, r->ksz, pos | bucket, hash, r->version);            
+                ht_add2(tree, r->key, r->ksz, MAKE_POS(bucket, pos), hash, r->version, size);
             }else{
                 ht_remove2(tree, r->key, r->ksz);
             }
@@ -395,10 +919,10 @@ void scanDataFileBefore(HTree* tree, int bucket, const char* path, time_t before
         } else {
             broken ++;
             if (broken > 40960) { // 10M
-                fprintf(stderr, "unexpected broken data in %s at %ld\n", path, p - f->addr - broken * PADDING);
+                fprintf(stderr, "unexpected broken data in %s at %ld\n", path, p - f->addr - broken * align);
                 break;
             }
-            p += PADDING;
+            p += align;
         }
 	size_t pos = p - f->addr;
 	if (pos - last_advise > (64<<20)) {
@@ -417,18 +941,17 @@ void scanDataFileBefore(HTree* tree, int bucket, const char* path, time_t before
 void update_items(Item *it, void *args)
 {
     HTree *tree = (HTree*) args;
-    Item *p = ht_get(tree, it->key);
-    if (p) {
-        if (it->pos != p->pos && it->ver == p->ver) {
+    Item p;
+    if (ht_lookup(tree, it->key, strlen(it->key), &p)) {
+        if (ITEM_POS(it) != ITEM_POS(&p) && it->ver == p.ver) {
             if (it->ver > 0) {
-                ht_add(tree, p->key, it->pos, p->hash, p->ver);
+                ht_add3(tree, it->key, strlen(it->key), ITEM_POS(it), p.hash, p.ver, it->size);
             } else {
-                ht_remove(tree, p->key);
+                ht_remove(tree, it->key);
             }
         }
-        free(p);
     } else {
-        ht_add(tree, it->key, it->pos, it->hash, it->ver);
+        ht_add3(tree, it->key, strlen(it->key), ITEM_POS(it), it->hash, it->ver, it->size);
     }
 }
 
@@ -444,6 +967,13 @@ uint32_t optimizeDataFile(HTree* tree, int bucket, const char* path, const char*
     if (lastdata != NULL) {
         new_df = fopen(lastdata, "ab");
         old_data_size = ftello(new_df);
+        if (old_data_size > 0 && read_data_file_align(lastdata) != ALIGNMENT) {
+            // not appended into data file of version 1, it will be
+            // converted when optimized
+            fclose(new_df);
+            close_mfile(f);
+            return 0;
+        }
 
         if (old_data_size > 0) {
             HintFile *hint = open_hint(lasthint, NULL);
@@ -455,19 +985,28 @@ uint32_t optimizeDataFile(HTree* tree, int bucket, const char* path, const char*
             hint_size = hint->size * 2;
             if (hint_size < 4096) hint_size = 4096;
             hintdata = malloc(hint_size);
-            memcpy(hintdata, hint->buf, hint->size);
-            hint_used = hint->size;
+            hint_used = put_hint_header(hintdata);
+            // in current version, old ones are shorter per record
+            char *q = hint->records, *hend = hint->buf + hint->size;
+            while (q < hend) {
+                HintRecord *hr = (HintRecord*) q;
+                q += HINT_LENGTH(hint, hr);
+                if (q > hend) break;
+                hint_used += put_hint_record(hintdata + hint_used, HINT_KEY(hint, hr), hr->ksize,
+                        HINT_POS(hint, hr), hr->version, hr->hash, HINT_SIZE(hint, hr));
+            }
             close_hint(hint);
         } else {
             hint_size = 4096;
             hintdata = malloc(hint_size);
-            hint_used = 0;
+            hint_used = put_hint_header(hintdata);
         }
     } else {
         sprintf(tmp, "%s.tmp", path);
         new_df = fopen(tmp, "wb");
         hintdata = malloc(1<<20);
         hint_size = 1<<20;
+        hint_used = put_hint_header(hintdata);
     }
     if (new_df == NULL){
         fprintf(stderr, "open new datafile failed\n");
@@ -476,8 +1015,8 @@ uint32_t optimizeDataFile(HTree* tree, int bucket, const char* path, const char*
     }
     
     HTree *cur_tree = ht_new(0,0);
-    int deleted = 0, broken = 0;
-    char *p = f->addr, *end = f->addr + f->size;
+    int deleted = 0, broken = 0, align;
+    char *p = first_record(f, &align), *end = f->addr + f->size;
     size_t last_advise = 0;
     while (p < end) {
         DataRecord *r = decode_record(p, end-p, false);
@@ -485,16 +1024,30 @@ uint32_t optimizeDataFile(HTree* tree, int bucket, const char* path, const char*
             broken ++;
             if (broken > 40960) { // 10M
                 // TODO: delete broken keys from htree
-                fprintf(stderr, "unexpected broken data in %s at %ld\n", path, p - f->addr - broken * PADDING);
+                fprintf(stderr, "unexpected broken data in %s at %ld\n", path, p - f->addr - broken * align);
                 break;
             }
-            p += PADDING;
+            p += align;
             continue;
         }
-        Item *it = ht_get2(tree, r->key, r->ksz);
+        Item item, *it = NULL;
+        if (ht_lookup(tree, r->key, r->ksz, &item)) it = &item;
         uint32_t pos = p - f->addr;
-        if (it && it->pos  == (pos | bucket) && (it->ver > 0 || skipped)) {
+        if (it && ITEM_POS(it) == MAKE_POS(bucket, pos) && (it->ver > 0 || skipped)) {
             uint32_t new_pos = ftello(new_df);
+            // records are written in the current version
+            if (new_pos == 0) {
+                char header[DATA_HEADER_SIZE];
+                new_pos = put_data_header(header);
+                if (fwrite(header, 1, new_pos, new_df) != new_pos) {
+                    fprintf(stderr, "write error: %s\n", path);
+                    free(hintdata);
+                    ht_destroy(cur_tree);
+                    close_mfile(f);
+                    fclose(new_df);
+                    return -1;
+                }
+            }
             if (new_pos + record_length(r) > max_data_size) {
                 fprintf(stderr, "optimize %s into %s failed\n", path, lastdata);
                 free(hintdata);
@@ -506,20 +1059,16 @@ uint32_t optimizeDataFile(HTree* tree, int bucket, const char* path, const char*
             }
 
             uint16_t hash = it->hash;
-            ht_add2(cur_tree, r->key, r->ksz, new_pos | last_bucket, hash, it->ver);
+            uint8_t size = record_class(record_length(r));
+            ht_add2(cur_tree, r->key, r->ksz, MAKE_POS(last_bucket, new_pos), hash, it->ver, size);
             // append record to hint file
-            int hsize = sizeof(HintRecord) - NAME_IN_RECORD + r->ksz + 1;
+            int hsize = HINT_RECORD_LENGTH(r->ksz);
             if (hint_used + hsize > hint_size) {
                 hint_size *= 2;
                 hintdata = realloc(hintdata, hint_size);
             }
-            HintRecord *hr = (HintRecord*)(hintdata + hint_used);
-            hr->ksize = r->ksz;
-            hr->pos = new_pos >> 8;
-            hr->version = it->ver;
-            hr->hash = hash;
-            memcpy(hr->key, r->key, r->ksz + 1);
-            hint_used += hsize;
+            hint_used += put_hint_record(hintdata + hint_used, r->key, r->ksz, new_pos,
+                    it->ver, hash, size);
 
             if (write_record(new_df, r) != 0) {
                 fprintf(stderr, "write error: %s\n", path);
@@ -530,12 +1079,11 @@ uint32_t optimizeDataFile(HTree* tree, int bucket, const char* path, const char*
                 return -1;
             }
         }else{
-            if (it && it->pos == (pos | bucket) && it->ver < 0) 
-                ht_add2(cur_tree, r->key, r->ksz, 0, it->hash, it->ver);
+            if (it && ITEM_POS(it) == MAKE_POS(bucket, pos) && it->ver < 0) 
+                ht_add2(cur_tree, r->key, r->ksz, 0, it->hash, it->ver, 0);
             deleted ++;
         }
-        if (it) free(it);
-        p += record_length(r); 
+        p += record_length2(r, align);
         free_record(r);
 	
 	if (pos - last_advise > (64<<20)) {
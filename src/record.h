@@ -34,16 +34,38 @@ typedef struct data_record {
 	char key[0];
 } DataRecord;
 
+// Data files of version 2 start with a header record (see put_data_header),
+// and the records are aligned to 16 bytes in them, 256 in the older ones.
+#define DATA_VERSION 2
+#define DATA_HEADER_SIZE 32
+
 typedef bool (*RecordVisitor)(DataRecord *r, void *arg1, void *arg2);
 
 uint32_t gen_hash(char* buf, int size);
+// 64 bits digest of the whole value
+uint64_t value_digest(const char *buf, int size);
+
+// compressor of values, see record.c
+int set_compressor(const char *spec);
+int load_compress_dict(const char *path);
 
 char* record_value(DataRecord *r);
 void free_record(DataRecord *r);
+void compress_record(DataRecord *r);
+DataRecord* decompress_record(DataRecord *r);
 DataRecord* decode_record(char* buf, uint32_t size, bool decomp);
 char* encode_record(DataRecord* r, int* size);	
+int record_length(DataRecord *r);
+int record_length2(DataRecord *r, int align);
+uint8_t record_class(uint32_t length);
+uint32_t class_length(uint8_t c);
+uint32_t value_crc(DataRecord *r);
+void encode_record2(DataRecord *r, char *buf, uint32_t vcrc);
+int put_data_header(char *buf);
 DataRecord* read_record(FILE *f, bool decomp);
 DataRecord* fast_read_record(int fd, off_t offset, bool decomp);
+DataRecord* fast_read_record2(int fd, off_t offset, int ksz, uint32_t length, bool decomp);
+DataRecord* read_record_header(int fd, off_t offset, bool check_crc);
 
 void scanDataFile(HTree* tree, int bucket, const char* path, const char* hintpath);
 void scanDataFileBefore(HTree* tree, int bucket, const char* path, time_t before);
@@ -0,0 +1,445 @@
+/*
+ * micro benchmarks for bitcask
+ *
+ *   make bb && ./bb [MB per run]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "bitcask.h"
+#include "record.h"
+
+extern const int PADDING;
+
+#define MAX_THREADS 32
+#define BENCH_PATH "/tmp/bench_bitcask"
+
+static int total_mb = 256;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+struct writer_args {
+    Bitcask *bc;
+    int id;
+    int vsz;
+    int ops;
+    char *value;
+    double *lat; // latency of every SET, or NULL
+};
+
+static void* writer(void *param)
+{
+    struct writer_args *args = (struct writer_args*) param;
+    char key[100];
+    int i;
+    for (i=0; i<args->ops; i++) {
+        sprintf(key, "/bench/%d/%d", args->id, i);
+        // different values, as different photos
+        memcpy(args->value, key, strlen(key));
+        double st = args->lat ? now() : 0;
+        bc_set(args->bc, key, args->value, args->vsz, 0, 0);
+        if (args->lat) args->lat[i] = now() - st;
+    }
+    return NULL;
+}
+
+// text alike, compressible to about 40%
+static void fill_value(char *buf, int size, unsigned int seed)
+{
+    static const char *words[] = {"the", "of", "and", "movie", "music", "book",
+        "photo", "review", "story", "good", "really", "like", "people", "very"};
+    int len = 0;
+    while (len < size) {
+        const char *w = words[rand_r(&seed) % 14];
+        int n = strlen(w);
+        if (len + n + 1 > size) n = size - len - 1;
+        memcpy(buf + len, w, n);
+        len += n;
+        buf[len ++] = ' ';
+    }
+}
+
+// SET throughput of one bitcask against number of writers
+static void bench_set_scaling(int vsz)
+{
+    int nthreads;
+    printf("set %d bytes:\n", vsz);
+    for (nthreads=1; nthreads<=MAX_THREADS; nthreads*=2) {
+        pthread_t tids[MAX_THREADS];
+        struct writer_args args[MAX_THREADS];
+        int i, ops = ((int64_t)total_mb << 20) / vsz / nthreads;
+        if (system("rm -rf " BENCH_PATH) != 0) return;
+        Bitcask *bc = bc_open(BENCH_PATH, 0, 0, 0);
+        if (bc == NULL) {
+            printf("open %s failed\n", BENCH_PATH);
+            return;
+        }
+        for (i=0; i<nthreads; i++) {
+            args[i].bc = bc;
+            args[i].id = i;
+            args[i].vsz = vsz;
+            args[i].ops = ops;
+            args[i].value = malloc(vsz);
+            args[i].lat = NULL;
+            fill_value(args[i].value, vsz, i + 1);
+        }
+        double st = now();
+        for (i=0; i<nthreads; i++) {
+            pthread_create(&tids[i], NULL, writer, &args[i]);
+        }
+        for (i=0; i<nthreads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        double used = now() - st;
+        printf("  %2d threads: %8.0f set/s, %6.1f MB/s\n", nthreads,
+                ops * nthreads / used, (double)ops * nthreads * vsz / used / 1048576);
+        for (i=0; i<nthreads; i++) {
+            free(args[i].value);
+        }
+        bc_close(bc);
+    }
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+}
+
+static volatile int stop_writer = 0;
+
+static void* big_writer(void *param)
+{
+    struct writer_args *args = (struct writer_args*) param;
+    char key[100];
+    int i = 0;
+    while (!stop_writer) {
+        sprintf(key, "/big/%d", i++ % 100);
+        memcpy(args->value, key, strlen(key));
+        bc_set(args->bc, key, args->value, args->vsz, 0, 0);
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// latency of small SETs while another writer is setting big values into
+// the same bitcask, which should not wait for compressing the big ones
+static void bench_set_latency(int big)
+{
+    int i, n = 2000;
+    double *lat = malloc(sizeof(double) * n), sum = 0;
+    char key[100], value[4096];
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+    Bitcask *bc = bc_open(BENCH_PATH, 0, 0, 0);
+    struct writer_args args = {bc, 0, big, 0, malloc(big), NULL};
+    fill_value(args.value, big, 7);
+    fill_value(value, sizeof(value), 8);
+    pthread_t tid;
+    stop_writer = 0;
+    pthread_create(&tid, NULL, big_writer, &args);
+    usleep(100000);
+    for (i=0; i<n; i++) {
+        sprintf(key, "/small/%d", i);
+        memcpy(value, key, strlen(key));
+        double st = now();
+        bc_set(bc, key, value, sizeof(value), 0, 0);
+        lat[i] = now() - st;
+        sum += lat[i];
+        usleep(1000);
+    }
+    stop_writer = 1;
+    pthread_join(tid, NULL);
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("set 4096 bytes with a writer of %d bytes: avg %.2f ms, p99 %.2f ms, max %.2f ms\n",
+            big, sum * 1e3 / n, lat[n * 99 / 100] * 1e3, lat[n - 1] * 1e3);
+    free(args.value);
+    free(lat);
+    bc_close(bc);
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+}
+
+// latency of SETs under sustained load of writers, a writer who fills up
+// the write buffer should not block others while flushing it
+static void bench_set_load(int vsz, int nthreads)
+{
+    pthread_t tids[MAX_THREADS];
+    struct writer_args args[MAX_THREADS];
+    int i, ops = ((int64_t)total_mb << 20) / vsz / nthreads, n = ops * nthreads;
+    double *lat = malloc(sizeof(double) * n), sum = 0;
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+    Bitcask *bc = bc_open(BENCH_PATH, 0, 0, 0);
+    for (i=0; i<nthreads; i++) {
+        args[i].bc = bc;
+        args[i].id = i;
+        args[i].vsz = vsz;
+        args[i].ops = ops;
+        args[i].value = malloc(vsz);
+        args[i].lat = lat + i * ops;
+        fill_value(args[i].value, vsz, i + 1);
+        pthread_create(&tids[i], NULL, writer, &args[i]);
+    }
+    for (i=0; i<nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        free(args[i].value);
+    }
+    for (i=0; i<n; i++) {
+        sum += lat[i];
+    }
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("set %d bytes by %d writers: avg %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.2f ms\n",
+            vsz, nthreads, sum * 1e3 / n, lat[n * 99 / 100] * 1e3, lat[n * 999 / 1000] * 1e3,
+            lat[n - 1] * 1e3);
+    free(lat);
+    bc_close(bc);
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+}
+
+// data file of version 1, records are aligned to PADDING
+static int write_old_file(const char *path, int n, int vsz)
+{
+    char key[100], value[4096];
+    char *buf = malloc(PADDING * ((vsz + 200) / PADDING + 2));
+    DataRecord *r = malloc(sizeof(DataRecord) + sizeof(key));
+    FILE *f = fopen(path, "wb");
+    int i;
+    if (f == NULL) return -1;
+    fill_value(value, vsz, 9);
+    for (i=0; i<n; i++) {
+        r->ksz = sprintf(key, "/small/%d", i);
+        memcpy(r->key, key, r->ksz);
+        memcpy(value, key, r->ksz);
+        r->vsz = vsz;
+        r->value = value;
+        r->free_value = false;
+        r->flag = 0;
+        r->version = 1;
+        r->tstamp = time(NULL);
+        compress_record(r);
+        int len = record_length2(r, PADDING);
+        memset(buf, 0, len);
+        encode_record2(r, buf, value_crc(r));
+        fwrite(buf, 1, len, f);
+        if (r->free_value) free(r->value);
+    }
+    fclose(f);
+    free(r);
+    free(buf);
+    return 0;
+}
+
+// pages of file in page cache
+static uint64_t cached_bytes(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) return 0;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (st.st_size + page - 1) / page, i;
+    unsigned char *vec = malloc(pages);
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    uint64_t cached = 0;
+    if (addr != MAP_FAILED && mincore(addr, st.st_size, vec) == 0) {
+        for (i=0; i<pages; i++) {
+            cached += (vec[i] & 1) * page;
+        }
+    }
+    if (addr != MAP_FAILED) munmap(addr, st.st_size);
+    free(vec);
+    close(fd);
+    return cached;
+}
+
+static void drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// disk usage of small values, and page cache used by reading the latest
+// 10% of them (the hot ones), with records aligned to 256 bytes
+// (version 1) and to 16 bytes
+static void bench_small_values(int vsz)
+{
+    int i, v, n = total_mb << 12, hot = n / 10;
+    char key[100], value[4096], path[255];
+    sprintf(path, "%s/000.data", BENCH_PATH);
+    fill_value(value, vsz, 9);
+    for (v=1; v<=DATA_VERSION; v++) {
+        if (system("rm -rf " BENCH_PATH) != 0) return;
+        Bitcask *bc;
+        if (v == 1) {
+            mkdir(BENCH_PATH, 0750);
+            if (write_old_file(path, n, vsz) != 0) return;
+        } else {
+            bc = bc_open(BENCH_PATH, 0, 0, 0);
+            for (i=0; i<n; i++) {
+                sprintf(key, "/small/%d", i);
+                memcpy(value, key, strlen(key));
+                bc_set(bc, key, value, vsz, 0, 0);
+            }
+            bc_close(bc);
+        }
+        struct stat st;
+        stat(path, &st);
+
+        bc = bc_open(BENCH_PATH, 0, 0, 0);
+        drop_cache(path);
+        double st_time = now();
+        for (i=n-hot; i<n; i++) {
+            sprintf(key, "/small/%d", i);
+            free_record(bc_get(bc, key));
+        }
+        double used = now() - st_time;
+        printf("set %d bytes in version %d: %6.1f bytes/record on disk,"
+                " hot 10%%: %6.1f MB in page cache, %5.2f us/get\n",
+                vsz, v, (double)st.st_size / n,
+                cached_bytes(path) / 1048576.0, used * 1e6 / hot);
+        bc_close(bc);
+    }
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+}
+
+// bytes read from disk by the process
+static uint64_t read_bytes(void)
+{
+    char line[100];
+    uint64_t n = 0;
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "read_bytes: ", 12) == 0) n = strtoull(line + 12, NULL, 10);
+    }
+    fclose(f);
+    return n;
+}
+
+// SETs of unchanged values not in page cache, the old values are read
+// to compare unless their digests are kept
+static void bench_same_values(int vsz)
+{
+    int i, n = (total_mb << 20) / vsz, keys;
+    char key[100], path[255], *value = malloc(vsz);
+    sprintf(path, "%s/000.data", BENCH_PATH);
+    fill_value(value, vsz, 5);
+    for (keys=0; keys<=n; keys+=n) {
+        if (system("rm -rf " BENCH_PATH) != 0) return;
+        Bitcask *bc = bc_open(BENCH_PATH, 0, 0, 0);
+        bc_set_digests(bc, keys);
+        for (i=0; i<n; i++) {
+            sprintf(key, "/same/%d", i);
+            strncpy(value, key, 16); // same value of key
+            bc_set(bc, key, value, vsz, 0, 0);
+        }
+        bc_flush(bc, 0, 0);
+        drop_cache(path);
+        uint64_t rb = read_bytes();
+        double st = now();
+        for (i=0; i<n; i++) {
+            // in random order, 1000003 is a prime
+            sprintf(key, "/same/%d", (int)(i * 1000003LL % n));
+            strncpy(value, key, 16); // same value of key
+            bc_set(bc, key, value, vsz, 0, 0);
+        }
+        double used = now() - st;
+        printf("set %d bytes unchanged, %s digests: %8.0f set/s, %6.1f MB read\n",
+                vsz, keys ? "with" : "without", n / used, (read_bytes() - rb) / 1048576.0);
+        bc_close(bc);
+    }
+    free(value);
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+}
+
+struct reader_args {
+    Bitcask *bc;
+    int n;
+    int ops;
+    unsigned int seed;
+};
+
+static void* reader(void *param)
+{
+    struct reader_args *args = (struct reader_args*) param;
+    char key[100];
+    int i;
+    for (i=0; i<args->ops; i++) {
+        sprintf(key, "/get/%d", rand_r(&args->seed) % args->n);
+        free_record(bc_get(args->bc, key));
+    }
+    return NULL;
+}
+
+// GET throughput of values in page cache against number of readers
+static void bench_get(int vsz)
+{
+    int i, nthreads, n = (total_mb << 20) / vsz, ops = n * 4;
+    char key[100], *value = malloc(vsz);
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+    Bitcask *bc = bc_open(BENCH_PATH, 0, 0, 0);
+    fill_value(value, vsz, 3);
+    for (i=0; i<n; i++) {
+        sprintf(key, "/get/%d", i);
+        memcpy(value, key, strlen(key));
+        bc_set(bc, key, value, vsz, 0, 0);
+    }
+    bc_close(bc);
+    // all of them are in data file
+    bc = bc_open(BENCH_PATH, 0, 0, 0);
+    printf("get %d bytes:\n", vsz);
+    for (nthreads=1; nthreads<=MAX_THREADS; nthreads*=2) {
+        pthread_t tids[MAX_THREADS];
+        struct reader_args args[MAX_THREADS];
+        double st = now();
+        for (i=0; i<nthreads; i++) {
+            args[i].bc = bc;
+            args[i].n = n;
+            args[i].ops = ops / nthreads;
+            args[i].seed = i + 1;
+            pthread_create(&tids[i], NULL, reader, &args[i]);
+        }
+        for (i=0; i<nthreads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        double used = now() - st;
+        printf("  %2d threads: %8.0f get/s\n", nthreads, ops / nthreads * nthreads / used);
+    }
+    bc_close(bc);
+    free(value);
+    if (system("rm -rf " BENCH_PATH) != 0) return;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) total_mb = atoi(argv[1]);
+    bench_set_scaling(4 << 10);
+    bench_set_scaling(32 << 10);
+    bench_set_scaling(256 << 10);
+    bench_set_load(4 << 10, 4);
+    bench_set_load(4 << 10, 16);
+    bench_set_latency(1 << 20);
+    bench_set_latency(8 << 20);
+    bench_small_values(20);
+    bench_small_values(100);
+    bench_small_values(400);
+    bench_same_values(100);
+    bench_same_values(4 << 10);
+    bench_get(100);
+    bench_get(4 << 10);
+    return 0;
+}
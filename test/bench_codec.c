@@ -0,0 +1,235 @@
+/*
+ * micro benchmarks for key codec
+ *
+ *   make bc && ./bc [keys | file of keys, one per line]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+#include "htree.h"
+#include "../src/codec.c"
+
+#define KEY_SIZE 128
+#define SAMPLE_KEYS 16384
+
+static int nkeys = 1000000;
+static char *keys;
+static int *klen;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// the decoder before Tmpl, as reference
+static int decode_sprintf(Codec *dc, char *buf, const char *src, int len)
+{
+    if (src[0] < 0 && len >= 5) {
+        int idx = -*src;
+        int32_t *args = (int32_t*)(src + 1);
+        if (idx >= 64) {
+            idx -= 64;
+            idx += (*(unsigned char*)(src+1)) << 6;
+            args = (int32_t*)(src + 2);
+        }
+        Fmt *f = dc->dict[idx];
+        switch (f->nargs) {
+            case 1: return sprintf(buf, f->fmt, args[0]);
+            case 2: return sprintf(buf, f->fmt, args[0], args[1]);
+            case 3: return sprintf(buf, f->fmt, args[0], args[1], args[2]);
+        }
+        return 0;
+    }
+    memcpy(buf, src, len);
+    buf[len] = 0;
+    return len;
+}
+
+static int make_key(char *buf, int i)
+{
+    uint32_t r = i * 2654435761u;
+    switch (i % 8) {
+        case 0: return sprintf(buf, "/photo/photo/%d.jpg", i);
+        case 1: return sprintf(buf, "/user/%d/avatar_%d.png", i % 1000 + 100, i);
+        case 2: return sprintf(buf, "/cache/%x/%08x", i % 251 + 0x1000, r);
+        case 3: return sprintf(buf, "/feed/%d/item-%d-%x", i % 3000 + 1000, i % 7, i + 0x10000);
+        case 4: return sprintf(buf, "dae:app:movie-web:session:%08x", r);
+        case 5: return sprintf(buf, "/view/photo/photo/public/p%d.jpg", i);
+        case 6: return sprintf(buf, "/music/song/%d/lyric-%s", i, r % 3 ? "zh" : "en");
+        default: return sprintf(buf, "subject:%d:comments:%d", i % 5000 + 1000000, i);
+    }
+}
+
+static int load_keys(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    int n = 0, size = 1024;
+    if (f == NULL) return 0;
+    keys = (char*) malloc((size_t)size * KEY_SIZE);
+    klen = (int*) malloc(sizeof(int) * size);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int l = strcspn(line, "\r\n");
+        if (l == 0 || l >= KEY_SIZE) continue;
+        if (n == size) {
+            size *= 2;
+            keys = (char*) realloc(keys, (size_t)size * KEY_SIZE);
+            klen = (int*) realloc(klen, sizeof(int) * size);
+        }
+        memcpy(keys + (size_t)n * KEY_SIZE, line, l);
+        keys[(size_t)n * KEY_SIZE + l] = 0;
+        klen[n ++] = l;
+    }
+    fclose(f);
+    return n;
+}
+
+// bytes per key in codec and in HTree, without and with prefix dictionary
+// learned from a sample of the keys
+static void bench_memory(void)
+{
+    const char **sample = (const char**) malloc(sizeof(char*) * SAMPLE_KEYS);
+    int *slen = (int*) malloc(sizeof(int) * SAMPLE_KEYS);
+    int step = nkeys / SAMPLE_KEYS + 1, n = 0, i, prefix;
+    for (i=0; i<nkeys && n < SAMPLE_KEYS; i+=step) {
+        sample[n] = keys + (size_t)i * KEY_SIZE;
+        slen[n ++] = klen[i];
+    }
+
+    uint64_t raw = 0;
+    for (i=0; i<nkeys; i++) {
+        raw += klen[i];
+    }
+    printf("raw keys:        %6.1f bytes/key\n", (double)raw / nkeys);
+    for (prefix=0; prefix<2; prefix++) {
+        char code[KEY_SIZE * 2], buf[KEY_SIZE * 2];
+        uint64_t encoded = 0;
+        int bad = 0, np = 0;
+        Codec *dc = dc_new();
+        double st = now();
+        if (prefix) np = dc_train(dc, sample, slen, n);
+        double t_train = now() - st;
+        for (i=0; i<nkeys; i++) {
+            const char *key = keys + (size_t)i * KEY_SIZE;
+            int l = dc_encode(dc, code, key, klen[i]);
+            encoded += l;
+            if (dc_decode(dc, buf, code, l) != klen[i] || memcmp(buf, key, klen[i]) != 0) {
+                if (bad ++ < 10) printf("mismatch: %s %s\n", key, buf);
+            }
+        }
+
+        HTree *t = ht_new(0, 0);
+        if (prefix) ht_train(t, sample, slen, n);
+        for (i=0; i<nkeys; i++) {
+            ht_add2(t, keys + (size_t)i * KEY_SIZE, klen[i], i << 8, i & 0xffff, 1, 0);
+        }
+        uint64_t allocated = 0, used = 0;
+        ht_stat(t, &allocated, &used);
+        printf("%s %6.1f bytes/key encoded, HTree %.1f bytes/key allocated, %.1f used,"
+                " %d fmts, %d prefixes (%.0f ms)%s\n",
+                prefix ? "fmt + prefix:   " : "fmt:            ", (double)encoded / nkeys,
+                (double)allocated / nkeys, (double)used / nkeys,
+                dc->dict_used - 1, np, t_train * 1e3, bad ? " (MISMATCH)" : "");
+        ht_destroy(t);
+        dc_destroy(dc);
+    }
+    free(sample);
+    free(slen);
+}
+
+int main(int argc, char **argv)
+{
+    int i, bad = 0;
+    if (argc > 1 && atoi(argv[1]) == 0) {
+        nkeys = load_keys(argv[1]);
+        if (nkeys == 0) {
+            printf("no keys in %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        if (argc > 1) nkeys = atoi(argv[1]);
+        keys = (char*) malloc((size_t)nkeys * KEY_SIZE);
+        klen = (int*) malloc(sizeof(int) * nkeys);
+        for (i=0; i<nkeys; i++) {
+            klen[i] = make_key(keys + (size_t)i * KEY_SIZE, i);
+        }
+    }
+
+    bench_memory();
+
+    Codec *dc = dc_new();
+    char *codes = (char*) malloc((size_t)nkeys * KEY_SIZE);
+    int *clen = (int*) malloc(sizeof(int) * nkeys);
+    char buf[KEY_SIZE], ref[KEY_SIZE];
+
+    double st = now();
+    for (i=0; i<nkeys; i++) {
+        clen[i] = dc_encode(dc, codes + (size_t)i * KEY_SIZE, keys + (size_t)i * KEY_SIZE, klen[i]);
+    }
+    double t_enc = now() - st;
+
+    st = now();
+    for (i=0; i<nkeys; i++) {
+        dc_decode(dc, buf, codes + (size_t)i * KEY_SIZE, clen[i]);
+    }
+    double t_dec = now() - st;
+
+    st = now();
+    for (i=0; i<nkeys; i++) {
+        decode_sprintf(dc, buf, codes + (size_t)i * KEY_SIZE, clen[i]);
+    }
+    double t_ref = now() - st;
+
+    for (i=0; i<nkeys; i++) {
+        const char *c = codes + (size_t)i * KEY_SIZE;
+        int n = dc_decode(dc, buf, c, clen[i]);
+        int m = decode_sprintf(dc, ref, c, clen[i]);
+        if (n != m || memcmp(buf, ref, n + 1) != 0
+                || n != klen[i] || memcmp(buf, keys + (size_t)i * KEY_SIZE, n) != 0) {
+            if (bad ++ < 10) printf("mismatch: %s %s\n", buf, ref);
+        }
+    }
+
+    // all the values of the integer slots
+    int32_t vals[] = {0, 1, 9, 10, 99, 100, 12345, 99999999, 100000000,
+        999999999, 2147483647, -1, -10, -2147483647 - 1};
+    if (dc->dict_used == dc->dict_size) dc_enlarge(dc);
+    Fmt *f = (Fmt*) malloc(sizeof(Fmt) + 32);
+    f->nargs = 2;
+    strcpy(f->fmt, "a%db%x");
+    Tmpl *t = tmpl_compile(f);
+    dc->tmpl[dc->dict_used] = t;
+    dc->dict[dc->dict_used ++] = f;
+    for (i=0; i<sizeof(vals)/sizeof(vals[0]); i++) {
+        char code[10];
+        int idx = dc->dict_used - 1;
+        code[0] = - (idx & 0x3f) - 64;
+        code[1] = idx >> 6;
+        memcpy(code + 2, &vals[i], 4);
+        memcpy(code + 6, &vals[i], 4);
+        int n = dc_decode(dc, buf, code, 10);
+        int m = decode_sprintf(dc, ref, code, 10);
+        if (n != m || memcmp(buf, ref, n + 1) != 0) {
+            if (bad ++ < 10) printf("mismatch: %s %s\n", buf, ref);
+        }
+    }
+
+    printf("%d keys, %d fmts\n", nkeys, dc->dict_used - 1);
+    printf("encode:          %6.0f ns/key\n", t_enc * 1e9 / nkeys);
+    printf("decode:          %6.0f ns/key\n", t_dec * 1e9 / nkeys);
+    printf("decode(sprintf): %6.0f ns/key\n", t_ref * 1e9 / nkeys);
+    printf("%d mismatch\n", bad);
+
+    dc_destroy(dc);
+    free(keys);
+    free(codes);
+    free(klen);
+    free(clen);
+    return bad != 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * micro benchmarks for compressors of values
+ *
+ *   make bcz [COMPRESS="-DHAVE_LZ4 -llz4 -DHAVE_ZSTD -lzstd"]
+ *   ./bcz [files, one value per file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "record.h"
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#endif
+
+#define MAX_VALUES 4096
+
+extern const int PADDING;
+
+typedef struct {
+    const char *name;
+    int n;
+    char *values[MAX_VALUES];
+    int sizes[MAX_VALUES];
+} Corpus;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static const char *words[] = {"the", "of", "and", "a", "to", "in", "is", "you",
+    "that", "it", "he", "was", "for", "on", "are", "as", "with", "his", "they",
+    "movie", "music", "book", "photo", "douban", "review", "story", "good",
+    "really", "like", "love", "time", "people", "first", "very", "beautiful",
+    "一个", "我们", "电影", "音乐", "喜欢", "时候", "没有", "因为", "所以"};
+
+// articles, reviews and comments
+static void gen_text(Corpus *c, int n)
+{
+    unsigned int seed = 1;
+    int i, nw = sizeof(words) / sizeof(words[0]);
+    c->name = "text";
+    for (i=0; i<n; i++) {
+        int size = 1000 + rand_r(&seed) % 20000, len = 0;
+        char *v = malloc(size + 64);
+        len += sprintf(v, "{\"id\": %d, \"title\": \"", 1000000 + i);
+        while (len < size) {
+            // zipf alike
+            int w = rand_r(&seed) % nw;
+            w = w * (rand_r(&seed) % nw) / nw;
+            len += sprintf(v + len, "%s%s", words[w], rand_r(&seed) % 12 ? " " : ". ");
+        }
+        len += sprintf(v + len, "\"}");
+        c->values[i] = v;
+        c->sizes[i] = len;
+    }
+    c->n = n;
+}
+
+// EXIF and sizes of images, with a random digest
+static void gen_meta(Corpus *c, int n)
+{
+    static const char *makes[] = {"Canon", "NIKON CORPORATION", "Apple", "SONY", "FUJIFILM"};
+    static const char *models[] = {"Canon EOS 5D Mark III", "NIKON D800", "iPhone 4S",
+        "NEX-5N", "X100S"};
+    unsigned int seed = 2;
+    int i, j;
+    c->name = "image-meta";
+    for (i=0; i<n; i++) {
+        char *v = malloc(2048);
+        int m = rand_r(&seed) % 5, len;
+        len = sprintf(v, "Make=%s\nModel=%s\nOrientation=%d\nXResolution=72/1\n"
+                "YResolution=72/1\nResolutionUnit=2\nSoftware=Ver.%d.%d\n"
+                "DateTime=2012:%02d:%02d %02d:%02d:%02d\nExposureTime=1/%d\n"
+                "FNumber=%d/10\nISOSpeedRatings=%d\nFocalLength=%d/1\nFlash=%d\n"
+                "PixelXDimension=%d\nPixelYDimension=%d\nColorSpace=1\n"
+                "GPSLatitude=%d/1,%d/1,%d/100\nGPSLongitude=%d/1,%d/1,%d/100\n"
+                "sizes=large:%dx%d,median:%dx%d,small:%dx%d,thumb:%dx%d\ndigest=",
+                makes[m], models[m], 1 + rand_r(&seed) % 8, rand_r(&seed) % 3,
+                rand_r(&seed) % 10, 1 + rand_r(&seed) % 12, 1 + rand_r(&seed) % 28,
+                rand_r(&seed) % 24, rand_r(&seed) % 60, rand_r(&seed) % 60,
+                1 << (rand_r(&seed) % 12), 14 + rand_r(&seed) % 200, 100 << (rand_r(&seed) % 6),
+                10 + rand_r(&seed) % 200, rand_r(&seed) % 2, 4000 + rand_r(&seed) % 1000,
+                3000 + rand_r(&seed) % 1000, rand_r(&seed) % 90, rand_r(&seed) % 60,
+                rand_r(&seed) % 6000, rand_r(&seed) % 180, rand_r(&seed) % 60,
+                rand_r(&seed) % 6000, 2000 + rand_r(&seed) % 500, 1500 + rand_r(&seed) % 500,
+                600 + rand_r(&seed) % 100, 400 + rand_r(&seed) % 100,
+                100 + rand_r(&seed) % 50, 80 + rand_r(&seed) % 50, 75, 75);
+        for (j=0; j<32; j++) {
+            len += sprintf(v + len, "%02x", rand_r(&seed) & 0xff);
+        }
+        c->values[i] = v;
+        c->sizes[i] = len;
+    }
+    c->n = n;
+}
+
+static void load_files(Corpus *c, int argc, char **argv)
+{
+    int i;
+    c->name = "files";
+    c->n = 0;
+    for (i=1; i<argc && c->n < MAX_VALUES; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (f == NULL) continue;
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        char *v = malloc(size + 1);
+        if (fread(v, 1, size, f) == size) {
+            c->values[c->n] = v;
+            c->sizes[c->n ++] = size;
+        } else {
+            free(v);
+        }
+        fclose(f);
+    }
+}
+
+// ratio and speed of compress_record() / decompress_record() as bc_set()
+// and bc_get() do, values which can not be compressed are kept as is
+static int bench(Corpus *c, const char *compressor)
+{
+    int i, compressed = 0, bad = 0;
+    uint64_t raw = 0, stored = 0;
+    double t_comp = 0, t_decomp = 0;
+    DataRecord *r = (DataRecord*) malloc(sizeof(DataRecord) + 32);
+    strcpy(r->key, "/test/key");
+    r->ksz = strlen(r->key);
+    for (i=0; i<c->n; i++) {
+        r->value = c->values[i];
+        r->vsz = c->sizes[i];
+        r->free_value = false;
+        r->flag = 0;
+        double st = now();
+        compress_record(r);
+        t_comp += now() - st;
+        raw += c->sizes[i];
+        stored += r->vsz;
+        if (r->flag != 0) compressed ++;
+
+        DataRecord *r2 = (DataRecord*) malloc(sizeof(DataRecord) + 32);
+        memcpy(r2, r, sizeof(DataRecord) + 32);
+        r2->free_value = false;
+        st = now();
+        r2 = decompress_record(r2);
+        t_decomp += now() - st;
+        if (r2 == NULL || r2->vsz != c->sizes[i] || memcmp(r2->value, c->values[i], r2->vsz) != 0) {
+            bad ++;
+        }
+        if (r->free_value) free(r->value);
+        free_record(r2);
+    }
+    free(r);
+    printf("%-10s %-9s %5.1f%% (%d/%d compressed), compress %7.1f MB/s, decompress %7.1f MB/s%s\n",
+            c->name, compressor, stored * 100.0 / raw, compressed, c->n,
+            raw / t_comp / 1e6, raw / t_decomp / 1e6, bad ? " (MISMATCH)" : "");
+    return bad;
+}
+
+#ifdef HAVE_ZSTD
+// train a dictionary from every other value, as `zstd --train`
+static int train_dict(Corpus *c, const char *path)
+{
+    size_t total = 0, *sizes = malloc(sizeof(size_t) * c->n);
+    int i, n = 0;
+    for (i=0; i<c->n; i+=2) total += c->sizes[i];
+    char *samples = malloc(total), *p = samples;
+    for (i=0; i<c->n; i+=2) {
+        memcpy(p, c->values[i], c->sizes[i]);
+        p += c->sizes[i];
+        sizes[n ++] = c->sizes[i];
+    }
+    char dict[64 << 10];
+    size_t size = ZDICT_trainFromBuffer(dict, sizeof(dict), samples, sizes, n);
+    free(samples);
+    free(sizes);
+    if (ZDICT_isError(size)) return -1;
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) return -1;
+    fwrite(dict, 1, size, f);
+    fclose(f);
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    const char *names[] = {"qlz", "lz4", "zstd"};
+    static Corpus corpora[3];
+    int i, j, n = 0, bad = 0;
+    if (argc > 1) {
+        load_files(&corpora[n ++], argc, argv);
+    } else {
+        gen_text(&corpora[n ++], 1000);
+        gen_meta(&corpora[n ++], 4000);
+    }
+    for (i=0; i<n; i++) {
+        for (j=0; j<sizeof(names)/sizeof(names[0]); j++) {
+            if (set_compressor(names[j]) == 0) {
+                bad += bench(&corpora[i], names[j]);
+            }
+        }
+    }
+#ifdef HAVE_ZSTD
+    // a dictionary should be trained for each kind of values, the last
+    // one is used here
+    const char *path = "/tmp/bench_compress.dict";
+    if (train_dict(&corpora[n-1], path) == 0 && load_compress_dict(path) == 0) {
+        set_compressor("zstd");
+        bad += bench(&corpora[n-1], "zstd+dict");
+    }
+    unlink(path);
+#endif
+    printf("%d mismatch\n", bad);
+    return bad != 0;
+}
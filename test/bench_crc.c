@@ -0,0 +1,211 @@
+/*
+ * micro benchmarks for crc32 of records
+ *
+ *   make bcrc && ./bcrc [MB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "record.h"
+
+uint32_t crc32(uint32_t crc, unsigned char *buf, size_t len);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+static uint32_t table[256];
+static volatile uint32_t sink;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// the byte-at-a-time crc32 before slicing-by-8, as reference
+static uint32_t crc32_byte(uint32_t crc, unsigned char *buf, size_t len)
+{
+    unsigned char *end = buf + len;
+    crc = ~crc;
+    for (; buf < end; ++buf)
+        crc = table[(crc ^ *buf) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void init_table(void)
+{
+    int i, k;
+    for (i=0; i<256; i++) {
+        uint32_t c = i;
+        for (k=0; k<8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+}
+
+// any length and alignment, and crc of pieces as read_record() does
+static int check(unsigned char *buf)
+{
+    int bad = 0, i;
+    for (i=0; i<2000; i++) {
+        int off = i % 13, len = i < 1000 ? i : rand() % 100000;
+        int cut = len ? rand() % len : 0;
+        uint32_t r = crc32_byte(0, buf + off, len);
+        uint32_t c = crc32(0, buf + off, len);
+        uint32_t c2 = crc32(crc32(0, buf + off, cut), buf + off + cut, len - cut);
+        uint32_t c3 = crc32_combine(crc32(0, buf + off, cut), crc32(0, buf + off + cut, len - cut), len - cut);
+        if (r != c || r != c2 || r != c3) {
+            if (bad ++ < 10) printf("mismatch: len %d off %d %08x %08x %08x %08x\n", len, off, r, c, c2, c3);
+        }
+    }
+    return bad;
+}
+
+static void bench_throughput(unsigned char *buf, int size)
+{
+    int sizes[] = {256, 4096, 100 << 10, 1 << 20, 8 << 20};
+    int i, j;
+    for (i=0; i<sizeof(sizes)/sizeof(sizes[0]) && sizes[i] <= size; i++) {
+        int n = sizes[i], rounds = (256 << 20) / n;
+        uint32_t x = 0;
+        double st = now();
+        for (j=0; j<rounds; j++) x ^= crc32_byte(0, buf, n);
+        double t1 = now() - st;
+        st = now();
+        for (j=0; j<rounds; j++) x ^= crc32(0, buf, n);
+        double t2 = now() - st;
+        printf("crc32 %8d bytes: byte %5.2f GB/s, slice-by-8 %5.2f GB/s%s\n", n,
+                (double)n * rounds / t1 / 1e9, (double)n * rounds / t2 / 1e9,
+                x == 0 ? "" : " (MISMATCH)");
+    }
+}
+
+// fast_read_record() of a big value in page cache, the part of crc in it
+static void bench_get(unsigned char *buf, int vsz)
+{
+    const char *path = "/tmp/bench_crc.data";
+    DataRecord *r = (DataRecord*) malloc(sizeof(DataRecord) + 32);
+    int i, size, rounds = (1 << 30) / vsz + 1;
+    strcpy(r->key, "/photo/photo/1.jpg");
+    r->ksz = strlen(r->key);
+    r->vsz = vsz;
+    r->value = (char*) buf;
+    r->free_value = false;
+    r->tstamp = time(NULL);
+    r->flag = 0;
+    r->version = 1;
+    char *data = encode_record(r, &size);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data, size) != size) {
+        printf("write %s failed\n", path);
+        return;
+    }
+    free(data);
+    free(r);
+
+    double st = now();
+    for (i=0; i<rounds; i++) {
+        DataRecord *r2 = fast_read_record(fd, 0, false);
+        if (r2 == NULL) {
+            printf("read record failed\n");
+            break;
+        }
+        free_record(r2);
+    }
+    double t = now() - st;
+    // with the size class from the index, header and value in one read
+    uint32_t length = class_length(record_class(size));
+    st = now();
+    for (i=0; i<rounds; i++) {
+        DataRecord *r2 = fast_read_record2(fd, 0, 18, length, false);
+        if (r2 == NULL) {
+            printf("read record failed\n");
+            break;
+        }
+        free_record(r2);
+    }
+    double t2 = now() - st;
+    st = now();
+    for (i=0; i<rounds; i++) sink = crc32(0, buf, vsz);
+    double t_new = now() - st;
+    st = now();
+    for (i=0; i<rounds; i++) sink = crc32_byte(0, buf, vsz);
+    double t_old = now() - st;
+    printf("get %d bytes: %.0f us/get, crc %.0f%% of it, was %.0f us/get, crc %.0f%%,"
+            " %.0f us/get in one read\n",
+            vsz, t * 1e6 / rounds, t_new * 100 / t,
+            (t - t_new + t_old) * 1e6 / rounds, t_old * 100 / (t - t_new + t_old),
+            t2 * 1e6 / rounds);
+    close(fd);
+    unlink(path);
+}
+
+// encode a record for bc_set(): into a new buffer and copied into write
+// buffer, or into write buffer directly with crc of value computed before
+static void bench_encode(unsigned char *buf, int vsz)
+{
+    DataRecord *r = (DataRecord*) malloc(sizeof(DataRecord) + 32);
+    int i, size, rounds = (1 << 30) / vsz + 1;
+    strcpy(r->key, "/photo/photo/1.jpg");
+    r->ksz = strlen(r->key);
+    r->vsz = vsz;
+    r->value = (char*) buf;
+    r->free_value = false;
+    r->tstamp = time(NULL);
+    r->flag = 0x10; // client compressed
+    r->version = 1;
+    char *wbuf = malloc(record_length(r)), *wbuf2 = malloc(record_length(r));
+
+    double st = now();
+    for (i=0; i<rounds; i++) {
+        char *data = encode_record(r, &size);
+        memcpy(wbuf, data, size);
+        free(data);
+    }
+    double t1 = now() - st;
+    st = now();
+    for (i=0; i<rounds; i++) {
+        encode_record2(r, wbuf2, value_crc(r));
+    }
+    double t2 = now() - st;
+    uint32_t vcrc = value_crc(r);
+    st = now();
+    for (i=0; i<rounds; i++) {
+        encode_record2(r, wbuf2, vcrc);
+    }
+    double t3 = now() - st;
+    printf("encode %d bytes: copy %.0f us, in place %.0f us, %.0f us without crc of value%s\n", vsz,
+            t1 * 1e6 / rounds, t2 * 1e6 / rounds, t3 * 1e6 / rounds,
+            memcmp(wbuf, wbuf2, size) == 0 ? "" : " (MISMATCH)");
+    free(wbuf);
+    free(wbuf2);
+    free(r);
+}
+
+int main(int argc, char **argv)
+{
+    int size = 8 << 20, i;
+    if (argc > 1) size = atoi(argv[1]) << 20;
+    if (size < (1 << 20)) size = 1 << 20;
+    unsigned char *buf = (unsigned char*) malloc(size + 16);
+    for (i=0; i<size + 16; i++) {
+        buf[i] = rand();
+    }
+    init_table();
+
+    int bad = check(buf);
+    bench_throughput(buf, size);
+    bench_get(buf, 100 << 10);
+    bench_get(buf, size);
+    bench_encode(buf, 100 << 10);
+    bench_encode(buf, size);
+    printf("%d mismatch\n", bad);
+    free(buf);
+    return bad != 0;
+}
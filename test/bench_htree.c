@@ -0,0 +1,376 @@
+/*
+ * micro benchmarks for HTree
+ *
+ *   make bh && ./bh [keys]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "htree.h"
+#include "bitcask.h"
+
+// the format written by ht_save()
+extern const char VERSION[];
+
+#define MAX_THREADS 32
+
+static int nkeys = 1000000;
+static volatile int stop_writer = 0;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double rss_mb()
+{
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%*ld %ld", &pages) != 1) pages = 0;
+        fclose(f);
+    }
+    return pages * (double)sysconf(_SC_PAGESIZE) / 1048576.0;
+}
+
+static HTree* build_tree(int n)
+{
+    HTree *t = ht_new(0, 0);
+    char buf[100];
+    int i;
+    for (i=0; i<n; i++) {
+        sprintf(buf, "/photo/photo/%d.jpg", i);
+        ht_add(t, buf, i << 8, i & 0xffff, 1);
+    }
+    return t;
+}
+
+struct reader_args {
+    HTree *tree;
+    int seed;
+    int ops;
+};
+
+static void* reader(void *param)
+{
+    struct reader_args *args = (struct reader_args*) param;
+    char buf[100];
+    unsigned int seed = args->seed;
+    int i;
+    for (i=0; i<args->ops; i++) {
+        sprintf(buf, "/photo/photo/%d.jpg", rand_r(&seed) % nkeys);
+        Item *it = ht_get(args->tree, buf);
+        if (it) free(it);
+    }
+    return NULL;
+}
+
+static void* writer(void *param)
+{
+    HTree *tree = (HTree*) param;
+    char buf[100];
+    unsigned int seed = 7;
+    while (!stop_writer) {
+        int k = rand_r(&seed) % nkeys;
+        sprintf(buf, "/photo/photo/%d.jpg", k);
+        ht_add(tree, buf, k << 8, k & 0xffff, 2);
+    }
+    return NULL;
+}
+
+// GET throughput against number of reader threads, with or without
+// a concurrent writer (bc_set)
+static void bench_get_scaling(HTree *tree, bool with_writer)
+{
+    int ops = 200000, nthreads;
+    printf("get scaling (%s writer):\n", with_writer ? "with" : "no");
+    for (nthreads=1; nthreads<=MAX_THREADS; nthreads*=2) {
+        pthread_t tids[MAX_THREADS], wid;
+        struct reader_args args[MAX_THREADS];
+        int i;
+        stop_writer = 0;
+        if (with_writer) pthread_create(&wid, NULL, writer, tree);
+        double st = now();
+        for (i=0; i<nthreads; i++) {
+            args[i].tree = tree;
+            args[i].seed = i + 1;
+            args[i].ops = ops;
+            pthread_create(&tids[i], NULL, reader, &args[i]);
+        }
+        for (i=0; i<nthreads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        double used = now() - st;
+        stop_writer = 1;
+        if (with_writer) pthread_join(wid, NULL);
+        printf("  %2d threads: %8.0f get/s\n", nthreads, ops * nthreads / used);
+    }
+}
+
+// ht_get() returns a malloced copy, ht_lookup() fills a stack Item
+static void bench_lookup_alloc(HTree *tree)
+{
+    char buf[100];
+    int i, n = 1000000, found = 0;
+    double st = now();
+    for (i=0; i<n; i++) {
+        sprintf(buf, "/photo/photo/%d.jpg", i % nkeys);
+        Item *it = ht_get(tree, buf);
+        if (it) {
+            found ++;
+            free(it);
+        }
+    }
+    double t1 = now() - st;
+
+    st = now();
+    for (i=0; i<n; i++) {
+        Item it;
+        sprintf(buf, "/photo/photo/%d.jpg", i % nkeys);
+        if (ht_lookup(tree, buf, strlen(buf), &it)) found --;
+    }
+    double t2 = now() - st;
+    printf("ht_get:    %6.0f ns/get, 1 malloc/get\n", t1 * 1e9 / n);
+    printf("ht_lookup: %6.0f ns/get, 0 malloc/get%s\n", t2 * 1e9 / n,
+            found == 0 ? "" : " (MISMATCH)");
+}
+
+// lookups of existing and missing keys, most of the time is spent
+// in searching the items of a leaf
+static void bench_leaf_search(HTree *tree)
+{
+    char buf[100];
+    int i, n = 1000000, found = 0;
+    double st = now();
+    for (i=0; i<n; i++) {
+        Item it;
+        sprintf(buf, "/photo/photo/%d.jpg", i % nkeys);
+        found += ht_lookup(tree, buf, strlen(buf), &it);
+    }
+    double t1 = now() - st;
+
+    st = now();
+    for (i=0; i<n; i++) {
+        Item it;
+        sprintf(buf, "/photo/photo/%d.jpg", nkeys + i);
+        found -= ht_lookup(tree, buf, strlen(buf), &it);
+    }
+    double t2 = now() - st;
+    printf("leaf search: hit %6.0f ns/get, miss %6.0f ns/get%s\n",
+            t1 * 1e9 / n, t2 * 1e9 / n, found == n ? "" : " (MISMATCH)");
+}
+
+// listing of all the leaves, as `get @xxx` in sync
+static void bench_list(HTree *tree)
+{
+    char dir[10];
+    int i, n = 0;
+    double st = now();
+    for (i=0; i<4096; i++) {
+        sprintf(dir, "%03x", i);
+        char *r = ht_list(tree, dir, NULL);
+        if (r) {
+            n += strlen(r);
+            free(r);
+        }
+    }
+    printf("list 4096 dirs: %.3f s, %d bytes\n", now() - st, n);
+}
+
+// `get @` after a burst of writes, as a sync sweep does
+static void bench_sync_probe(HTree *tree)
+{
+    char buf[100];
+    unsigned int seed = 11;
+    int i, j, rounds = 20;
+    double total = 0, worst = 0;
+    for (i=0; i<rounds; i++) {
+        for (j=0; j<50000; j++) {
+            int k = rand_r(&seed) % nkeys;
+            sprintf(buf, "/photo/photo/%d.jpg", k);
+            ht_add(tree, buf, k << 8, k & 0xffff, (j & 3) ? 3 : -3);
+        }
+        double st = now();
+        ht_get_hash(tree, "@", NULL);
+        char *r = ht_list(tree, "", NULL);
+        double t = now() - st;
+        free(r);
+        total += t;
+        if (t > worst) worst = t;
+    }
+    printf("sync probe: avg %.0f us, max %.0f us, max lock hold %u us\n",
+            total * 1e6 / rounds, worst * 1e6, ht_max_lock_hold(tree));
+}
+
+// restart: open the snapshot, then look up all the keys
+static double open_and_touch(const char *path, uint32_t *hash, double *touch)
+{
+    char buf[100];
+    int i, count = 0;
+    double st = now();
+    HTree *t = ht_open(0, 0, path);
+    double used = now() - st;
+    if (t == NULL) {
+        printf("open %s failed\n", path);
+        return 0;
+    }
+    st = now();
+    for (i=0; i<nkeys; i++) {
+        Item it;
+        sprintf(buf, "/photo/photo/%d.jpg", i);
+        ht_lookup(t, buf, strlen(buf), &it);
+    }
+    *touch = now() - st;
+    *hash = ht_get_hash(t, "@", &count);
+    ht_destroy(t);
+    return used;
+}
+
+static void bench_open(HTree *tree)
+{
+    const char *p2 = "/tmp/bench_htree.v2", *p3 = "/tmp/bench_htree.v3";
+    uint32_t h2 = 0, h3 = 0, h = ht_get_hash(tree, "@", NULL);
+    double t2, t3, l2, l3;
+    ht_save_v2(tree, p2);
+    ht_save(tree, p3);
+    t2 = open_and_touch(p2, &h2, &l2);
+    t3 = open_and_touch(p3, &h3, &l3);
+    printf("open HTREE002: %.3f s, %.8s: %.3f s, lookup all after open: %.3f s, %.3f s%s\n",
+            t2, VERSION, t3, l2, l3, h2 == h && h3 == h ? "" : " (MISMATCH)");
+    unlink(p2);
+    unlink(p3);
+}
+
+static double max_add;
+
+static void* timed_writer(void *param)
+{
+    HTree *tree = (HTree*) param;
+    char buf[100];
+    unsigned int seed = 13;
+    while (!stop_writer) {
+        int k = rand_r(&seed) % nkeys;
+        sprintf(buf, "/photo/photo/%d.jpg", k);
+        double st = now();
+        ht_add(tree, buf, k << 8, k & 0xffff, 4);
+        double t = now() - st;
+        if (t > max_add) max_add = t;
+    }
+    return NULL;
+}
+
+// ht_save() with a concurrent writer, which should not wait for it
+static void bench_save(HTree *tree)
+{
+    const char *path = "/tmp/bench_htree.save";
+    pthread_t wid;
+    stop_writer = 0;
+    max_add = 0;
+    pthread_create(&wid, NULL, timed_writer, tree);
+    usleep(100000);
+    double st = now();
+    int r = ht_save(tree, path);
+    double used = now() - st;
+    usleep(100000);
+    stop_writer = 1;
+    pthread_join(wid, NULL);
+    printf("save with writer: %.3f s%s, max ht_add %.1f ms\n", used,
+            r == 0 ? "" : " (FAILED)", max_add * 1e3);
+    unlink(path);
+}
+
+// memory per key with uniform keys, and with 1/8 of the keys in a hot
+// directory (two hex digits), which needs a deeper subtree
+static void bench_memory(void)
+{
+    char buf[100];
+    int skewed;
+    for (skewed=0; skewed<2; skewed++) {
+        HTree *t = ht_new(0, 0);
+        int i, j = 0;
+        for (i=0; i<nkeys; i++) {
+            if (skewed && i % 8 == 0) {
+                do {
+                    sprintf(buf, "/hot/%d.jpg", j++);
+                } while (fnv1a(buf, strlen(buf)) >> 24 != 0xab);
+            } else {
+                sprintf(buf, "/photo/photo/%d.jpg", i);
+            }
+            ht_add(t, buf, i << 8, i & 0xffff, 1);
+        }
+        uint64_t allocated = 0, used = 0;
+        ht_stat(t, &allocated, &used);
+        printf("memory %s: %.1f bytes/key allocated, %.1f bytes/key used\n",
+                skewed ? "skewed " : "uniform", (double)allocated / nkeys,
+                (double)used / nkeys);
+        ht_destroy(t);
+    }
+}
+
+// bc_set() looks up the key before and under its lock, an unchanged
+// value is told from the index and the old record, a changed one is
+// appended
+static void bench_set(void)
+{
+    char dir[] = "/tmp/bench_htree.XXXXXX", key[100], value[1024], cmd[100];
+    int i, n = nkeys < 100000 ? nkeys : 100000, round;
+    if (mkdtemp(dir) == NULL) return;
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    memset(value, 'v', sizeof(value));
+    for (i=0; i<n; i++) {
+        sprintf(key, "/photo/photo/%d.jpg", i);
+        bc_set(bc, key, value, sizeof(value), 0, 0);
+    }
+    bc_flush(bc, 0, 0);
+    for (round=0; round<2; round++) {
+        double st = now();
+        for (i=0; i<n; i++) {
+            sprintf(key, "/photo/photo/%d.jpg", i);
+            if (round == 1) sprintf(value, "%d", i);
+            bc_set(bc, key, value, sizeof(value), 0, 0);
+        }
+        printf("set %s value: %6.0f ns/set\n", round == 0 ? "unchanged" : "changed  ",
+                (now() - st) * 1e9 / n);
+        bc_flush(bc, 0, 0);
+    }
+    bc_close(bc);
+    sprintf(cmd, "rm -rf %s", dir);
+    if (system(cmd) != 0) printf("rm %s failed\n", dir);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) nkeys = atoi(argv[1]);
+
+    double st = now();
+    HTree *tree = build_tree(nkeys);
+    printf("add %d keys: %.2f s\n", nkeys, now() - st);
+
+    uint64_t allocated = 0, used = 0;
+    ht_stat(tree, &allocated, &used);
+    printf("index: %.1f MB allocated, %.1f MB used, rss %.1f MB\n",
+            allocated / 1048576.0, used / 1048576.0, rss_mb());
+
+    bench_memory();
+    bench_lookup_alloc(tree);
+    bench_leaf_search(tree);
+    bench_list(tree);
+    bench_sync_probe(tree);
+    bench_open(tree);
+    bench_save(tree);
+    bench_set();
+
+    bench_get_scaling(tree, false);
+    bench_get_scaling(tree, true);
+
+    ht_destroy(tree);
+    return 0;
+}
@@ -26,9 +26,9 @@ func NewHTree(depth,pos int) *HashTree {
 func (t *HashTree) Add(key string, item *Item) {
     p := C.CString(key)
     defer C.free(unsafe.Pointer(p))
-    pos := (uint32(item.Bucket)) + uint32(item.Pos)
+    pos := uint64(item.Pos)<<4 | uint64(item.Bucket)
     C.ht_add(t.tree, p,
-        (_Ctypedef_uint32_t)(pos),
+        (_Ctypedef_uint64_t)(pos),
         (_Ctypedef_uint16_t)(item.Hash),
         (_Ctypedef_int32_t)(item.Version))
 }
@@ -59,8 +59,8 @@ func (t *HashTree) Get(key string) *Item {
     }
     defer C.free(unsafe.Pointer(citem))
 
-    return &Item{Bucket: int(uint32(citem.pos) & 0xff),
-        Pos:     uint32(citem.pos) & 0xffffff00,
+    return &Item{Bucket: int(citem.bucket),
+        Pos:     uint32(citem.pos) << 4,
         Hash:    uint32(citem.hash),
         Version: int32(citem.ver)}
 }
@@ -0,0 +1,746 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *  Values compressed by the compressor chosen for the key, and the other
+ *  bits of flag left to client. Records which can not be decompressed are
+ *  kept in the index. The hint of a bucket is built
+ *  from the main tree, with the items of that bucket only, and a restart
+ *  from the hints gets the latest values. Writers set values of all sizes
+ *  and read them back while the buffer is flushed, and the values of
+ *  every size class are read back.
+ *  The current bucket is moved by optimize before its records are flushed.
+ *  Big values are sent from the data file, the others are read into memory.
+ *  Records are aligned to 16 bytes in new data files, 256 in old ones.
+ *  The cached fds of data files are dropped once optimize moved records.
+ *  Unchanged values are told by their digests without reading them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bitcask.h"
+#include "record.h"
+#include "quicklz.h"
+
+#define N 1000
+#define M 6     // deleted and set in the first write buffer of 4K
+#define WRITERS 4
+#define ROUNDS 5
+#define BIG (64 << 10)
+
+static const int sizes[] = {0, 1, 100, 200, 220, 1000, 4000, 32 << 10, 33 << 10,
+    100 << 10, 1 << 20, (1 << 20) + 1, 8 << 20};
+#define COMPRESS_FLAG 0x00010000
+#define CLIENT_FLAG 0x00060000 // bits of clients next to COMPRESS_FLAG
+
+static char dir[] = "/tmp/test_bitcask.XXXXXX";
+
+static void clean(const char *keep)
+{
+    char cmd[1024];
+    if (keep != NULL) {
+        sprintf(cmd, "cd %s && ls | grep -v '^%s$' | xargs rm -f", dir, keep);
+    } else {
+        sprintf(cmd, "rm -f %s/*", dir);
+    }
+    assert(system(cmd) == 0);
+}
+
+static void clean_snapshots()
+{
+    char cmd[1024];
+    sprintf(cmd, "rm -f %s/*.htree", dir);
+    assert(system(cmd) == 0);
+}
+
+static void check_value(Bitcask *bc, const char *key, const char *value, int flag)
+{
+    DataRecord *r = bc_get(bc, key);
+    if (r == NULL || r->vsz != strlen(value) || memcmp(r->value, value, r->vsz) != 0
+        || r->flag != flag) {
+        fprintf(stderr, "bad value of %s\n", key);
+        exit(1);
+    }
+    free_record(r);
+}
+
+// a record of value as it is, with flag
+static int put_record(char *buf, const char *key, const char *value, int vsz, int flag)
+{
+    int ksz = strlen(key), size = 0;
+    DataRecord *r = (DataRecord*) malloc(sizeof(DataRecord) + ksz + 1);
+    r->value = (char*)value;
+    r->free_value = false;
+    r->tstamp = time(NULL);
+    r->flag = flag;
+    r->version = 1;
+    r->ksz = ksz;
+    r->vsz = vsz;
+    memcpy(r->key, key, ksz + 1);
+    char *p = encode_record(r, &size);
+    memcpy(buf, p, size);
+    free(p);
+    free(r);
+    return size;
+}
+
+static void test_compressor()
+{
+    char buf[4096];
+    const char *names[] = {"none", "qlz", "lz4", "zstd"};
+    const char *value = "0123456789abcdef0123456789abcdef";
+    int i;
+
+    assert(set_compressor("bogus") == -1);
+    assert(set_compressor("qlz,/z/=bogus") == -1);
+    for (i=0; i<4; i++) {
+        char spec[100];
+        sprintf(spec, "none,/%s/=%s", names[i], names[i]);
+        if (set_compressor(spec) != 0) {
+            printf("%s is not built in\n", names[i]);
+        }
+    }
+
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    memset(buf, 'x', sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    for (i=0; i<4; i++) {
+        char key[100];
+        sprintf(key, "/%s/1", names[i]);
+        assert(bc_set(bc, key, buf, sizeof(buf) - 1, 0, 0));
+        check_value(bc, key, buf, 0);
+    }
+    // the other bits of flag are left to client
+    assert(bc_set(bc, "/qlz/client", buf, sizeof(buf) - 1, CLIENT_FLAG, 0));
+    check_value(bc, "/qlz/client", buf, CLIENT_FLAG);
+    bc_close(bc);
+
+    // from data file
+    clean("000.data");
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=0; i<4; i++) {
+        char key[100];
+        sprintf(key, "/%s/1", names[i]);
+        check_value(bc, key, buf, 0);
+    }
+    check_value(bc, "/qlz/client", buf, CLIENT_FLAG);
+    bc_close(bc);
+    clean(NULL);
+
+    // QuickLZ data without the id of compressor as before, records which
+    // can not be decompressed are indexed by their header
+    char xs[4096], qlz[4096 + 400], scratch[QLZ_SCRATCH_COMPRESS], broken[32];
+    strcpy(xs, buf);
+    int qsz = qlz_compress(xs, qlz, strlen(xs), scratch);
+    bool unbuilt = set_compressor("lz4") != 0;
+    int n = put_data_header(buf), count = 4 + unbuilt;
+    n += put_record(buf + n, "/plain", value, 32, 0);
+    n += put_record(buf + n, "/qlz", qlz, qsz, COMPRESS_FLAG);
+    memcpy(broken, value, 32);
+    broken[0] = 'x';    // header of QuickLZ
+    n += put_record(buf + n, "/broken", broken, 32, COMPRESS_FLAG);
+    broken[0] = 9;
+    n += put_record(buf + n, "/unknown", broken, 32, COMPRESS_FLAG);
+    if (unbuilt) {
+        broken[0] = 2;
+        n += put_record(buf + n, "/unbuilt", broken, 32, COMPRESS_FLAG);
+    }
+    char path[1024];
+    sprintf(path, "%s/000.data", dir);
+    FILE *f = fopen(path, "wb");
+    assert(f != NULL && fwrite(buf, n, 1, f) == 1);
+    fclose(f);
+    for (i=0; i<2; i++) {
+        // from data file, then from the hint built by scanning it
+        bc = bc_open(dir, 0, 0, 0);
+        assert(bc != NULL);
+        assert(bc_count(bc, NULL) == count);
+        check_value(bc, "/plain", value, 0);
+        check_value(bc, "/qlz", xs, 0);
+        assert(bc_get(bc, "/broken") == NULL);
+        assert(bc_get(bc, "/unknown") == NULL);
+        assert(bc_get(bc, "/unbuilt") == NULL);
+        assert(bc_count(bc, NULL) == count);
+        bc_close(bc);
+        clean_snapshots();
+    }
+    clean(NULL);
+    assert(set_compressor("qlz") == 0);
+    printf("compressor ok\n");
+}
+
+// the value of a key of writer w in round r, big ones in some rounds
+static int make_value(char *buf, int w, int i, int r)
+{
+    int n = sprintf(buf, "value %d of %d in round %d ", i, w, r);
+    if (i % 10 == 0) {
+        // compressible
+        memset(buf + n, 'a' + r, BIG - n);
+        n = BIG;
+    } else if (i % 10 == 1) {
+        int j;
+        for (j=n; j<BIG; j++) buf[j] = rand_r((unsigned*)&w);
+        n = BIG;
+    }
+    return n;
+}
+
+typedef struct {
+    Bitcask *bc;
+    int w;
+} Writer;
+
+static void* writer(void *param)
+{
+    Writer *wr = (Writer*)param;
+    char key[100], *value = malloc(BIG);
+    int i, r;
+    for (r=0; r<ROUNDS; r++) {
+        for (i=0; i<N / 10; i++) {
+            sprintf(key, "/w%d/%d", wr->w, i);
+            int n = make_value(value, wr->w, i, r);
+            assert(bc_set(wr->bc, key, value, n, 0, 0));
+            // found in write buffer, flush buffer or data file
+            DataRecord *rec = bc_get(wr->bc, key);
+            assert(rec != NULL && rec->vsz == n && memcmp(rec->value, value, n) == 0
+                    && rec->version == r + 1);
+            free_record(rec);
+            // the same value from all writers
+            sprintf(key, "/shared/%d", i);
+            sprintf(value, "shared %d", i);
+            assert(bc_set(wr->bc, key, value, strlen(value), 0, 0));
+            rec = bc_get(wr->bc, key);
+            assert(rec != NULL && rec->version == 1);
+            free_record(rec);
+        }
+    }
+    free(value);
+    return NULL;
+}
+
+static volatile bool writing;
+
+static void* flusher(void *param)
+{
+    while (writing) {
+        bc_flush((Bitcask*)param, 0, 0);
+        sched_yield();
+    }
+    return NULL;
+}
+
+static void check_writers(Bitcask *bc)
+{
+    char key[100], *value = malloc(BIG);
+    int i, w;
+    for (w=0; w<WRITERS; w++) {
+        for (i=0; i<N / 10; i++) {
+            sprintf(key, "/w%d/%d", w, i);
+            int n = make_value(value, w, i, ROUNDS - 1);
+            DataRecord *r = bc_get(bc, key);
+            if (r == NULL || r->vsz != n || memcmp(r->value, value, n) != 0
+                || r->version != ROUNDS) {
+                fprintf(stderr, "bad value of %s\n", key);
+                exit(1);
+            }
+            free_record(r);
+        }
+    }
+    // unchanged values never bump the version
+    for (i=0; i<N / 10; i++) {
+        sprintf(key, "/shared/%d", i);
+        sprintf(value, "shared %d", i);
+        DataRecord *r = bc_get(bc, key);
+        assert(r != NULL && r->version == 1);
+        free_record(r);
+        check_value(bc, key, value, 0);
+    }
+    assert(bc_count(bc, NULL) == (N / 10) * (WRITERS + 1));
+    free(value);
+}
+
+static void test_concurrent_set()
+{
+    pthread_t th[WRITERS], fl;
+    Writer wr[WRITERS];
+    int i;
+
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    writing = true;
+    pthread_create(&fl, NULL, flusher, bc);
+    for (i=0; i<WRITERS; i++) {
+        wr[i].bc = bc;
+        wr[i].w = i;
+        pthread_create(&th[i], NULL, writer, &wr[i]);
+    }
+    for (i=0; i<WRITERS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    writing = false;
+    pthread_join(fl, NULL);
+    check_writers(bc);
+    bc_close(bc);
+
+    // from data file
+    clean_snapshots();
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    check_writers(bc);
+    bc_close(bc);
+    clean(NULL);
+    printf("concurrent set ok\n");
+}
+
+// values of all size classes, read in one step by the size class
+static void check_sizes(Bitcask *bc, char *value)
+{
+    char key[100];
+    int i;
+    for (i=0; i<sizeof(sizes) / sizeof(sizes[0]); i++) {
+        sprintf(key, "/size/%d", sizes[i]);
+        DataRecord *r = bc_get(bc, key);
+        if (r == NULL || r->vsz != sizes[i] || memcmp(r->value, value + i, sizes[i]) != 0) {
+            fprintf(stderr, "bad value of %s\n", key);
+            exit(1);
+        }
+        free_record(r);
+    }
+}
+
+static void test_size_class()
+{
+    char key[100], *value = malloc((8 << 20) + 100);
+    unsigned seed = 1;
+    int i;
+    for (i=0; i<(8 << 20) + 100; i++) {
+        value[i] = rand_r(&seed);
+    }
+
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=0; i<sizeof(sizes) / sizeof(sizes[0]); i++) {
+        sprintf(key, "/size/%d", sizes[i]);
+        assert(bc_set(bc, key, value + i, sizes[i], 0, 0));
+    }
+    check_sizes(bc, value);
+    bc_flush(bc, 0, 0);
+    check_sizes(bc, value);
+    bc_close(bc);
+
+    // from snapshot, hint and data file
+    for (i=0; i<3; i++) {
+        if (i == 1) clean_snapshots();
+        if (i == 2) clean("000.data");
+        bc = bc_open(dir, 0, 0, 0);
+        assert(bc != NULL);
+        check_sizes(bc, value);
+        bc_close(bc);
+    }
+    clean(NULL);
+    free(value);
+    printf("size class ok\n");
+}
+
+static void set_keys(const char *fmt, int n)
+{
+    char key[100];
+    int i;
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=0; i<n; i++) {
+        sprintf(key, fmt, i);
+        assert(bc_set(bc, key, key, strlen(key), 0, 0));
+    }
+    bc_close(bc);
+}
+
+// the keys of the first bucket are changed in the second one
+static void test_hint()
+{
+    char key[100], value[100];
+    int i, count = N;
+    set_keys("/a/%d", N);
+
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=0; i<N; i++) {
+        sprintf(key, "/a/%d", i);
+        if (i % 2 == 1) {
+            sprintf(value, "value of %d", i);
+            assert(bc_set(bc, key, value, strlen(value), 0, 0));
+        }
+        if (i % 3 == 0) {
+            assert(bc_delete(bc, key));
+            count --;
+        }
+        sprintf(key, "/b/%d", i);
+        assert(bc_set(bc, key, key, strlen(key), 0, 0));
+        count ++;
+    }
+    bc_close(bc);
+
+    // from hint only
+    clean_snapshots();
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    assert(bc_count(bc, NULL) == count);
+    for (i=0; i<N; i++) {
+        sprintf(key, "/a/%d", i);
+        sprintf(value, "value of %d", i);
+        if (i % 3 == 0) {
+            assert(bc_get(bc, key) == NULL);
+        } else {
+            check_value(bc, key, i % 2 == 1 ? value : key, 0);
+        }
+        sprintf(key, "/b/%d", i);
+        check_value(bc, key, key, 0);
+    }
+    bc_close(bc);
+    clean(NULL);
+    printf("hint ok\n");
+}
+
+// the keys in write buffer are moved into the new bucket, and the hint
+// of it has them after restart
+static void test_optimize()
+{
+    char key[100], value[100];
+    int i;
+    set_keys("/keep/%d", N);
+    set_keys("/old/%d", M);
+
+    // all records in 001.data are deleted, 002.data is not created yet
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=0; i<M; i++) {
+        sprintf(key, "/old/%d", i);
+        assert(bc_delete(bc, key));
+        sprintf(key, "/new/%d", i);
+        sprintf(value, "value of %d", i);
+        assert(bc_set(bc, key, value, strlen(value), 0, 0));
+    }
+    sprintf(key, "%s/002.data", dir);
+    assert(access(key, F_OK) != 0);
+    bc_optimize(bc, -3600);
+    bc_close(bc);
+
+    // from hint only
+    clean_snapshots();
+    assert(access(key, F_OK) != 0);
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=0; i<N; i++) {
+        sprintf(key, "/keep/%d", i);
+        check_value(bc, key, key, 0);
+    }
+    for (i=0; i<M; i++) {
+        sprintf(key, "/new/%d", i);
+        sprintf(value, "value of %d", i);
+        check_value(bc, key, value, 0);
+        sprintf(key, "/old/%d", i);
+        assert(bc_get(bc, key) == NULL);
+    }
+    bc_close(bc);
+    clean(NULL);
+    printf("optimize ok\n");
+}
+
+// the value sent from data file, or -1 when it's read into memory
+static int get_file(Bitcask *bc, const char *key, bool check_crc, const char *value, int vsz)
+{
+    off_t offset = 0;
+    char buf[BIG];
+    int fd = -1;
+    DataRecord *r = bc_get2(bc, key, 16 << 10, check_crc, &fd, &offset);
+    if (fd < 0) {
+        free_record(r);
+        return -1;
+    }
+    assert(r != NULL && r->vsz == vsz && r->flag == 0 && strcmp(r->key, key) == 0);
+    assert(pread(fd, buf, vsz, offset) == vsz && memcmp(buf, value, vsz) == 0);
+    free_record(r);
+    close(fd);
+    return 0;
+}
+
+static void test_sendfile()
+{
+    char path[1024], *value = malloc(BIG), *zip = malloc(BIG);
+    unsigned seed = 1;
+    int i;
+    for (i=0; i<BIG; i++) {
+        value[i] = rand_r(&seed);
+    }
+    memset(zip, 'z', BIG);
+
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    assert(bc_set(bc, "/file/big", value, BIG, 0, 0));
+    // in write buffer
+    assert(get_file(bc, "/file/big", true, value, BIG) == -1);
+    assert(bc_set(bc, "/file/small", value, 1000, 0, 0));
+    assert(bc_set(bc, "/file/zip", zip, BIG, 0, 0));
+    assert(bc_set(bc, "/file/deleted", value, BIG, 0, 0));
+    assert(bc_delete(bc, "/file/deleted"));
+    bc_flush(bc, 0, 0);
+
+    assert(get_file(bc, "/file/big", true, value, BIG) == 0);
+    assert(get_file(bc, "/file/small", true, value, 1000) == -1);
+    assert(get_file(bc, "/file/zip", true, zip, BIG) == -1);
+    assert(get_file(bc, "/file/deleted", true, value, BIG) == -1);
+    assert(get_file(bc, "/file/none", true, value, BIG) == -1);
+
+    // broken value is only found by checking crc, then the key is removed
+    off_t offset = 0;
+    int fd = -1;
+    free_record(bc_get2(bc, "/file/big", 1, false, &fd, &offset));
+    assert(fd >= 0);
+    close(fd);
+    sprintf(path, "%s/000.data", dir);
+    fd = open(path, O_WRONLY);
+    value[100] ^= 1;
+    assert(fd >= 0 && pwrite(fd, value + 100, 1, offset + 100) == 1);
+    close(fd);
+    assert(get_file(bc, "/file/big", false, value, BIG) == 0);
+    assert(get_file(bc, "/file/big", true, value, BIG) == -1);
+    assert(bc_get(bc, "/file/big") == NULL);
+    bc_close(bc);
+
+    clean(NULL);
+    free(value);
+    free(zip);
+    printf("sendfile ok\n");
+}
+
+static void check_cached(Bitcask *bc, char *value)
+{
+    char key[100];
+    int i;
+    for (i=0; i<N; i++) {
+        sprintf(key, "/a/%d", i);
+        if (i % 2 == 0) {
+            assert(bc_get(bc, key) == NULL);
+        } else {
+            check_value(bc, key, key, 0);
+        }
+        sprintf(key, "/b/%d", i);
+        check_value(bc, key, key, 0);
+    }
+    assert(get_file(bc, "/a/big", true, value, BIG) == 0);
+}
+
+// the fds of data files cached by bc_get() are not used after optimize
+// moved the records, the ones taken before can still read the old file
+static void test_cached_fd()
+{
+    char key[100], buf[BIG], *value = malloc(BIG);
+    unsigned seed = 2;
+    off_t offset = 0;
+    int i;
+    for (i=0; i<BIG; i++) {
+        value[i] = rand_r(&seed);
+    }
+    set_keys("/a/%d", N);
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    assert(bc_set(bc, "/a/big", value, BIG, 0, 0));
+    bc_close(bc);
+    set_keys("/b/%d", N);
+
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=0; i<N; i++) {
+        sprintf(key, "/a/%d", i);
+        check_value(bc, key, key, 0);
+        if (i % 2 == 0) {
+            assert(bc_delete(bc, key));
+        }
+        sprintf(key, "/b/%d", i);
+        check_value(bc, key, key, 0);
+    }
+    int fd = -1;
+    free_record(bc_get2(bc, "/a/big", 16 << 10, true, &fd, &offset));
+    assert(fd >= 0);
+    bc_flush(bc, 0, 0);
+
+    bc_optimize(bc, -3600);
+    check_cached(bc, value);
+    assert(pread(fd, buf, BIG, offset) == BIG && memcmp(buf, value, BIG) == 0);
+    close(fd);
+    bc_close(bc);
+
+    clean_snapshots();
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    check_cached(bc, value);
+    bc_close(bc);
+    clean(NULL);
+    free(value);
+    printf("cached fd ok\n");
+}
+
+// records of data file of version 1, without header, aligned to 256 bytes
+static int put_old_record(char *buf, const char *key, const char *value)
+{
+    int n = put_record(buf, key, value, strlen(value), 0);
+    int size = (n + 255) & ~255;
+    memset(buf + n, 0, size - n);
+    return size;
+}
+
+static void check_aligned()
+{
+    char key[100], value[100];
+    int i;
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=0; i<N; i++) {
+        sprintf(key, "/v%d/%d", 1 + i % 2, i);
+        sprintf(value, "value %d", i);
+        check_value(bc, key, value, 0);
+    }
+    bc_close(bc);
+}
+
+static void test_align()
+{
+    char path[1024], key[100], value[100], *buf = malloc(N * 256);
+    int i, n = 0;
+    for (i=0; i<N; i+=2) {
+        sprintf(key, "/v1/%d", i);
+        sprintf(value, "value %d", i);
+        n += put_old_record(buf + n, key, value);
+    }
+    sprintf(path, "%s/000.data", dir);
+    FILE *f = fopen(path, "wb");
+    assert(f != NULL && fwrite(buf, n, 1, f) == 1);
+    fclose(f);
+    free(buf);
+
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    for (i=1; i<N; i+=2) {
+        sprintf(key, "/v2/%d", i);
+        sprintf(value, "value %d", i);
+        assert(bc_set(bc, key, value, strlen(value), 0, 0));
+    }
+    bc_close(bc);
+
+    // small records take less than 64 bytes in new data file
+    struct stat st;
+    sprintf(path, "%s/001.data", dir);
+    assert(stat(path, &st) == 0);
+    assert(st.st_size < DATA_HEADER_SIZE + N / 2 * 64);
+    assert((st.st_size - DATA_HEADER_SIZE) % 16 == 0);
+
+    check_aligned();
+    // from data files
+    sprintf(path, "rm -f %s/*.hint* %s/*.htree", dir, dir);
+    assert(system(path) == 0);
+    check_aligned();
+    clean(NULL);
+    printf("align ok\n");
+}
+
+// the record of key in data file
+static off_t get_record(Bitcask *bc, const char *key, int *ver)
+{
+    off_t offset = 0;
+    int fd = -1;
+    DataRecord *r = bc_get2(bc, key, 1, false, &fd, &offset);
+    assert(fd >= 0);
+    close(fd);
+    *ver = r->version;
+    free_record(r);
+    return offset;
+}
+
+static off_t break_value(Bitcask *bc, const char *key)
+{
+    char path[1024];
+    int ver;
+    off_t offset = get_record(bc, key, &ver);
+    sprintf(path, "%s/000.data", dir);
+    int fd = open(path, O_WRONLY);
+    assert(fd >= 0 && pwrite(fd, "X", 1, offset) == 1);
+    close(fd);
+    return offset;
+}
+
+// an unchanged value is told by its digest without reading the old one,
+// which is broken here, so it's written again when the digest is missed
+static void test_digest()
+{
+    char key[100], value[100];
+    int i, ver;
+    Bitcask *bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    bc_set_digests(bc, 1024);
+    for (i=0; i<10; i++) {
+        sprintf(key, "/d/%d", i);
+        sprintf(value, "value %d", i);
+        assert(bc_set(bc, key, value, strlen(value), 0, 0));
+    }
+    bc_flush(bc, 0, 0);
+
+    // hit
+    off_t offset = break_value(bc, "/d/0");
+    assert(bc_set(bc, "/d/0", "value 0", 7, 0, 0));
+    assert(get_record(bc, "/d/0", &ver) == offset && ver == 1);
+    assert(bc_set(bc, "/d/0", "value 0", 7, 1, 0));
+    assert(bc_set(bc, "/d/0", "changed", 7, 0, 0));
+    check_value(bc, "/d/0", "changed", 0);
+    bc_flush(bc, 0, 0);
+    assert(get_record(bc, "/d/0", &ver) != offset && ver == 3);
+
+    // missed after the table is cleared, the old value is read
+    bc_set_digests(bc, 1024);
+    offset = get_record(bc, "/d/2", &ver);
+    assert(bc_set(bc, "/d/2", "value 2", 7, 0, 0));
+    assert(get_record(bc, "/d/2", &ver) == offset && ver == 1);
+    assert(break_value(bc, "/d/2") == offset);
+    assert(bc_set(bc, "/d/2", "value 2", 7, 0, 0));
+    assert(get_record(bc, "/d/2", &ver) == offset && ver == 1);
+    offset = break_value(bc, "/d/1");
+    assert(bc_set(bc, "/d/1", "value 1", 7, 0, 0));
+    check_value(bc, "/d/1", "value 1", 0);
+
+    // disabled
+    bc_set_digests(bc, 0);
+    offset = break_value(bc, "/d/3");
+    assert(bc_set(bc, "/d/3", "value 3", 7, 0, 0));
+    check_value(bc, "/d/3", "value 3", 0);
+    bc_close(bc);
+    clean(NULL);
+    printf("digest ok\n");
+}
+
+int main(int argc, char **argv)
+{
+    assert(mkdtemp(dir) != NULL);
+
+    test_compressor();
+    test_hint();
+    test_concurrent_set();
+    test_size_class();
+    test_optimize();
+    test_sendfile();
+    test_align();
+    test_cached_fd();
+    test_digest();
+
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *  Keys are encoded with the trained prefixes and decoded back, through a
+ *  dump of the codec and a snapshot of tree, and a snapshot refers to the
+ *  shared codec is only loaded with the very same codec.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "htree.h"
+#include "codec.h"
+
+#define N 3000
+
+static const char *patterns[] = {
+    "/photo/large/public/p%d.jpg",
+    "user:profile:%08x",
+    "/status/recent-%d",
+    "/unseen/key/%d",   // not in the samples
+};
+
+static int make_key(char *key, int i)
+{
+    return sprintf(key, i < N ? patterns[i % 3] : patterns[3], i * 7 + 100);
+}
+
+static void train(const char ***keys, int **lens)
+{
+    int i;
+    *keys = (const char**) malloc(sizeof(char*) * N);
+    *lens = (int*) malloc(sizeof(int) * N);
+    for (i=0; i<N; i++) {
+        char *key = malloc(100);
+        (*lens)[i] = make_key(key, i);
+        (*keys)[i] = key;
+    }
+}
+
+static void free_keys(const char **keys, int *lens)
+{
+    int i;
+    for (i=0; i<N; i++) free((char*)keys[i]);
+    free(keys);
+    free(lens);
+}
+
+// every key is decoded back by dc and dc2, from the same bytes
+static void check_codec(Codec *dc, Codec *dc2, int *encoded)
+{
+    char key[100], buf[256], out[256];
+    int i;
+    *encoded = 0;
+    for (i=0; i<N * 2; i++) {
+        int len = make_key(key, i);
+        int n = dc_encode(dc, buf, key, len);
+        assert(n > 0 && n <= len);
+        if (buf[0] == 0) (*encoded) ++;
+        if (dc_decode(dc, out, buf, n) != len || memcmp(out, key, len) != 0) {
+            fprintf(stderr, "decode %s failed\n", key);
+            exit(1);
+        }
+        if (dc2 != NULL && (dc_decode(dc2, out, buf, n) != len || memcmp(out, key, len) != 0)) {
+            fprintf(stderr, "decode %s by loaded codec failed\n", key);
+            exit(1);
+        }
+    }
+}
+
+static void test_prefix()
+{
+    const char **keys;
+    int *lens, encoded = 0;
+    train(&keys, &lens);
+
+    Codec *dc = dc_new();
+    int n = dc_train(dc, keys, lens, N);
+    assert(n > 0);
+    assert(dc_train(dc, keys, lens, N) == -1);
+    check_codec(dc, NULL, &encoded);
+    assert(encoded == N);
+
+    int size = dc_size(dc);
+    char *buf = malloc(size);
+    assert(dc_dump(dc, buf, size) == size);
+    Codec *dc2 = dc_new();
+    assert(dc_load(dc2, buf, size) == 0);
+    check_codec(dc, dc2, &encoded);
+    free(buf);
+
+    // index of prefix out of the dictionary
+    char bad[3] = {0, n + 1, 'x'}, out[16];
+    assert(dc_decode(dc2, out, bad, sizeof(bad)) == 0);
+    dc_destroy(dc2);
+    dc_destroy(dc);
+
+    free_keys(keys, lens);
+    printf("prefix ok\n");
+}
+
+static void add_keys(HTree *t, int from, int to)
+{
+    char key[100];
+    int i;
+    for (i=from; i<to; i++) {
+        make_key(key, i);
+        ht_add(t, key, MAKE_POS(1, i << 4), i, 1);
+    }
+}
+
+static void check_keys(HTree *t, int to, const char *name)
+{
+    char key[100];
+    int i, count = 0;
+    for (i=0; i<to; i++) {
+        make_key(key, i);
+        Item *it = ht_get(t, key);
+        if (it == NULL || ITEM_POS(it) != MAKE_POS(1, i << 4) || strcmp(it->key, key) != 0) {
+            fprintf(stderr, "%s: bad item of %s\n", name, key);
+            exit(1);
+        }
+        free(it);
+    }
+    ht_get_hash(t, "@", &count);
+    assert(count == to);
+}
+
+static void test_tree(const char *dir)
+{
+    const char **keys;
+    int *lens;
+    char path[1024];
+    train(&keys, &lens);
+    sprintf(path, "%s/000.hash", dir);
+
+    HTree *t = ht_new(0, 0);
+    assert(ht_train(t, keys, lens, N) > 0);
+    add_keys(t, 0, N);
+    assert(ht_train(t, keys, lens, N) == -1);
+    assert(ht_save(t, path) == 0);
+    ht_destroy(t);
+    t = ht_open(0, 0, path);
+    assert(t != NULL);
+    check_keys(t, N, "trained");
+    ht_destroy(t);
+    unlink(path);
+
+    free_keys(keys, lens);
+    printf("trained tree ok\n");
+}
+
+static void test_shared(const char *dir)
+{
+    const char **keys;
+    int *lens;
+    char path[1024], cpath[1024], stale[1024], other[1024], cmd[4096];
+    train(&keys, &lens);
+    sprintf(path, "%s/000.hash", dir);
+    sprintf(cpath, "%s/codec", dir);
+    sprintf(stale, "%s/codec.stale", dir);
+    sprintf(other, "%s/codec.other", dir);
+
+    Codec *dc = dc_open(cpath);
+    assert(dc != NULL && dc_shared(dc));
+    assert(dc_train(dc, keys, lens, N) > 0);
+    HTree *t = ht_new2(0, 0, dc);
+    add_keys(t, 0, N / 2);
+    assert(dc_save(dc) == 0);
+    sprintf(cmd, "cp %s %s", cpath, stale);
+    assert(system(cmd) == 0);
+
+    // the other tree learns more formats in the shared codec
+    HTree *t2 = ht_new2(0, 0, dc);
+    ht_add(t2, "/another/format/1234", MAKE_POS(1, 16), 1, 1);
+    ht_add(t2, "/another/format2/1234/5678", MAKE_POS(1, 16), 1, 1);
+    ht_destroy(t2);
+    add_keys(t, N / 2, N);
+    assert(dc_save(dc) == 0);
+    assert(ht_save(t, path) == 0);
+    ht_destroy(t);
+
+    Codec *dc2 = dc_open(cpath);
+    assert(dc2 != NULL);
+    t = ht_open2(0, 0, path, dc2);
+    assert(t != NULL);
+    check_keys(t, N, "shared");
+    ht_destroy(t);
+    dc_destroy(dc2);
+
+    // the codec saved before the snapshot has less formats
+    dc2 = dc_open(stale);
+    assert(dc2 != NULL);
+    assert(ht_open2(0, 0, path, dc2) == NULL);
+    dc_destroy(dc2);
+
+    // another codec with the same formats
+    dc2 = dc_open(other);
+    assert(dc_train(dc2, keys, lens, N) > 0);
+    t = ht_new2(0, 0, dc2);
+    add_keys(t, 0, N);
+    ht_destroy(t);
+    assert(ht_open2(0, 0, path, dc2) == NULL);
+    dc_destroy(dc2);
+
+    // no shared codec
+    assert(ht_open(0, 0, path) == NULL);
+
+    dc_destroy(dc);
+    unlink(path);
+    unlink(cpath);
+    unlink(stale);
+    free_keys(keys, lens);
+    printf("shared codec ok\n");
+}
+
+int main(int argc, char **argv)
+{
+    char tmp[] = "/tmp/test_codec.XXXXXX";
+    assert(mkdtemp(tmp) != NULL);
+
+    test_prefix();
+    test_tree(tmp);
+    test_shared(tmp);
+
+    rmdir(tmp);
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *  Records encoded in place, at any alignment of the value and of the
+ *  buffer, are decoded back from memory and from a data file, with the
+ *  padding zeroed. The size class of a record is the smallest one which
+ *  holds it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "record.h"
+
+#define CLIENT_COMPRESS_FLAG 0x10
+
+static DataRecord* new_record(const char *key, char *value, int vsz, int flag)
+{
+    int ksz = strlen(key);
+    DataRecord *r = (DataRecord*) malloc(sizeof(DataRecord) + ksz + 1);
+    r->value = value;
+    r->free_value = false;
+    r->tstamp = 1234567;
+    r->flag = flag;
+    r->version = 3;
+    r->ksz = ksz;
+    r->vsz = vsz;
+    memcpy(r->key, key, ksz + 1);
+    return r;
+}
+
+static void check_record(DataRecord *r, const char *key, const char *value, int vsz, int flag)
+{
+    if (r == NULL || strcmp(r->key, key) != 0 || r->vsz != vsz
+        || memcmp(r->value, value, vsz) != 0 || r->flag != flag || r->version != 3) {
+        fprintf(stderr, "bad record of %s\n", key);
+        exit(1);
+    }
+    free_record(r);
+}
+
+static void test_encode(int fd)
+{
+    int sizes[] = {0, 1, 7, 8, 15, 16, 17, 100, 255, 1000, 100 << 10, 1 << 20};
+    char key[100];
+    int i, a, b, j;
+    char *value = malloc((1 << 20) + 8), *buf = malloc((2 << 20) + 8);
+    for (i=0; i<(1 << 20) + 8; i++) {
+        value[i] = rand();
+    }
+
+    for (i=0; i<sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int vsz = sizes[i];
+        for (a=0; a<8; a+=3) {
+            for (b=0; b<8; b+=5) {
+                sprintf(key, "/record/%d/%d", vsz, a);
+                DataRecord *r = new_record(key, value + a, vsz, CLIENT_COMPRESS_FLAG);
+                int len = record_length(r);
+                memset(buf, 0xff, len + b);
+                encode_record2(r, buf + b, value_crc(r));
+                free(r);
+
+                int n = sizeof(DataRecord) - sizeof(char*) + strlen(key) + vsz;
+                for (j=n; j<len; j++) {
+                    assert(buf[b + j] == 0);
+                }
+                r = decode_record(buf + b, len, true);
+                check_record(r, key, value + a, vsz, CLIENT_COMPRESS_FLAG);
+
+                assert(pwrite(fd, buf + b, len, 0) == len);
+                r = fast_read_record(fd, 0, true);
+                check_record(r, key, value + a, vsz, CLIENT_COMPRESS_FLAG);
+            }
+        }
+    }
+
+    // compressed by encode_record()
+    memset(value, 'x', 100 << 10);
+    DataRecord *r = new_record("/record/compressed", value, 100 << 10, 0);
+    int size = 0;
+    char *p = encode_record(r, &size);
+    assert(size < 10 << 10);
+    free_record(r);
+    r = decode_record(p, size, true);
+    check_record(r, "/record/compressed", value, 100 << 10, 0);
+    free(p);
+
+    free(value);
+    free(buf);
+    printf("encode ok\n");
+}
+
+// the smallest class which holds the length
+static void test_class()
+{
+    uint32_t len;
+    uint8_t last = 0;
+    for (len=256; len<=(16 << 20); len+=256) {
+        uint8_t c = record_class(len);
+        if (c == 0) {
+            assert(len > class_length(255));
+            continue;
+        }
+        assert(c >= last);
+        assert(class_length(c) >= len && class_length(c - 1) < len);
+        last = c;
+    }
+    assert(record_class(256) == 1 && class_length(128) == 32 << 10);
+    assert(last == 255);
+    printf("size class ok\n");
+}
+
+int main(int argc, char **argv)
+{
+    char path[] = "/tmp/test_encode.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+
+    test_encode(fd);
+    test_class();
+
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *  Hint files of a bucket are built from HTree and scanned back, with
+ *  offsets up to 4G in version 3, and the ones of version 1 and 2 are
+ *  still readable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "htree.h"
+#include "hint.h"
+
+#define N 1000
+#define BUCKET 7
+
+// offsets of records all over 4G, aligned to 16 bytes
+static uint32_t make_offset(int i)
+{
+    return (uint32_t)(i * 4294967.291) & ~0xfu;
+}
+
+static int32_t make_ver(int i)
+{
+    return i % 10 == 9 ? -3 : i % 5 + 1;
+}
+
+static void fill(HTree *t)
+{
+    char key[100];
+    int i;
+    for (i=0; i<N; i++) {
+        sprintf(key, "/hint/%d", i);
+        ht_add3(t, key, strlen(key), MAKE_POS(BUCKET, make_offset(i)), (uint16_t)(i * 13),
+                make_ver(i), (uint8_t)(i % 64));
+        // the other buckets are not in hint
+        sprintf(key, "/other/%d", i);
+        ht_add(t, key, MAKE_POS(BUCKET + 1 + i % 2, make_offset(i)), 1, 1);
+    }
+}
+
+static void check(HTree *t, const char *name)
+{
+    char key[100];
+    int i, n = 0;
+    for (i=0; i<N; i++) {
+        sprintf(key, "/hint/%d", i);
+        Item *it = ht_get(t, key);
+        if (make_ver(i) < 0) {
+            // deleted records are removed in scanHintFile()
+            if (it != NULL) {
+                fprintf(stderr, "%s: deleted %s is found\n", name, key);
+                exit(1);
+            }
+            continue;
+        }
+        if (it == NULL || ITEM_POS(it) != MAKE_POS(BUCKET, make_offset(i))
+            || it->ver != make_ver(i) || it->hash != (uint16_t)(i * 13)
+            || it->size != i % 64) {
+            fprintf(stderr, "%s: bad item of %s\n", name, key);
+            exit(1);
+        }
+        free(it);
+        n ++;
+    }
+    int count = 0;
+    ht_get_hash(t, "@", &count);
+    if (count != n) {
+        fprintf(stderr, "%s: %d items, expected %d\n", name, count, n);
+        exit(1);
+    }
+}
+
+static void test_build(const char *dir, const char *name)
+{
+    char path[1024];
+    int total = 0;
+    sprintf(path, "%s/%s", dir, name);
+
+    HTree *t = ht_new(0, 0);
+    fill(t);
+    assert(ht_freeze(t) == 0);
+    build_bucket_hint(t, BUCKET, path);
+
+    HTree *t2 = ht_new(0, 0);
+    scanHintFile(t2, BUCKET, path, NULL);
+    check(t2, name);
+    ht_destroy(t2);
+
+    assert(count_deleted_record(t, BUCKET, path, &total) == N / 10);
+    assert(total == N);
+    ht_destroy(t);
+    unlink(path);
+    printf("%s ok\n", name);
+}
+
+// records of version 1 (no header) and 2, pos in 256 bytes
+static void test_old(const char *dir, int version)
+{
+    char path[1024], key[100];
+    char *buf = malloc(N * 64), *p = buf;
+    int i;
+    sprintf(path, "%s/old.hint", dir);
+    if (version > 1) {
+        HintRecord *r = (HintRecord*)p;
+        memset(r, 0, sizeof(HintRecord));
+        r->version = version;
+        p += sizeof(HintRecord) - NAME_IN_RECORD + 1;
+    }
+    for (i=0; i<N; i++) {
+        HintRecord *r = (HintRecord*)p;
+        int ksz = sprintf(key, "/old/%d", i), extra = version > 1;
+        r->ksize = ksz;
+        r->pos = i << 8;
+        r->version = i + 1;
+        r->hash = i;
+        r->key[0] = 5;
+        memcpy(r->key + extra, key, ksz + 1);
+        p += sizeof(HintRecord) - NAME_IN_RECORD + extra + ksz + 1;
+    }
+    write_hint_file(buf, p - buf, path);
+    free(buf);
+
+    HTree *t = ht_new(0, 0);
+    scanHintFile(t, BUCKET, path, NULL);
+    for (i=0; i<N; i++) {
+        sprintf(key, "/old/%d", i);
+        Item *it = ht_get(t, key);
+        if (it == NULL || ITEM_POS(it) != MAKE_POS(BUCKET, (uint32_t)i << 16)
+            || it->ver != i + 1 || it->size != (version > 1 ? 5 : 0)) {
+            fprintf(stderr, "version %d: bad item of %s\n", version, key);
+            exit(1);
+        }
+        free(it);
+    }
+    ht_destroy(t);
+    unlink(path);
+    printf("version %d ok\n", version);
+}
+
+int main(int argc, char **argv)
+{
+    char tmp[] = "/tmp/test_hint.XXXXXX";
+    assert(mkdtemp(tmp) != NULL);
+
+    test_build(tmp, "000.hint");
+    test_build(tmp, "000.hint.qlz");
+    test_old(tmp, 1);
+    test_old(tmp, 2);
+
+    rmdir(tmp);
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *  SETs and DELETEs of a durable store return after their records are
+ *  in the data file, the concurrent ones are synced together, and all of
+ *  them are there after reopen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "hstore.h"
+
+#define WRITERS 4
+#define N 200
+
+static char dir[] = "/tmp/test_hstore.XXXXXX";
+
+static off_t data_size()
+{
+    char path[1024];
+    struct stat st;
+    sprintf(path, "%s/000.data", dir);
+    if (stat(path, &st) != 0) return 0;
+    return st.st_size;
+}
+
+static HStore *store;
+
+static void* writer(void *param)
+{
+    char key[100], value[100];
+    int i, id = (int)(intptr_t)param;
+    for (i=0; i<N; i++) {
+        sprintf(key, "/w%d/%d", id, i);
+        sprintf(value, "value %d", i);
+        assert(hs_set(store, key, value, strlen(value), 0, 0));
+        if (i % 10 == 0) {
+            assert(hs_delete(store, key));
+        }
+    }
+    return NULL;
+}
+
+static void check_values(int id)
+{
+    char key[100], value[100];
+    int i, vlen;
+    uint32_t flag;
+    for (i=0; i<N; i++) {
+        sprintf(key, "/w%d/%d", id, i);
+        sprintf(value, "value %d", i);
+        char *v = hs_get(store, key, &vlen, &flag);
+        if (i % 10 == 0) {
+            assert(v == NULL);
+        } else {
+            assert(v != NULL && vlen == strlen(value) && memcmp(v, value, vlen) == 0);
+            free(v);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char path[1024];
+    uint64_t commits, syncs, hist[COMMIT_HIST_SIZE];
+    pthread_t tids[WRITERS];
+    int i;
+
+    assert(mkdtemp(dir) != NULL);
+    strcpy(path, dir);
+    store = hs_open(path, 0, 0, 0);
+    assert(store != NULL);
+    assert(!hs_commit_stat(store, &commits, &syncs, hist));
+    assert(hs_group_commit(store, 1000, 8) == 0);
+    assert(hs_group_commit(store, 1000, 8) == -1);
+
+    // the record is in the data file once SET returns
+    assert(hs_set(store, "/first", "value", 5, 0, 0));
+    assert(data_size() > 0);
+    off_t size = data_size();
+    assert(hs_delete(store, "/first"));
+    assert(data_size() > size);
+
+    for (i=0; i<WRITERS; i++) {
+        assert(pthread_create(&tids[i], NULL, writer, (void*)(intptr_t)i) == 0);
+    }
+    for (i=0; i<WRITERS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(hs_commit_stat(store, &commits, &syncs, hist));
+    assert(commits == 2 + WRITERS * (N + N / 10));
+    assert(syncs > 0 && syncs <= commits);
+    uint64_t total = 0;
+    for (i=0; i<COMMIT_HIST_SIZE; i++) {
+        total += hist[i];
+    }
+    assert(total == commits);
+    for (i=0; i<WRITERS; i++) {
+        check_values(i);
+    }
+    hs_close(store);
+
+    strcpy(path, dir);
+    store = hs_open(path, 0, 0, 0);
+    assert(store != NULL);
+    assert(hs_get(store, "/first", &i, (uint32_t*)&i) == NULL);
+    for (i=0; i<WRITERS; i++) {
+        check_values(i);
+    }
+    hs_close(store);
+
+    sprintf(path, "rm -rf %s", dir);
+    assert(system(path) == 0);
+    printf("group commit ok, %lu SETs in %lu syncs\n", commits, syncs);
+    return 0;
+}
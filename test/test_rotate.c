@@ -0,0 +1,147 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *  Writers set and get values while the buffer is flushed, the buckets
+ *  of 4MB (MAX_BUCKET_MB) are rotated and optimized, all the latest
+ *  values are there after restart.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bitcask.h"
+#include "record.h"
+
+#define WRITERS 4
+#define N 500
+#define ROUNDS 5
+#define VSZ 4000
+
+static char dir[] = "/tmp/test_rotate.XXXXXX";
+static Bitcask *bc;
+static volatile bool writing;
+
+static void make_value(char *buf, int w, int i, int r)
+{
+    unsigned seed = w * N + i + r;
+    int j, n = sprintf(buf, "value %d of %d in round %d ", i, w, r);
+    for (j=n; j<VSZ; j++) buf[j] = rand_r(&seed);
+}
+
+// a GET may miss the record being moved by optimize, not again
+static DataRecord *get(const char *key)
+{
+    DataRecord *r = bc_get(bc, key);
+    if (r == NULL) r = bc_get(bc, key);
+    return r;
+}
+
+static void check_value(const char *key, const char *value, int ver)
+{
+    DataRecord *r = get(key);
+    if (r == NULL || r->vsz != VSZ || memcmp(r->value, value, VSZ) != 0
+        || r->version != ver) {
+        fprintf(stderr, "bad value of %s\n", key);
+        exit(1);
+    }
+    free_record(r);
+}
+
+static void* writer(void *param)
+{
+    char key[100], value[VSZ];
+    int w = (int)(intptr_t)param, i, r;
+    for (r=0; r<ROUNDS; r++) {
+        for (i=0; i<N; i++) {
+            sprintf(key, "/w%d/%d", w, i);
+            make_value(value, w, i, r);
+            assert(bc_set(bc, key, value, VSZ, 0, 0));
+            check_value(key, value, r + 1);
+        }
+    }
+    return NULL;
+}
+
+static void* flusher(void *param)
+{
+    while (writing) {
+        bc_flush(bc, 0, 0);
+        usleep(100);
+    }
+    return NULL;
+}
+
+static void* optimizer(void *param)
+{
+    while (writing) {
+        bc_optimize(bc, -3600);
+        usleep(10000);
+    }
+    return NULL;
+}
+
+static void check_writers()
+{
+    char key[100], value[VSZ];
+    int w, i;
+    for (w=0; w<WRITERS; w++) {
+        for (i=0; i<N; i++) {
+            sprintf(key, "/w%d/%d", w, i);
+            make_value(value, w, i, ROUNDS - 1);
+            check_value(key, value, ROUNDS);
+        }
+    }
+    assert(bc_count(bc, NULL) == WRITERS * N);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t th[WRITERS], fl, op;
+    char cmd[1024];
+    int i;
+
+    assert(mkdtemp(dir) != NULL);
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    writing = true;
+    pthread_create(&fl, NULL, flusher, NULL);
+    pthread_create(&op, NULL, optimizer, NULL);
+    for (i=0; i<WRITERS; i++) {
+        pthread_create(&th[i], NULL, writer, (void*)(intptr_t)i);
+    }
+    for (i=0; i<WRITERS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    writing = false;
+    pthread_join(fl, NULL);
+    pthread_join(op, NULL);
+    check_writers();
+    bc_close(bc);
+
+    // from snapshot and hints
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    check_writers();
+    bc_close(bc);
+    sprintf(cmd, "%s/001.data", dir);
+    assert(access(cmd, F_OK) == 0);
+
+    // from data files
+    sprintf(cmd, "rm -f %s/*.hint* %s/*.htree", dir, dir);
+    assert(system(cmd) == 0);
+    bc = bc_open(dir, 0, 0, 0);
+    assert(bc != NULL);
+    check_writers();
+    bc_close(bc);
+
+    sprintf(cmd, "rm -rf %s", dir);
+    assert(system(cmd) == 0);
+    printf("rotate ok\n");
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *  The snapshots of HTree of old versions in test/data are loaded, checked
+ *  against a tree built in memory, saved in the current version, changed,
+ *  and saved again.
+ *
+ *  The snapshots were saved by ht_save() of the commit which added the
+ *  version, with the items of fill(), the pos of them is offset | bucket.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "htree.h"
+
+#define N 500
+
+static const char *versions[] = {
+    "HTREE001", "HTREE002",
+};
+
+static void make_key(char *key, int i)
+{
+    sprintf(key, i % 3 ? "/snapshot/%d.jpg" : "key-%08x", i);
+}
+
+static int32_t make_ver(int i)
+{
+    return i % 10 == 9 ? -2 : i % 5 + 1;
+}
+
+static void fill(HTree *t)
+{
+    char key[100];
+    int i;
+    for (i=0; i<N; i++) {
+        make_key(key, i);
+        ht_add(t, key, MAKE_POS(i % 16, i << 8), (uint16_t)(i * 7), make_ver(i));
+    }
+}
+
+static void check_items(HTree *t, HTree *expect, const char *name)
+{
+    char key[100];
+    int i, n = 0, m = 0;
+    for (i=0; i<N; i++) {
+        make_key(key, i);
+        Item *it = ht_get(t, key);
+        if (it == NULL || ITEM_POS(it) != MAKE_POS(i % 16, i << 8)
+            || it->ver != make_ver(i) || it->hash != (uint16_t)(i * 7)) {
+            fprintf(stderr, "%s: bad item of %s\n", name, key);
+            exit(1);
+        }
+        free(it);
+    }
+    uint32_t h = ht_get_hash(t, "@", &n);
+    if (h != ht_get_hash(expect, "@", &m) || n != m) {
+        fprintf(stderr, "%s: hash %u of %d items, expected %u of %d\n",
+                name, h, n, ht_get_hash(expect, "@", NULL), m);
+        exit(1);
+    }
+}
+
+// the tree should work after changed, Data blocks of snapshot are used in place
+static void change(HTree *t)
+{
+    char key[100];
+    make_key(key, 0);
+    ht_remove(t, key);
+    make_key(key, 1);
+    ht_add(t, key, MAKE_POS(3, 1 << 20), 1, 10);
+    ht_add(t, "/snapshot/new", MAKE_POS(1, 16), 2, 1);
+}
+
+static void check_changed(HTree *t, HTree *expect, const char *name)
+{
+    int n = 0, m = 0;
+    Item *it = ht_get(t, "key-00000000");
+    assert(it == NULL);
+    it = ht_get(t, "/snapshot/1.jpg");
+    assert(it != NULL && ITEM_POS(it) == MAKE_POS(3, 1 << 20) && it->ver == 10);
+    free(it);
+    it = ht_get(t, "/snapshot/new");
+    assert(it != NULL && ITEM_POS(it) == MAKE_POS(1, 16));
+    free(it);
+    if (ht_get_hash(t, "@", &n) != ht_get_hash(expect, "@", &m) || n != m) {
+        fprintf(stderr, "%s: hash of changed tree not match\n", name);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *srcdir = getenv("srcdir");
+    char path[1024], tmp[] = "/tmp/test_snapshot.XXXXXX";
+    int i;
+    if (srcdir == NULL) srcdir = ".";
+    assert(mkdtemp(tmp) != NULL);
+
+    HTree *expect = ht_new(0, 0);
+    fill(expect);
+    HTree *changed = ht_new(0, 0);
+    fill(changed);
+    change(changed);
+
+    for (i=0; i<sizeof(versions)/sizeof(versions[0]); i++) {
+        const char *name = versions[i];
+        sprintf(path, "%s/test/data/%s", srcdir, name);
+        HTree *t = ht_open(0, 0, path);
+        if (t == NULL) {
+            fprintf(stderr, "%s: can not load %s\n", name, path);
+            return 1;
+        }
+        check_items(t, expect, name);
+
+        // round trip in the current version and HTREE002
+        sprintf(path, "%s/%s.new", tmp, name);
+        assert(ht_save(t, path) == 0);
+        HTree *t2 = ht_open(0, 0, path);
+        assert(t2 != NULL);
+        check_items(t2, expect, name);
+        ht_destroy(t2);
+        unlink(path);
+
+        sprintf(path, "%s/%s.v2", tmp, name);
+        assert(ht_save_v2(t, path) == 0);
+        t2 = ht_open(0, 0, path);
+        assert(t2 != NULL);
+        check_items(t2, expect, name);
+        ht_destroy(t2);
+        unlink(path);
+
+        change(t);
+        check_changed(t, changed, name);
+        sprintf(path, "%s/%s.changed", tmp, name);
+        assert(ht_save(t, path) == 0);
+        ht_destroy(t);
+        t = ht_open(0, 0, path);
+        assert(t != NULL);
+        check_changed(t, changed, name);
+        ht_destroy(t);
+        unlink(path);
+        printf("%s ok\n", name);
+    }
+
+    ht_destroy(expect);
+    ht_destroy(changed);
+    rmdir(tmp);
+    return 0;
+}
@@ -0,0 +1,457 @@
+/*
+ *  Beansdb - A high available distributed key-value storage system:
+ *
+ *  HTree is read by many threads while another one changes it, items of
+ *  the same fingerprint in one leaf, the leaves merged with deleted items
+ *  in them, the memory of arena reused after the keys are removed, the
+ *  hashes of nodes kept up to date by every change, the view frozen
+ *  for snapshot while the tree is changed, and the nodes split only
+ *  under a hot prefix.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "htree.h"
+
+#define N 10000
+#define READERS 4
+#define ROUNDS 20
+
+static volatile bool stopped;
+
+static uint64_t make_pos(int i)
+{
+    return MAKE_POS(i % 16, i << 8);
+}
+
+// the stable keys are always there, the others come and go
+static void make_key(char *key, int i, bool stable)
+{
+    sprintf(key, stable ? "/stable/%d.jpg" : "/moving/%d.jpg", i);
+}
+
+static void check_item(Item *it, const char *key, int i)
+{
+    if (it == NULL || ITEM_POS(it) != make_pos(i) || strcmp(it->key, key) != 0) {
+        fprintf(stderr, "bad item of %s\n", key);
+        exit(1);
+    }
+}
+
+static void* reader(void *param)
+{
+    HTree *t = (HTree*)param;
+    char key[100];
+    Item item;
+    int i = 0;
+    while (!stopped) {
+        make_key(key, i, true);
+        Item *it = ht_get(t, key);
+        check_item(it, key, i);
+        free(it);
+
+        make_key(key, i, false);
+        it = ht_get(t, key);
+        if (it != NULL) {
+            check_item(it, key, i);
+            free(it);
+        }
+        // without copy of key
+        if (ht_lookup(t, key, strlen(key), &item) && ITEM_POS(&item) != make_pos(i)) {
+            fprintf(stderr, "bad pos of %s\n", key);
+            exit(1);
+        }
+        i = (i + 7) % N;
+    }
+    return NULL;
+}
+
+static void test_concurrent()
+{
+    char key[100];
+    pthread_t ths[READERS];
+    int i, r;
+
+    HTree *t = ht_new(0, 0);
+    for (i=0; i<N; i++) {
+        make_key(key, i, true);
+        ht_add(t, key, make_pos(i), i, 1);
+        make_key(key, i, false);
+        ht_add(t, key, make_pos(i), i, 1);
+    }
+
+    stopped = false;
+    for (i=0; i<READERS; i++) {
+        pthread_create(&ths[i], NULL, reader, t);
+    }
+    // split and merge the leaves under readers
+    for (r=0; r<ROUNDS; r++) {
+        for (i=0; i<N; i++) {
+            make_key(key, i, false);
+            if (r % 2 == 0) {
+                ht_remove(t, key);
+            } else {
+                ht_add(t, key, make_pos(i), i, r + 1);
+            }
+        }
+        int count = 0;
+        ht_get_hash(t, "@", &count);
+        assert(count == N + (r % 2 ? N : 0));
+    }
+    stopped = true;
+    for (i=0; i<READERS; i++) {
+        pthread_join(ths[i], NULL);
+    }
+
+    ht_destroy(t);
+    printf("concurrent ok\n");
+}
+
+static uint8_t fingerprint(const char *key)
+{
+    uint32_t h = fnv1a(key, strlen(key));
+    return h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24);
+}
+
+// all in one leaf, under SPLIT_LIMIT
+static void test_fingerprint()
+{
+    char key[100], same[40][100], other[100];
+    int i, n = 0, count = 0;
+    Item item;
+    for (i=0; n < 40; i++) {
+        sprintf(key, "/fp/%d", i);
+        if (fingerprint(key) == 0x5a) strcpy(same[n++], key);
+    }
+    // a key of the same fingerprint, not added
+    for (i++; ; i++) {
+        sprintf(other, "/fp/%d", i);
+        if (fingerprint(other) == 0x5a) break;
+    }
+
+    HTree *t = ht_new(0, 0);
+    for (i=0; i<20; i++) {
+        sprintf(key, "/nofp/%d", i);
+        ht_add(t, key, make_pos(100 + i), 1, 1);
+    }
+    for (i=0; i<40; i++) {
+        ht_add(t, same[i], make_pos(i), 1, 1);
+    }
+    for (i=0; i<40; i++) {
+        check_item(ht_get(t, same[i]), same[i], i);
+    }
+    assert(!ht_lookup(t, other, strlen(other), &item));
+
+    for (i=0; i<40; i+=2) {
+        ht_remove(t, same[i]);
+    }
+    for (i=0; i<40; i++) {
+        bool found = ht_lookup(t, same[i], strlen(same[i]), &item);
+        assert(found == (i % 2 == 1));
+        assert(!found || ITEM_POS(&item) == make_pos(i));
+    }
+    for (i=0; i<20; i++) {
+        sprintf(key, "/nofp/%d", i);
+        assert(ht_lookup(t, key, strlen(key), &item) && ITEM_POS(&item) == make_pos(100 + i));
+    }
+    ht_get_hash(t, "@", &count);
+    assert(count == 40);
+    ht_destroy(t);
+    printf("fingerprint ok\n");
+}
+
+// the live items after deleted ones are kept when the children are merged
+static void test_merge()
+{
+    char key[100];
+    int i, count = 0;
+    HTree *t = ht_new(0, 0);
+    for (i=0; i<N; i++) {
+        make_key(key, i, false);
+        ht_add(t, key, make_pos(i), i, 1);
+    }
+    ht_get_hash(t, "@", &count);
+    assert(count == N);
+    for (i=0; i<N; i++) {
+        make_key(key, i, false);
+        if (i % 200 != 0) {
+            ht_add(t, key, make_pos(i), i, -2);
+        }
+    }
+    ht_get_hash(t, "@", &count);
+    assert(count == N / 200);
+    for (i=0; i<N; i+=200) {
+        make_key(key, i, false);
+        Item *it = ht_get(t, key);
+        check_item(it, key, i);
+        assert(it->ver == 1);
+        free(it);
+    }
+    ht_destroy(t);
+    printf("merge ok\n");
+}
+
+static void test_arena()
+{
+    char key[100];
+    uint64_t allocated = 0, used = 0, first = 0;
+    int i, r, count = 0;
+    Item item;
+
+    HTree *t = ht_new(0, 0);
+    ht_stat(t, &allocated, &used);
+    assert(allocated < 64 << 10 && used <= allocated);
+    for (r=0; r<4; r++) {
+        for (i=0; i<N * 10; i++) {
+            make_key(key, i, r % 2);
+            ht_add(t, key, make_pos(i), i, 1);
+        }
+        ht_stat(t, &allocated, &used);
+        assert(used > 0 && used <= allocated);
+        if (r == 0) first = allocated;
+        assert(allocated < first * 3 / 2);
+
+        for (i=0; i<N * 10; i++) {
+            make_key(key, i, r % 2);
+            assert(ht_lookup(t, key, strlen(key), &item) && ITEM_POS(&item) == make_pos(i));
+            ht_remove(t, key);
+        }
+        ht_get_hash(t, "@", &count);
+        assert(count == 0);
+    }
+    ht_stat(t, &allocated, &used);
+    assert(used < first / 4);
+    ht_destroy(t);
+    printf("arena ok\n");
+}
+
+static void compare_hash(HTree *t, HTree *t2, const char *dir)
+{
+    int n = 0, m = 0;
+    uint32_t h = ht_get_hash(t, dir, &n), h2 = ht_get_hash(t2, dir, &m);
+    if (h != h2 || n != m) {
+        fprintf(stderr, "hash of %s: %u of %d items, expected %u of %d\n",
+                dir, h, n, h2, m);
+        exit(1);
+    }
+}
+
+// the same as a tree built from the final items
+static void test_hash()
+{
+    char key[100], dir[10];
+    int i, r;
+    HTree *t = ht_new(0, 0), *t2 = ht_new(0, 0);
+    for (i=0; i<N * 2; i++) {
+        make_key(key, i, false);
+        ht_add(t, key, make_pos(i), i, 1);
+    }
+    for (r=0; r<3; r++) {
+        for (i=0; i<N * 2; i++) {
+            make_key(key, i, false);
+            if (i % 3 == r) {
+                ht_add(t, key, make_pos(i), i * 7 + r, r + 2);
+            } else if (i % 5 == r) {
+                ht_remove(t, key);
+            }
+        }
+    }
+    for (i=0; i<N * 2; i++) {
+        make_key(key, i, false);
+        if (i % 5 >= 3 || i % 5 <= i % 3) {
+            ht_add(t2, key, make_pos(i), i * 7 + i % 3, i % 3 + 2);
+        }
+    }
+
+    compare_hash(t, t2, "@");
+    for (i=0; i<16 * 17; i++) {
+        sprintf(dir, i < 16 ? "@%x" : "@%02x", i < 16 ? i : i - 16);
+        compare_hash(t, t2, dir);
+    }
+    char *l = ht_list(t, "", NULL), *l2 = ht_list(t2, "", NULL);
+    assert(l != NULL && l2 != NULL && strcmp(l, l2) == 0);
+    free(l);
+    free(l2);
+    assert(ht_max_lock_hold(t) > 0);
+    ht_destroy(t);
+    ht_destroy(t2);
+    printf("hash ok\n");
+}
+
+static void* writer(void *param)
+{
+    HTree *t = (HTree*)param;
+    char key[100];
+    int i;
+    for (i=0; !stopped; i = (i + 1) % N) {
+        make_key(key, i, true);
+        ht_add(t, key, make_pos(i), i, 2);
+    }
+    return NULL;
+}
+
+// the snapshot has the items at the time of ht_freeze()
+static void test_freeze()
+{
+    char key[100], path[] = "/tmp/test_tree.XXXXXX";
+    int i, count = 0;
+    pthread_t th;
+    Item item;
+    assert(mkstemp(path) >= 0);
+
+    HTree *t = ht_new(0, 0);
+    for (i=0; i<N; i++) {
+        make_key(key, i, false);
+        ht_add(t, key, make_pos(i), i, 1);
+    }
+    assert(ht_freeze(t) == 0);
+    for (i=0; i<N; i++) {
+        make_key(key, i, false);
+        if (i % 2 == 0) {
+            ht_remove(t, key);
+        } else if (i % 3 == 0) {
+            ht_add(t, key, make_pos(i), i, 2);
+        }
+        make_key(key, i, true);
+        ht_add(t, key, make_pos(i), i, 1);
+    }
+    assert(ht_save_frozen(t, path) == 0);
+
+    HTree *t2 = ht_open(0, 0, path);
+    assert(t2 != NULL);
+    for (i=0; i<N; i++) {
+        make_key(key, i, false);
+        assert(ht_lookup(t2, key, strlen(key), &item) && item.ver == 1);
+        make_key(key, i, true);
+        assert(!ht_lookup(t2, key, strlen(key), &item));
+    }
+    ht_get_hash(t2, "@", &count);
+    assert(count == N);
+    ht_destroy(t2);
+
+    ht_get_hash(t, "@", &count);
+    assert(count == N + N / 2);
+    for (i=0; i<N; i++) {
+        make_key(key, i, false);
+        assert(ht_lookup(t, key, strlen(key), &item) == (i % 2 == 1));
+        assert(i % 2 == 0 || item.ver == (i % 3 == 0 ? 2 : 1));
+    }
+
+    // saved while it is changed
+    stopped = false;
+    pthread_create(&th, NULL, writer, t);
+    for (i=0; i<5; i++) {
+        assert(ht_save(t, path) == 0);
+        t2 = ht_open(0, 0, path);
+        assert(t2 != NULL);
+        ht_get_hash(t2, "@", &count);
+        assert(count == N + N / 2);
+        ht_destroy(t2);
+    }
+    stopped = true;
+    pthread_join(th, NULL);
+
+    ht_destroy(t);
+    unlink(path);
+    printf("freeze ok\n");
+}
+
+// the keys under one prefix of two hex digits, split deep down there only
+static int make_hot_key(char *key, int start)
+{
+    int i;
+    for (i=start; ; i++) {
+        sprintf(key, "/hot/%d.jpg", i);
+        if (fnv1a(key, strlen(key)) >> 24 == 0x5a) return i;
+    }
+}
+
+static void check_same(HTree *t, HTree *t2)
+{
+    char *l = ht_list(t, "", NULL), *l2 = ht_list(t2, "", NULL);
+    assert(l != NULL && l2 != NULL && strcmp(l, l2) == 0);
+    free(l);
+    free(l2);
+    compare_hash(t, t2, "@");
+    compare_hash(t, t2, "@5");
+    compare_hash(t, t2, "@5a");
+}
+
+static void test_sparse()
+{
+    char key[100], path[] = "/tmp/test_tree.XXXXXX";
+    uint64_t allocated = 0, used = 0, uniform = 0, hot = 0;
+    int i, k, count = 0;
+    Item item;
+    assert(mkstemp(path) >= 0);
+
+    HTree *t = ht_new(0, 0), *t2 = ht_new(0, 0);
+    for (i=0, k=0; i<N * 4; i++, k++) {
+        make_key(key, i, false);
+        ht_add(t2, key, make_pos(i), i, 1);
+        k = make_hot_key(key, k);
+        ht_add(t, key, make_pos(i), i, 1);
+    }
+    for (i=0; i<N; i++) {
+        make_key(key, i, true);
+        ht_add(t, key, make_pos(i), i, 1);
+        ht_add(t2, key, make_pos(i), i, 1);
+    }
+    ht_stat(t, &allocated, &hot);
+    ht_stat(t2, &allocated, &uniform);
+    assert(hot < uniform * 3 / 2);
+    ht_destroy(t2);
+
+    for (i=0, k=0; i<N * 4; i++, k++) {
+        k = make_hot_key(key, k);
+        assert(ht_lookup(t, key, strlen(key), &item) && ITEM_POS(&item) == make_pos(i));
+    }
+
+    // written in preorder, the dense HTREE002 is still readable
+    assert(ht_save(t, path) == 0);
+    t2 = ht_open(0, 0, path);
+    assert(t2 != NULL);
+    check_same(t, t2);
+    ht_destroy(t2);
+    assert(ht_save_v2(t, path) == 0);
+    t2 = ht_open(0, 0, path);
+    assert(t2 != NULL);
+    check_same(t, t2);
+    ht_destroy(t2);
+
+    // the groups are merged back
+    for (i=0, k=0; i<N * 4; i++, k++) {
+        k = make_hot_key(key, k);
+        ht_remove(t, key);
+    }
+    ht_get_hash(t, "@", &count);
+    assert(count == N);
+    ht_stat(t, &allocated, &used);
+    assert(used < hot / 4);
+    for (i=0; i<N; i++) {
+        make_key(key, i, true);
+        assert(ht_lookup(t, key, strlen(key), &item) && ITEM_POS(&item) == make_pos(i));
+    }
+    ht_destroy(t);
+    unlink(path);
+    printf("sparse ok\n");
+}
+
+int main(int argc, char **argv)
+{
+    test_concurrent();
+    test_fingerprint();
+    test_merge();
+    test_arena();
+    test_hash();
+    test_freeze();
+    test_sparse();
+    return 0;
+}